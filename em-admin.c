@@ -39,17 +39,45 @@
 
 */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <ctype.h>
 #include <time.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <limits.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
 #include <syslog.h>
 #include <termios.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
 #include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+
+#include "em-frames.h"
+#include "em-readings.h"
 
 /* Do NOT change: */
 
@@ -96,6 +124,9 @@
 #define EM_FRAME_LONG		18
 
 #define MBUS_WAKEUP_TIME	3
+#define MBUS_RETRIES		2
+#define MBUS_TIMEOUT		1000		/* ms, meter fell silent */
+#define MBUS_DRAIN_GAP		50		/* ms, line idle after a broken frame */
 #define MBUS_WAKEUP_CHAR	0x55
 #define MBUS_FRAME_ACK		0xE5
 #define MBUS_FRAME_SHORT_START	0x10
@@ -108,10 +139,58 @@
 #define MBUS_FRAME_SHORT_HDR_LEN (1 + 1 + 1)			/* START C A */
 #define MBUS_FRAME_LONG_HDR_LEN	(4 + 1 + 1 + 1)			/* START C A CI */
 #define MBUS_FRAME_FTR_LEN	(1 + 1)				/* CHK STOP */
+#define MBUS_FRAME_MAX_LEN	(4 + 255 + MBUS_FRAME_FTR_LEN)	/* START L L START, up to 255 bytes C A CI data */
 #define MBUS_RSPUD12_HDR_LEN	(4 + 2 + 1 + 1 + 1 + 1 + 2)	/* AD MAN VER MED ACC STAT SIG */
+#define MBUS_MEDIUM_WARMWATER	0x06
+#define MBUS_MEDIUM_WATER	0x07
+#define MBUS_MEDIUM_COLDWATER	0x16
+#define MBUS_MANUFACTURER(a, b, c) ((((a) - 64) << 10) | (((b) - 64) << 5) | ((c) - 64))
 
 #define LOG_BUFSIZE		256
 
+#define SERIAL_URING_ENTRIES	4
+#define SERIAL_URING_BUFSIZE	4096		/* registered buffer, first half for writes */
+
+#define EM_MAX_PORTS		64		/* opto heads handled by supervisor mode */
+#define EM_PROBE_WINDOW		64		/* exchanges considered for link quality display */
+#define EM_PROBE_REWAKE		3		/* consecutive failures before waking up again */
+#define EM_ROUTE_STOPS		1024		/* meters per route file */
+#define EM_CLUSTER_WORKERS	64		/* workers connected to a coordinator */
+#define EM_CLUSTER_LINE		512		/* bytes per protocol line, limits the commands of a job */
+#define EM_CLUSTER_QUEUE	(2 * EM_MAX_PORTS)	/* jobs queued by a worker */
+#define EM_SCHED_ENTRIES	16		/* lines of a schedule file */
+#define EM_SCHED_CMDS		8		/* commands per schedule line */
+#define EM_SCHED_SLOTS		256		/* timing wheel slots of one second */
+
+#define EM_STATS_MAGIC		0x31534d45	/* "EMS1" */
+#define EM_STATS_HEADS		64
+#define EM_STATS_METERS		4096		/* power of two */
+
+#define EM_ANALYZE_PERIODS	30		/* readings per meter, end and middle of 15 months */
+#define EM_ANALYZE_THRESHOLD	5		/* minimum anomaly score to report */
+#define EM_ROLLOVER		100000000	/* l, counter wraps around */
+
+#define EM_SNAPSHOT_MAGIC	0x31504e53	/* "SNP1" */
+#define EM_PARAMS_LEN		20		/* parameter block as decoded by em_dump_settings */
+#define EM_TIME_REC_LEN		7		/* DIF VIF VIFE CP32 */
+#define EM_KEYDAY_REC_LEN	5		/* DIF VIF VIFE CP16 */
+#define EM_CLOCK_TOLERANCE	120		/* s, the meter clock has minute resolution */
+
+#define EM_LATENCY_MAGIC	0x314c4d45	/* "EML1" */
+#define EM_LATENCY_SLOTS	1024		/* (manufacturer, version, command), power of two */
+#define EM_LATENCY_BUCKETS	64
+#define EM_LATENCY_BUCKET	25		/* ms per histogram bucket */
+#define EM_LATENCY_WINDOW	512		/* samples per slot, older ones fade out */
+#define EM_LATENCY_MIN_SAMPLES	16		/* before the learned deadline is used */
+#define EM_LATENCY_PERCENTILE	99
+#define EM_LATENCY_MARGIN	100		/* ms added to the percentile */
+#define EM_LATENCY_MAX		3000		/* ms, longest first byte deadline */
+
+#define EM_RT_PRIORITY		50		/* SCHED_FIFO priority in real-time mode ($EM_RT) */
+#define EM_RT_SAMPLES		200		/* 1 ms sleeps to measure the scheduling latency */
+#define EM_RT_PREFAULT		(256 * 1024)	/* bytes of stack touched after locking memory */
+#define EM_RT_ALIGN_WAIT	8		/* s, longest wait for a minute boundary before set_time */
+
 /* Do change according to your needs: */
 
 #define EM_SET_FLAGS		( EM_ENA_RADIO_AVAIL | EM_ENA_RADIO_ON | EM_ENA_AES )
@@ -146,17 +225,210 @@
 #define EM_SET_KEYDAY_MONTH	10
 #define EM_SET_KEYDAY_DAY	3
 
+#define EM_SET_AES_TESTED	0		/* NOT TESTED, set to 1 if you know what you're doing */
+
+#define EM_READINGS_STALE	1000		/* ms a reading may stay locked before its writer is presumed dead */
+#define EM_CLAIM_STALE		1000		/* ms a table slot may stay half claimed before its claimer is presumed dead */
+
+#define EM_SNAPSHOT_FILE	"/var/tmp/em-admin.snapshot"	/* parameter archive, override with $EM_SNAPSHOT_FILE */
+#define EM_LATENCY_FILE		"/var/tmp/em-admin.latency"	/* response latencies, override with $EM_LATENCY_FILE */
+
+#define EM_EXPORT_PORT		9820		/* metrics exporter, listens on localhost */
+#define EM_EXPORT_HIGHRES_INTERVAL (30 * 60)	/* seconds between high resolution readings */
+#define EM_EXPORT_MONTHS_INTERVAL (24 * 60 * 60)	/* seconds between monthly readings */
+#define EM_EXPORT_RETRY_INTERVAL (5 * 60)	/* seconds to wait after a failed refresh */
+#define EM_EXPORT_BUDGET	64		/* requests per day, each one increments MBUS_ACCESSCOUNT */
+#define EM_EXPORT_BURST		3		/* requests the exporter may save up */
+
+#define EM_CLUSTER_PORT		9821		/* cluster coordinator, on loopback unless an address is given */
+#define EM_CLUSTER_PREFETCH	2		/* jobs a worker queues beyond its idle heads */
+#define EM_CLUSTER_ATTEMPTS	3		/* failed sessions before a job is given up */
+#define EM_CLUSTER_GRACE	(5 * 60)	/* seconds running jobs of a lost worker wait for it to reconnect */
+#define EM_CLUSTER_RETRY	5		/* seconds between reconnection attempts of a worker */
+
+#define EM_SCHED_JITTER		5		/* % of the interval added at random, keeps ports out of step */
+#define EM_SCHED_BATCH		10		/* % of the interval a job may run early to share a wakeup */
+#define EM_SCHED_RETRY		(5 * 60)	/* seconds to wait after a failed session */
+#define EM_SCHED_BUDGET		96		/* requests per meter and day, unless set in the schedule */
+#define EM_SCHED_BURST		8		/* requests a meter may save up */
+
+#define EM_ROUTE_DETECT_INTERVAL 1000		/* ms between wakeup attempts while waiting for the head */
+
+#define EM_FLOW_INTERVAL	1000		/* ms between high resolution readings in flow mode */
+#define EM_FLOW_DRAW		15		/* ml/s, flow of a draw (0.9 l/min) */
+#define EM_FLOW_DRAW_END	3		/* s below the draw flow ending a draw */
+#define EM_FLOW_QUIET		60		/* s without flow ending continuous flow */
+#define EM_FLOW_LEAK		600		/* s of continuous flow reported as a possible leak */
+
+#define EM_SNIFF_GAP		20		/* ms of silence ending a frame, a character takes 4.6 ms */
+#define EM_SNIFF_CHAR_US	4583		/* us per 11 bit character at 2400 baud */
+
+#define EM_IMPORT_CHUNK		(4 << 20)	/* bytes of log per work item of the importer */
+#define EM_IMPORT_TAGS		256		/* ports (log tags) told apart by the importer */
+
+#define EM_ARROW_BATCH		65536		/* rows per record batch of Arrow exports, multiple of 8 */
+#define EM_ARROW_ALIGN		64		/* buffer alignment in Arrow files, power of two */
+#define EM_ARROW_META		16384		/* bytes of flatbuffer metadata besides the footer blocks */
+
+#define EM_COVERAGE_BUCKETS	24		/* of the sliding window, counted per meter */
+#define EM_COVERAGE_WINDOW	24		/* h, default window */
+#define EM_COVERAGE_WINDOW_MAX	(62 * 24 * 60 * 60)	/* s */
+#define EM_COVERAGE_POOR	80		/* % of the expected telegrams, below is poor delivery */
+#define EM_COVERAGE_MIN_EXPECTED 8		/* telegrams expected before a meter is judged */
+#define EM_COVERAGE_TOP		20		/* meters listed in the final report */
+#define EM_COVERAGE_RESYNC	(24 * 3600000000ULL)	/* us, records further off the stream time are corrupt */
+
+
+struct mbus_stats {
+	unsigned long wakeups;
+	unsigned long requests;
+	unsigned long retries;
+	unsigned long timeouts;
+	unsigned long parity_errors;
+	unsigned long checksum_errors;
+	unsigned long framing_errors;		/* invalid start/stop bytes or length */
+	unsigned long bytes_out;
+	unsigned long bytes_in;
+};
+
+struct mbus_stats mbus_stats;
+
+/* Identification of the meter as seen in its last RSP_UD header */
+struct em_meter {
+	int valid;
+	uint32_t secadr;
+	uint16_t manufacturer;
+	uint8_t version;
+	uint8_t medium;
+	uint8_t accesscount;
+	uint8_t state;
+	int highres_valid;
+	uint32_t highres;			/* ml */
+	int months_valid;
+	uint16_t month_date[30];		/* end of months, then middle of months */
+	uint32_t month_value[30];		/* l */
+	int params_valid;
+	uint8_t params[EM_PARAMS_LEN];
+	int keyday_valid;
+	uint8_t keyday_day;
+	uint8_t keyday_month;
+	int clock_valid;
+	time_t clock;				/* meter time as if it were UTC */
+};
+
+struct em_meter em_meter;
+
+/* Known models, they share timing, frame layout and commands and only differ in the EM_MODEL_* flags */
+struct em_model {
+	const char *name;
+	uint8_t version_min;
+	uint8_t version_max;
+	uint32_t media;				/* bitmask of supported MBUS_MEDIUM_* */
+	unsigned int flags;			/* EM_MODEL_* */
+};
+
+#define EM_MODEL_DEFAULT	1		/* until the meter has answered */
+#define EM_MODEL_MULTIREC	(1 << 0)	/* accepts several records in one SND_UD */
+#define EM_MODEL_WATER		((1 << MBUS_MEDIUM_WARMWATER) | (1 << MBUS_MEDIUM_WATER) | (1 << MBUS_MEDIUM_COLDWATER))
+
+const struct em_model em_models[] = {
+	{	/* unknown meter, treated like a WaterStar M but without multi-record writes */
+		.name = "generic M-Bus", .version_min = 0, .version_max = 255, .media = ~0U,
+	}, {
+		.name = "Lorenz WaterStar M (DWZ)", .version_min = 0, .version_max = 255, .media = EM_MODEL_WATER,
+		.flags = EM_MODEL_MULTIREC,
+	}, {	/* untested, same hardware as DWZ */
+		.name = "Engelmann WaterStar M (EFE)", .version_min = 0, .version_max = 255, .media = EM_MODEL_WATER,
+		.flags = EM_MODEL_MULTIREC,
+	}, {	/* untested, same hardware as DWZ */
+		.name = "Brummerhoop WaterStar M (BHG)", .version_min = 0, .version_max = 255, .media = EM_MODEL_WATER,
+		.flags = EM_MODEL_MULTIREC,
+	},
+};
+
+/* Index into em_models by manufacturer code */
+const uint8_t em_model_index[1 << 15] = {
+	[MBUS_MANUFACTURER('D', 'W', 'Z')] = 1,
+	[MBUS_MANUFACTURER('E', 'F', 'E')] = 2,
+	[MBUS_MANUFACTURER('B', 'H', 'G')] = 3,
+};
+
+const struct em_model *em_model = &em_models[EM_MODEL_DEFAULT];
+unsigned char em_multirec_rejected[sizeof(em_models) / sizeof(em_models[0])];
+
+const struct em_model *em_model_lookup(const uint16_t manufacturer, const uint8_t version, const uint8_t medium) {
+	const struct em_model *m = &em_models[em_model_index[manufacturer & 0x7fff]];
+	if ((version < m->version_min) || (version > m->version_max) || (medium >= 32) || !(m->media & (1U << medium)))
+		return &em_models[0];
+	return m;
+}
+
+const char *log_tag = NULL;
+int log_prio = LOG_DEBUG;
+int serial_parmrk = 0;
 
 void log_line(int prio, const char *fmt, ...) {
 	va_list args;
 	va_start(args, fmt);
-	if (prio <= LOG_DEBUG) {
+	if (prio <= log_prio) {
+		if (log_tag) fprintf(stdout, "[%s] ", log_tag);
 		vfprintf(stdout, fmt, args);
 		fprintf(stdout, "\n");
 	}
 	va_end(args);
 }
 
+double em_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+   Slots of the shared tables are claimed by setting used from 0 to 1, then
+   2 once the key is in. Wait for a claim of another process to complete; a
+   claimer that died in between would leave 1 for good, its slot is marked
+   abandoned (3) so that nobody waits for it again.
+*/
+uint32_t em_claim_wait(uint32_t *used, uint32_t v) {
+	const double stale = em_now() + EM_CLAIM_STALE / 1000.0;
+
+	while (v == 1) {
+		if ((em_now() > stale) && __atomic_compare_exchange_n(used, &v, 3, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			log_line(LOG_WARNING, "Abandoning table slot of a dead process");
+			return 3;
+		}
+		sched_yield();
+		v = __atomic_load_n(used, __ATOMIC_ACQUIRE);
+	}
+	return v;
+}
+
+/* Token bucket of meter requests, every request increments MBUS_ACCESSCOUNT and costs battery */
+struct em_bucket {
+	double tokens;				/* requests left */
+	double time;				/* em_now() of the last refill, 0 if unused */
+};
+
+void em_bucket_refill(struct em_bucket *b, const double now, const double per_day, const double burst) {
+	b->tokens += (now - b->time) * per_day / (24 * 60 * 60);
+	if (b->tokens > burst)
+		b->tokens = burst;
+	b->time = now;
+}
+
+/* Seconds until cost requests may be spent, 0 if now; a cost above the burst only waits for a full bucket */
+double em_bucket_wait(const struct em_bucket *b, double cost, const double per_day, const double burst) {
+	if (cost > burst)
+		cost = burst;
+	return (b->tokens >= cost) ? 0 : (cost - b->tokens) * (24 * 60 * 60) / per_day;
+}
+
+char *em_datestr(char *data, const unsigned int date) {
+	sprintf(data, "%04d-%02d-%02d", 2000 + (date >> 9), (date >> 5) & 0b1111, date & 0b11111);
+	return data;
+}
+
 char *bitprint(char *data, const unsigned long val, const unsigned int len) {
 	for (unsigned int i = 0; i < len; i++)
 		data[i] = (val & (1 << (len - i - 1))) ? '1' : '0';
@@ -222,61 +494,579 @@ int serial_interface_attribs(int fd, int speed, int parity) {
 	tty.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
 	tty.c_oflag &= ~OPOST;
 
+	/* mark parity errors as 0xff 0x00 <char>, literal 0xff as 0xff 0xff */
+	if (parity)
+		tty.c_iflag |= (INPCK | PARMRK);
+	else
+		tty.c_iflag &= ~INPCK;
+	serial_parmrk = parity ? 1 : 0;
+
 	/* fetch bytes as they become available */
 	tty.c_cc[VMIN] = 1;
 	tty.c_cc[VTIME] = 1;
 
-	if (tcsetattr(fd, TCSANOW, &tty) != 0)
-		return -1;
+	if (tcsetattr(fd, TCSANOW, &tty) != 0) {
+		/* ptys do not emulate parity, allow testing against a simulated meter */
+		if (!parity || (errno != EINVAL))
+			return -1;
+		log_line(LOG_WARNING, "Serial port does not support parity, continuing without");
+		tty.c_cflag &= ~PARENB;
+		tty.c_iflag &= ~(INPCK | PARMRK);
+		serial_parmrk = 0;
+		if (tcsetattr(fd, TCSANOW, &tty) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Serial i/o backends, selected with $EM_IO_BACKEND. They only move raw bytes,
+ * reads return 0 when the deadline (CLOCK_MONOTONIC) passed without data.
+ */
+struct serial_backend {
+	const char *name;
+	int (*init)(void);
+	void (*release)(int fd);
+	ssize_t (*write)(int fd, const unsigned char *data, const size_t len);
+	ssize_t (*read)(int fd, unsigned char *data, const size_t len, const struct timespec *deadline);
+};
+
+int serial_timeout = MBUS_TIMEOUT;
+unsigned long serial_syscalls = 0;
+
+int em_rt = 0;
+double em_rt_late_max = 0;			/* s, timed out reads returning after their deadline */
+unsigned int em_rt_head = 0;			/* head slot of the session, selects its cpu */
+
+ssize_t serial_blocking_write(int fd, const unsigned char *data, const size_t len) {
+	serial_syscalls++;
+	return write(fd, data, len);
+}
+
+ssize_t serial_blocking_read(int fd, unsigned char *data, const size_t len, const struct timespec *deadline) {
+	struct timespec now;
+	fd_set fds;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long long ns = (deadline->tv_sec - now.tv_sec) * 1000000000LL + (deadline->tv_nsec - now.tv_nsec);
+	struct timeval tv = { (ns > 0) ? ns / 1000000000 : 0, (ns > 0) ? (ns % 1000000000) / 1000 : 0 };
 
+	FD_ZERO(&fds);
+	FD_SET(fd, &fds);
+	serial_syscalls++;
+	int r = select(fd + 1, &fds, NULL, NULL, &tv);
+	if (r <= 0)
+		return r ? -errno : 0;
+	serial_syscalls++;
+	ssize_t n = read(fd, data, len);
+	return (n < 0) ? -errno : n ? n : -EIO;
+}
+
+/* epoll with an absolute timerfd, the port stays registered until released */
+int serial_epfd = -1, serial_tfd = -1, serial_epoll_port = -1;
+struct timespec serial_armed;
+
+int serial_epoll_init(void) {
+	struct epoll_event ev = { .events = EPOLLIN, .data.fd = -1 };
+
+	if (((serial_epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) ||
+	    ((serial_tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK)) < 0) ||
+	    epoll_ctl(serial_epfd, EPOLL_CTL_ADD, serial_tfd, &ev))
+		return errno;
+	return 0;
+}
+
+void serial_epoll_release(int fd) {
+	if (fd != serial_epoll_port)
+		return;
+	epoll_ctl(serial_epfd, EPOLL_CTL_DEL, fd, NULL);
+	serial_epoll_port = -1;
+}
+
+ssize_t serial_epoll_read(int fd, unsigned char *data, const size_t len, const struct timespec *deadline) {
+	struct epoll_event ev;
+
+	if (fd != serial_epoll_port) {
+		struct epoll_event add = { .events = EPOLLIN, .data.fd = fd };
+		serial_epoll_release(serial_epoll_port);
+		serial_syscalls++;
+		if (epoll_ctl(serial_epfd, EPOLL_CTL_ADD, fd, &add) && (errno != EEXIST))
+			return -errno;
+		serial_epoll_port = fd;
+	}
+	/* the deadline is the same for all reads of a frame */
+	if ((deadline->tv_sec != serial_armed.tv_sec) || (deadline->tv_nsec != serial_armed.tv_nsec)) {
+		struct itimerspec its = { .it_value = *deadline };
+		serial_syscalls++;
+		if (timerfd_settime(serial_tfd, TFD_TIMER_ABSTIME, &its, NULL))
+			return -errno;
+		serial_armed = *deadline;
+	}
+	for (;;) {
+		serial_syscalls++;
+		int r = epoll_wait(serial_epfd, &ev, 1, -1);
+		if (r < 0)
+			return -errno;
+		if (ev.data.fd == fd)
+			break;
+		/* timer expired, unless it was re-armed meanwhile */
+		uint64_t ticks;
+		serial_syscalls++;
+		if (read(serial_tfd, &ticks, sizeof(ticks)) == sizeof(ticks)) {
+			serial_armed.tv_sec = serial_armed.tv_nsec = 0;
+			return 0;
+		}
+	}
+	serial_syscalls++;
+	ssize_t n = read(fd, data, len);
+	return (n < 0) ? ((errno == EAGAIN) ? 0 : -errno) : n ? n : -EIO;
+}
+
+/* io_uring via raw syscalls: fixed buffer reads with a linked absolute timeout */
+struct serial_uring {
+	int fd;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned char *buf;
+	int port;				/* made blocking */
+	int port_flags;				/* its file status flags before */
+} serial_uring = { .fd = -1, .port = -1 };
+
+int serial_uring_init(void) {
+	struct serial_uring *u = &serial_uring;
+	struct io_uring_params p = { 0 };
+	struct iovec iov;
+
+	if ((u->fd = syscall(__NR_io_uring_setup, SERIAL_URING_ENTRIES, &p)) < 0)
+		return errno;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+		return ENOTSUP;
+	size_t sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	size_t cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	unsigned char *sq = mmap(NULL, (sqlen > cqlen) ? sqlen : cqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	u->buf = mmap(NULL, SERIAL_URING_BUFSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if ((sq == MAP_FAILED) || (u->sqes == MAP_FAILED) || (u->buf == MAP_FAILED))
+		return errno;
+	u->sq_head = (unsigned int *) (sq + p.sq_off.head);
+	u->sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+	u->sq_mask = (unsigned int *) (sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned int *) (sq + p.sq_off.array);
+	u->cq_head = (unsigned int *) (sq + p.cq_off.head);
+	u->cq_tail = (unsigned int *) (sq + p.cq_off.tail);
+	u->cq_mask = (unsigned int *) (sq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *) (sq + p.cq_off.cqes);
+
+	iov.iov_base = u->buf;
+	iov.iov_len = SERIAL_URING_BUFSIZE;
+	if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS, &iov, 1))
+		return errno;
+	return 0;
+}
+
+struct io_uring_sqe *serial_uring_sqe(const unsigned char op, const int fd, const uint64_t user_data) {
+	struct serial_uring *u = &serial_uring;
+	unsigned int tail = *u->sq_tail, i = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[i];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->user_data = user_data;
+	u->sq_array[i] = i;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	return sqe;
+}
+
+/* Submit the queued entries and wait for as many completions, result of the one tagged 1 */
+int serial_uring_submit(const unsigned int n, int *res) {
+	struct serial_uring *u = &serial_uring;
+
+	serial_syscalls++;
+	if (syscall(__NR_io_uring_enter, u->fd, n, n, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+		return -errno;
+	for (unsigned int i = 0; i < n; ) {
+		unsigned int head = *u->cq_head;
+		if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+			serial_syscalls++;
+			if (syscall(__NR_io_uring_enter, u->fd, 0, n - i, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+				return -errno;
+			continue;
+		}
+		const struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+		if (cqe->user_data == 1)
+			*res = cqe->res;
+		__atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+		i++;
+	}
 	return 0;
 }
 
+ssize_t serial_uring_write(int fd, const unsigned char *data, const size_t len) {
+	const size_t max = SERIAL_URING_BUFSIZE / 2;
+	size_t p = 0;
+
+	while (p < len) {
+		size_t l = (len - p < max) ? len - p : max;
+		int res = -EIO, err;
+		memcpy(serial_uring.buf, data + p, l);
+		struct io_uring_sqe *sqe = serial_uring_sqe(IORING_OP_WRITE_FIXED, fd, 1);
+		sqe->addr = (uintptr_t) serial_uring.buf;
+		sqe->len = l;
+		sqe->buf_index = 0;
+		if ((err = serial_uring_submit(1, &res)) || (res < 0)) {
+			errno = -(err ? err : res);
+			return p ? (ssize_t) p : -1;
+		}
+		p += res;
+		if (!res)
+			break;
+	}
+	return p;
+}
+
+/* Give the port made blocking its flags back, they are shared with every process holding it */
+void serial_uring_release(int fd) {
+	if ((fd < 0) || (fd != serial_uring.port))
+		return;
+	serial_syscalls++;
+	if (fcntl(fd, F_SETFL, serial_uring.port_flags))
+		log_line(LOG_WARNING, "Failed to restore serial port flags: %s", strerror(errno));
+	serial_uring.port = -1;
+}
+
+ssize_t serial_uring_read(int fd, unsigned char *data, const size_t len, const struct timespec *deadline) {
+	/* non-blocking files fail with EAGAIN instead of waiting for data */
+	if (fd != serial_uring.port) {
+		serial_uring_release(serial_uring.port);
+		int flags = fcntl(fd, F_GETFL);
+		serial_syscalls += 2;
+		if ((flags < 0) || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK))
+			return -errno;
+		serial_uring.port = fd;
+		serial_uring.port_flags = flags;
+	}
+
+	struct __kernel_timespec ts = { deadline->tv_sec, deadline->tv_nsec };
+	const size_t l = (len < SERIAL_URING_BUFSIZE / 2) ? len : SERIAL_URING_BUFSIZE / 2;
+	unsigned char *buf = serial_uring.buf + SERIAL_URING_BUFSIZE / 2;
+	int res = -EIO, err;
+
+	struct io_uring_sqe *sqe = serial_uring_sqe(IORING_OP_READ_FIXED, fd, 1);
+	sqe->addr = (uintptr_t) buf;
+	sqe->len = l;
+	sqe->buf_index = 0;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe = serial_uring_sqe(IORING_OP_LINK_TIMEOUT, -1, 2);
+	sqe->addr = (uintptr_t) &ts;
+	sqe->len = 1;
+	sqe->timeout_flags = IORING_TIMEOUT_ABS;
+	if ((err = serial_uring_submit(2, &res))) {
+		serial_uring_release(fd);
+		return err;
+	}
+	if ((res == -ECANCELED) || (res == -EAGAIN))
+		return 0;
+	if (res <= 0) {
+		serial_uring_release(fd);
+		return res ? res : -EIO;
+	}
+	memcpy(data, buf, res);
+	return res;
+}
+
+void serial_release_none(int fd) {
+}
+
+const struct serial_backend serial_backends[] = {
+	{ "blocking", NULL, serial_release_none, serial_blocking_write, serial_blocking_read },
+	{ "epoll", serial_epoll_init, serial_epoll_release, serial_blocking_write, serial_epoll_read },
+	{ "io_uring", serial_uring_init, serial_uring_release, serial_uring_write, serial_uring_read },
+};
+
+const struct serial_backend *serial_io = &serial_backends[0];
+
+/* Switch to the named backend, falls back to blocking i/o if it is not available */
+int serial_backend_select(const char *name) {
+	for (unsigned int i = 0; i < sizeof(serial_backends) / sizeof(serial_backends[0]); i++) {
+		const struct serial_backend *b = &serial_backends[i];
+		if (strcmp(name, b->name))
+			continue;
+		int err = b->init ? b->init() : 0;
+		if (err) {
+			log_line(LOG_WARNING, "I/O backend %s not available (%s), using blocking i/o", name, strerror(err));
+			serial_io = &serial_backends[0];
+			return err;
+		}
+		serial_io = b;
+		return 0;
+	}
+	log_line(LOG_WARNING, "Unknown i/o backend '%s', using blocking i/o", name);
+	serial_io = &serial_backends[0];
+	return EINVAL;
+}
+
+void serial_close(int fd) {
+	serial_io->release(fd);
+	close(fd);
+}
+
 ssize_t serial_write(int fd, const unsigned char *data, const size_t len) {
 	char buf[LOG_BUFSIZE];
-	for (unsigned int i = 0; (i < len) && (i < (LOG_BUFSIZE / 3 - 1)); i++) {
-		sprintf(buf + (3 * i), "%02x ", data[i]);
+	if (log_prio >= LOG_DEBUG) {
+		for (unsigned int i = 0; (i < len) && (i < (LOG_BUFSIZE / 3 - 1)); i++) {
+			sprintf(buf + (3 * i), "%02x ", data[i]);
+		}
+		log_line(LOG_DEBUG, "UART>%03d> %s", len, buf);
 	}
-	log_line(LOG_DEBUG, "UART>%03d> %s", len, buf);
-	ssize_t n = write(fd, data, len);
+	ssize_t n = serial_io->write(fd, data, len);
+	if (n > 0) mbus_stats.bytes_out += n;
 	return n;
 }
 
-ssize_t serial_read(int fd, unsigned char *data, const size_t maxbytes) {
+/* Length of the M-Bus frame starting at data, 0 if not known (yet) */
+size_t mbus_framelen(const unsigned char *data, const size_t len) {
+	if (!len) return 0;
+	switch (data[0]) {
+	case MBUS_FRAME_ACK:
+		return 1;
+	case MBUS_FRAME_SHORT_START:
+		return MBUS_FRAME_SHORT_HDR_LEN + MBUS_FRAME_FTR_LEN;
+	case MBUS_FRAME_LONG_START:
+		return (len < 2) ? 0 : data[1] + 4 + MBUS_FRAME_FTR_LEN;
+	}
+	return 0;
+}
+
+void serial_deadline(struct timespec *deadline, const int ms) {
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += ms / 1000;
+	deadline->tv_nsec += (ms % 1000) * 1000000;
+	if (deadline->tv_nsec >= 1000000000) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+}
+
+/*
+ * Push parser of a long frame, fed the bytes as they arrive: the start header is rejected as
+ * soon as it is complete, each DIF/VIF record of a RSP_UD is handed to the callback once its
+ * data bytes are in and the checksum is kept running. Records arrive before the checksum is
+ * known, a negative result at the end invalidates them.
+ */
+struct mbus_record {
+	unsigned int index;
+	unsigned int offset;			/* of the DIF in the frame */
+	unsigned char dif;
+	unsigned char dife;			/* first DIFE, 0 if none */
+	unsigned char vif;
+	unsigned char vife;			/* first VIFE, 0 if none */
+	unsigned int df;			/* data field */
+	unsigned int sn;			/* storage number */
+	const unsigned char *data;
+	unsigned int len;
+};
+
+struct mbus_parser {
+	size_t pos;				/* bytes consumed */
+	size_t end;				/* frame length, 0 until the start header is in */
+	size_t rec;				/* next record, 0 if none (left) */
+	unsigned char cs;
+	unsigned int nrec;
+	void (*record)(const struct mbus_record *rec, void *ctx);
+	void *ctx;
+};
+
+void mbus_parse_reset(struct mbus_parser *ps) {
+	ps->pos = ps->end = ps->rec = 0;
+	ps->cs = 0;
+	ps->nrec = 0;
+}
+
+/* Hand over the next record if all its bytes (up to avail) are in, 0 to wait for more or if done */
+int mbus_parse_record(struct mbus_parser *ps, const unsigned char *data, const size_t avail) {
+	const unsigned char ldb[] = { 0, 1, 2, 3, 4, 4, 6, 8 };
+	struct mbus_record r = { .index = ps->nrec, .offset = ps->rec };
+	size_t q = ps->rec;
+
+	if (q >= avail)
+		goto more;
+	r.dif = data[q++];
+	r.df = r.dif & 0x0f;
+	/* variable length data, special functions and manufacturer data end the records we know */
+	if (r.df > 7) {
+		ps->rec = 0;
+		return 0;
+	}
+	for (unsigned int n = 0; data[q - 1] & 0x80; n++) {
+		if (q >= avail)
+			goto more;
+		if (!n) r.dife = data[q];
+		q++;
+	}
+	if (q >= avail)
+		goto more;
+	r.vif = data[q++];
+	for (unsigned int n = 0; data[q - 1] & 0x80; n++) {
+		if (q >= avail)
+			goto more;
+		if (!n) r.vife = data[q];
+		q++;
+	}
+	r.len = ldb[r.df];
+	if (q + r.len > avail)
+		goto more;
+	r.data = data + q;
+	r.sn = (r.dif & 0x40) >> 6 | (r.dife & 0x0f) << 1;
+	ps->rec = q + r.len;
+	ps->nrec++;
+	ps->record(&r, ps->ctx);
+	return 1;
+
+ more:
+	/* all data bytes are in, the record is cut off */
+	if (avail == ps->end - MBUS_FRAME_FTR_LEN)
+		ps->rec = 0;
+	return 0;
+}
+
+/* Consume data[pos..len), the frame length once complete, 0 if incomplete or -EPROTO */
+ssize_t mbus_parse(struct mbus_parser *ps, const unsigned char *data, const size_t len) {
+	ssize_t ret = 0;
+
+	while (!ret && (ps->pos < len)) {
+		const size_t i = ps->pos++;
+		if ((i == 0) && (data[0] != MBUS_FRAME_LONG_START)) {
+			log_line(LOG_ERR, "M-Bus long frame: Invalid start 0x%02x", data[0]);
+			mbus_stats.framing_errors++;
+			ret = -EPROTO;
+		} else if (i == 3) {
+			if ((data[3] != MBUS_FRAME_LONG_START) || (data[1] != data[2]) || (data[1] < 3)) {
+				log_line(LOG_ERR, "M-Bus long frame: Invalid start header");
+				mbus_stats.framing_errors++;
+				ret = -EPROTO;
+			}
+			ps->end = data[1] + 4 + MBUS_FRAME_FTR_LEN;
+		} else if (i < 4) {
+			continue;
+		} else if (i < ps->end - MBUS_FRAME_FTR_LEN) {
+			ps->cs += data[i];
+			if ((i == MBUS_FRAME_LONG_HDR_LEN + MBUS_RSPUD12_HDR_LEN - 1) && (data[6] == MBUS_CI_RSPUD12))
+				ps->rec = i + 1;
+		} else if (i == ps->end - MBUS_FRAME_FTR_LEN) {
+			if (data[i] != ps->cs) {
+				log_line(LOG_ERR, "M-Bus long frame: Invalid checksum");
+				mbus_stats.checksum_errors++;
+				ret = -EPROTO;
+			}
+		} else if (data[i] != MBUS_FRAME_STOP) {
+			log_line(LOG_ERR, "M-Bus long frame: Invalid stop header");
+			mbus_stats.framing_errors++;
+			ret = -EPROTO;
+		} else {
+			ret = ps->end;
+		}
+	}
+	if ((ret >= 0) && ps->record) {
+		const size_t avail = (ps->pos < ps->end - MBUS_FRAME_FTR_LEN) ? ps->pos : ps->end - MBUS_FRAME_FTR_LEN;
+		while (ps->rec && mbus_parse_record(ps, data, avail));
+	}
+	return ret;
+}
+
+/*
+ * Read until a complete M-Bus frame arrived, maxbytes were read or the meter fell silent:
+ * no first byte within first_ms, or no complete frame serial_timeout after it.
+ * Stores the first byte latency (s) if latency is given. A parser, if given, sees every read
+ * and ends it as soon as the frame is complete or broken (-EPROTO).
+ */
+ssize_t serial_read_deadline(int fd, unsigned char *data, const size_t maxbytes, const int first_ms, double *latency,
+			     struct mbus_parser *parser) {
 	char buf[LOG_BUFSIZE];
-	fd_set serial_read_fds;
-	struct timeval serial_timeout;
+	unsigned char raw[LOG_BUFSIZE];
+	struct timespec deadline;
+	unsigned int mark = 0;
+	ssize_t parsed = 0;
 	size_t p = 0;
+	double t0 = em_now();
 
-	FD_ZERO(&serial_read_fds);
-	FD_SET(fd, &serial_read_fds);
-	serial_timeout.tv_sec = 1;
-	serial_timeout.tv_usec = 0;
-
+	serial_deadline(&deadline, first_ms);
 	while (p < maxbytes) {
-		if (select(fd + 1, &serial_read_fds, NULL, NULL, &serial_timeout) == 1) {
-			p += read(fd, data + p, maxbytes - p);
-		} else {
+		ssize_t n = serial_io->read(fd, raw, (maxbytes - p) < sizeof(raw) ? (maxbytes - p) : sizeof(raw), &deadline);
+		if (n <= 0)
 			break;
+		if (!p && !mark) {
+			if (latency)
+				*latency = em_now() - t0;
+			serial_deadline(&deadline, serial_timeout);
 		}
+		mbus_stats.bytes_in += n;
+		for (ssize_t i = 0; i < n; i++) {
+			if (serial_parmrk) {
+				if (!mark && (raw[i] == 0xff)) {
+					mark = 1;
+					continue;
+				}
+				if (mark == 1) {
+					mark = (raw[i] == 0xff) ? 0 : 2;
+					if (mark) continue;
+				} else if (mark == 2) {
+					mbus_stats.parity_errors++;
+					mark = 0;
+				}
+			}
+			data[p++] = raw[i];
+		}
+		if (parser && (parsed = mbus_parse(parser, data, p)))
+			break;
+		size_t fl = mbus_framelen(data, p);
+		if (fl && (p >= fl))
+			break;
 	}
 
 	if (!p) {
+		if (em_rt) {
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			double late = (now.tv_sec - deadline.tv_sec) + (now.tv_nsec - deadline.tv_nsec) / 1e9;
+			if (late > em_rt_late_max)
+				em_rt_late_max = late;
+		}
+		mbus_stats.timeouts++;
 		log_line(LOG_DEBUG, "UART< (read timeout)");
 		return -EIO;
 	}
 
-	for (size_t i = 0; i < p; i++) {
-		if ((3 * (i + 1) + 32) >= LOG_BUFSIZE) {
-			sprintf(buf + (3 * i), "(%ld bytes not shown)", p - i);
-			break;
+	if (log_prio >= LOG_DEBUG) {
+		for (size_t i = 0; i < p; i++) {
+			if ((3 * (i + 1) + 32) >= LOG_BUFSIZE) {
+				sprintf(buf + (3 * i), "(%ld bytes not shown)", p - i);
+				break;
+			}
+			sprintf(buf + (3 * i), "%02x ", data[i]);
 		}
-		sprintf(buf + (3 * i), "%02x ", data[i]);
+		log_line(LOG_DEBUG, "UART<%03d< %s", p, buf);
+	}
+	if (parsed < 0) {
+		/* the rest of the broken frame must not end up in the next exchange */
+		ssize_t n;
+		do {
+			serial_deadline(&deadline, MBUS_DRAIN_GAP);
+			if ((n = serial_io->read(fd, raw, sizeof(raw), &deadline)) > 0)
+				mbus_stats.bytes_in += n;
+		} while (n > 0);
+		return parsed;
 	}
-	log_line(LOG_DEBUG, "UART<%03d< %s", p, buf);
 	return p;
 }
 
+ssize_t serial_read(int fd, unsigned char *data, const size_t maxbytes) {
+	return serial_read_deadline(fd, data, maxbytes, serial_timeout, NULL, NULL);
+}
+
 unsigned char mbus_cslong(const unsigned char *frame, const size_t len) {
 	unsigned char cs = 0;
 	for (unsigned int i = 4; i < (len - 2); i++)
@@ -288,27 +1078,33 @@ int mbus_checklong(const unsigned char *data, const size_t len) {
 	unsigned char ll;
 	if (len < (MBUS_FRAME_LONG_HDR_LEN + MBUS_FRAME_FTR_LEN)) {
 		log_line(LOG_ERR, "M-Bus long frame: Too small");
+		mbus_stats.framing_errors++;
 		return 0;
 	}
 	if ((data[0] != MBUS_FRAME_LONG_START) || (data[3] != MBUS_FRAME_LONG_START)) {
 		log_line(LOG_ERR, "M-Bus long frame: Invalid start header");
+		mbus_stats.framing_errors++;
 		return 0;
 	}
 	if (data[1] != data[2]) {
 		log_line(LOG_ERR, "M-Bus long frame: Mismatching length info");
+		mbus_stats.framing_errors++;
 		return 0;
 	}
 	ll = data[1] + 4 + MBUS_FRAME_FTR_LEN;
 	if (ll > len) {
 		log_line(LOG_ERR, "M-Bus long frame: Frame length %d exceeds buffer size %d", ll, len);
+		mbus_stats.framing_errors++;
 		return 0;
 	}
 	if (data[ll - 1] != MBUS_FRAME_STOP) {
 		log_line(LOG_ERR, "M-Bus long frame: Invalid stop header");
+		mbus_stats.framing_errors++;
 		return 0;
 	}
 	if (mbus_cslong(data, ll) != data[ll - MBUS_FRAME_FTR_LEN]) {
 		log_line(LOG_ERR, "M-Bus long frame: Invalid checksum");
+		mbus_stats.checksum_errors++;
 		return 0;
 	}
 	/* EN1434-3 Dedicated Application Layer, Chapter 3 */
@@ -316,6 +1112,14 @@ int mbus_checklong(const unsigned char *data, const size_t len) {
 	log_line(LOG_INFO, "MBUS_ADR: %d", data[5]);
 	log_line(LOG_INFO, "MBUS_CI: 0x%02x", data[6]);
 	if (data[6] == MBUS_CI_RSPUD12) {
+		em_meter.valid = 1;
+		em_meter.secadr = data[10] << 24 | data[9] << 16 | data[8] << 8 | data[7];
+		em_meter.manufacturer = data[12] << 8 | data[11];
+		em_meter.version = data[13];
+		em_meter.medium = data[14];
+		em_meter.accesscount = data[15];
+		em_meter.state = data[16];
+		em_model = em_model_lookup(em_meter.manufacturer, em_meter.version, em_meter.medium);
 		log_line(LOG_INFO, "MBUS_SECADR: 0x%02x%02x%02x%02x", data[10], data[9], data[8], data[7]);
 		log_line(LOG_INFO, "MBUS_MANUFACTURER: 0x%02X%02X (%c%c%c)", data[12], data[11],
 			 64 + ((data[12] & 0b1111100) >> 2),
@@ -326,6 +1130,7 @@ int mbus_checklong(const unsigned char *data, const size_t len) {
 		log_line(LOG_INFO, "MBUS_ACCESSCOUNT: %d", data[15]);
 		log_line(LOG_INFO, "MBUS_STATE: 0x%02x", data[16]);
 		log_line(LOG_INFO, "MBUS_SIGNATURE: 0x%02X%02X", data[18], data[17]);
+		log_line(LOG_INFO, "EM_MODEL: %s", em_model->name);
 	}
 	return ll;
 }
@@ -333,18 +1138,22 @@ int mbus_checklong(const unsigned char *data, const size_t len) {
 int mbus_checkshort(const unsigned char *data, const size_t len) {
 	if (len < (MBUS_FRAME_SHORT_HDR_LEN + MBUS_FRAME_FTR_LEN)) {
 		log_line(LOG_ERR, "M-Bus short frame: Too small");
+		mbus_stats.framing_errors++;
 		return 0;
 	}
 	if (data[0] != MBUS_FRAME_SHORT_START) {
 		log_line(LOG_ERR, "M-Bus short frame: Invalid start header");
+		mbus_stats.framing_errors++;
 		return 0;
 	}
 	if (data[MBUS_FRAME_SHORT_HDR_LEN + MBUS_FRAME_FTR_LEN - 1] != MBUS_FRAME_STOP) {
 		log_line(LOG_ERR, "M-Bus short frame: Invalid stop header");
+		mbus_stats.framing_errors++;
 		return 0;
 	}
 	if ((unsigned char)(data[1] + data[2]) != data[MBUS_FRAME_SHORT_HDR_LEN]) {
 		log_line(LOG_ERR, "M-Bus short frame: Invalid checksum");
+		mbus_stats.checksum_errors++;
 		return 0;
 	}
 
@@ -353,7 +1162,179 @@ int mbus_checkshort(const unsigned char *data, const size_t len) {
 	return MBUS_FRAME_SHORT_HDR_LEN + MBUS_FRAME_FTR_LEN;
 }
 
-ssize_t mbus_io(int fd, unsigned char *out, const size_t outlen, unsigned char *in, size_t inlen) {
+struct em_latency_slot {
+	uint32_t used;				/* see em_claim_wait() */
+	uint32_t fail;				/* timeout rate per mille, EWMA over ~16 requests */
+	uint64_t key;				/* manufacturer << 48 | version << 40 | command */
+	uint32_t samples;
+	uint32_t hist[EM_LATENCY_BUCKETS];	/* first byte latency */
+};
+
+struct em_latency {
+	uint32_t magic;
+	uint32_t size;
+	struct em_latency_slot slot[EM_LATENCY_SLOTS];
+};
+
+struct em_latency *em_latency_map(const char *path, const int create) {
+	struct em_latency *t;
+	struct stat sb;
+	int fd = open(path, create ? (O_RDWR | O_CREAT | O_CLOEXEC) : (O_RDONLY | O_CLOEXEC), 0644);
+
+	if (fd < 0) {
+		log_line(create ? LOG_WARNING : LOG_ERR, "Failed to open latency table '%s': %s", path, strerror(errno));
+		return NULL;
+	}
+	if (fstat(fd, &sb) || ((sb.st_size < sizeof(*t)) && (!create || ftruncate(fd, sizeof(*t))))) {
+		log_line(LOG_ERR, "Invalid latency table '%s'", path);
+		close(fd);
+		return NULL;
+	}
+	t = mmap(NULL, sizeof(*t), create ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (t == MAP_FAILED) {
+		log_line(LOG_WARNING, "Failed to map latency table '%s': %s", path, strerror(errno));
+		return NULL;
+	}
+	if (create && !t->magic) {
+		t->size = sizeof(*t);
+		__atomic_store_n(&t->magic, EM_LATENCY_MAGIC, __ATOMIC_RELEASE);
+	}
+	if ((t->magic != EM_LATENCY_MAGIC) || (t->size != sizeof(*t))) {
+		log_line(LOG_ERR, "Incompatible latency table '%s'", path);
+		munmap(t, sizeof(*t));
+		return NULL;
+	}
+	return t;
+}
+
+/* Mapped on first use and kept for the life of the process, NULL if disabled */
+struct em_latency *em_latency_table(void) {
+	static struct em_latency *t = NULL;
+	static int failed = 0;
+	const char *path = getenv("EM_LATENCY_FILE") ? getenv("EM_LATENCY_FILE") : EM_LATENCY_FILE;
+
+	if (!t && !failed && !(failed = !path[0]))
+		failed = !(t = em_latency_map(path, 1));
+	return t;
+}
+
+/*
+   Slot of the meter model and the request, claimed as in em_stats_slot. The
+   model is the identified one, else taken from a complete RSP_UD header in
+   the response (in, len) so the first exchange of a session is not learned
+   under an unknown meter. NULL if neither is known.
+*/
+struct em_latency_slot *em_latency_slot(const unsigned char *out, const size_t outlen, const unsigned char *in, const ssize_t len) {
+	const size_t hdr = MBUS_FRAME_LONG_HDR_LEN + MBUS_RSPUD12_HDR_LEN;
+	struct em_latency *t;
+	uint16_t manufacturer;
+	uint8_t version;
+	uint32_t cmd;
+
+	if (em_meter.valid) {
+		manufacturer = em_meter.manufacturer;
+		version = em_meter.version;
+	} else if (in && (len >= (ssize_t) (hdr + MBUS_FRAME_FTR_LEN)) && (in[0] == MBUS_FRAME_LONG_START) &&
+		   (in[1] == in[2]) && (len >= in[1] + 4 + MBUS_FRAME_FTR_LEN) && (in[6] == MBUS_CI_RSPUD12) &&
+		   (mbus_cslong(in, in[1] + 4 + MBUS_FRAME_FTR_LEN) == in[in[1] + 4])) {
+		manufacturer = in[12] << 8 | in[11];
+		version = in[13];
+	} else {
+		return NULL;
+	}
+	if (!(t = em_latency_table()))
+		return NULL;
+	if (out[0] == MBUS_FRAME_SHORT_START)
+		cmd = out[1] & ~0x20;		/* without FCB */
+	else
+		cmd = out[6] << 16 | ((outlen > 9) ? out[7] << 8 : 0) | ((outlen > 10) ? out[8] : 0);
+	const uint64_t key = (uint64_t) manufacturer << 48 | (uint64_t) version << 40 | cmd;
+
+	uint32_t h = (key ^ key >> 32) * 2654435761u;
+	for (unsigned int i = 0; i < EM_LATENCY_SLOTS; i++, h++) {
+		struct em_latency_slot *slot = &t->slot[h & (EM_LATENCY_SLOTS - 1)];
+		uint32_t used = __atomic_load_n(&slot->used, __ATOMIC_ACQUIRE);
+		if (!used && __atomic_compare_exchange_n(&slot->used, &used, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			slot->key = key;
+			__atomic_store_n(&slot->used, 2, __ATOMIC_RELEASE);
+			return slot;
+		}
+		used = em_claim_wait(&slot->used, used);
+		if ((used == 2) && (slot->key == key))
+			return slot;
+	}
+	return NULL;
+}
+
+/* First byte deadline (ms): high percentile of the learned latencies plus a margin, widened by timeouts */
+int em_latency_deadline(const struct em_latency_slot *slot) {
+	uint32_t samples = slot ? __atomic_load_n(&slot->samples, __ATOMIC_RELAXED) : 0, sum = 0;
+	unsigned int b;
+
+	if (samples < EM_LATENCY_MIN_SAMPLES)
+		return serial_timeout;
+	for (b = 0; b < EM_LATENCY_BUCKETS - 1; b++)
+		if ((sum += slot->hist[b]) * 100 >= (uint64_t) samples * EM_LATENCY_PERCENTILE)
+			break;
+	int ms = (b + 1) * EM_LATENCY_BUCKET + EM_LATENCY_MARGIN;
+	ms += ms * slot->fail / 250;		/* doubled at 25 % timeouts */
+	return (ms < EM_LATENCY_MAX) ? ms : EM_LATENCY_MAX;
+}
+
+/* Timeouts only count as a (censored) sample if the deadline was a learned one */
+void em_latency_add(struct em_latency_slot *slot, const double latency, const int timeout, const int learned) {
+	unsigned int b = latency * 1000 / EM_LATENCY_BUCKET;
+
+	if (!slot)
+		return;
+	slot->fail = (slot->fail * 15 + (timeout ? 1000 : 0)) / 16;
+	if (timeout && !learned)
+		return;
+	if (timeout)
+		b++;
+	if (b >= EM_LATENCY_BUCKETS)
+		b = EM_LATENCY_BUCKETS - 1;
+	/* age: halve the histogram, concurrent sessions may lose a sample meanwhile */
+	if (__atomic_add_fetch(&slot->samples, 1, __ATOMIC_RELAXED) > EM_LATENCY_WINDOW) {
+		uint32_t n = 0;
+		for (unsigned int i = 0; i < EM_LATENCY_BUCKETS; i++)
+			n += (slot->hist[i] /= 2);
+		slot->samples = n + 1;
+	}
+	__atomic_add_fetch(&slot->hist[b], 1, __ATOMIC_RELAXED);
+}
+
+int em_latency_report(const char *path) {
+	struct em_latency *t = em_latency_map(path, 0);
+
+	if (!t)
+		return 1;
+	log_line(LOG_INFO, "%-5s %3s %-8s %7s %6s %6s %6s %6s", "MANUF", "VER", "COMMAND", "SAMPLES", "P50", "P99", "TMOUT", "DEADLINE");
+	for (unsigned int i = 0; i < EM_LATENCY_SLOTS; i++) {
+		const struct em_latency_slot *slot = &t->slot[i];
+		unsigned int b, p50 = 0, sum = 0;
+		if (slot->used != 2) continue;
+		for (b = 0; b < EM_LATENCY_BUCKETS - 1; b++) {
+			sum += slot->hist[b];
+			if (!p50 && (sum * 2 >= slot->samples))
+				p50 = (b + 1) * EM_LATENCY_BUCKET;
+			if (sum * 100 >= slot->samples * EM_LATENCY_PERCENTILE)
+				break;
+		}
+		const uint16_t m = slot->key >> 48;
+		log_line(LOG_INFO, "%c%c%c   %3u %06x   %7u %4u ms %4u ms %3u.%u%% %5d ms", ((m >> 10) & 0x1f) + 64,
+			 ((m >> 5) & 0x1f) + 64, (m & 0x1f) + 64, (unsigned int) (slot->key >> 40) & 0xff,
+			 (unsigned int) slot->key & 0xffffff, slot->samples, p50 ? p50 : (b + 1) * EM_LATENCY_BUCKET,
+			 (b + 1) * EM_LATENCY_BUCKET, slot->fail / 10, slot->fail % 10, em_latency_deadline(slot));
+	}
+	munmap(t, sizeof(*t));
+	return 0;
+}
+
+/* Exchange with retries, the response is parsed while it arrives if a parser is given */
+ssize_t mbus_io_parse(int fd, unsigned char *out, const size_t outlen, unsigned char *in, size_t inlen,
+		      struct mbus_parser *parser) {
 	if ((outlen == (MBUS_FRAME_SHORT_HDR_LEN + MBUS_FRAME_FTR_LEN)) && (out[0] == MBUS_FRAME_SHORT_START)) {
 		out[outlen - MBUS_FRAME_FTR_LEN] = out[1] + out[2];
 		if (!mbus_checkshort(out, outlen)) return -EPROTO;
@@ -363,8 +1344,38 @@ ssize_t mbus_io(int fd, unsigned char *out, const size_t outlen, unsigned char *
 	} else {
 		return -EPROTO;
 	}
-	serial_write(fd, out, outlen);
-	return serial_read(fd, in, inlen);
+	struct em_latency_slot *slot = em_latency_slot(out, outlen, NULL, 0);
+	const int learned = slot && (slot->samples >= EM_LATENCY_MIN_SAMPLES);
+	const int write = (out[0] == MBUS_FRAME_LONG_START) && (out[4] == MBUS_C_SND_UD);
+	int deadline = em_latency_deadline(slot);
+	/* a write is not idempotent, a lost response must not apply it twice, nor time out early */
+	const unsigned int retries = write ? 0 : MBUS_RETRIES;
+	if (write && (deadline < serial_timeout))
+		deadline = serial_timeout;
+	ssize_t len = -EIO;
+	for (unsigned int i = 0; (len == -EIO) && (i <= retries); i++) {
+		/* a retry waits twice as long */
+		const int first_ms = ((deadline << i) < EM_LATENCY_MAX) ? (deadline << i) : EM_LATENCY_MAX;
+		double latency = 0;
+		if (i) {
+			log_line(LOG_WARNING, "M-Bus retry %d", i);
+			mbus_stats.retries++;
+			tcflush(fd, TCIFLUSH);
+		}
+		mbus_stats.requests++;
+		serial_write(fd, out, outlen);
+		if (parser)
+			mbus_parse_reset(parser);
+		len = serial_read_deadline(fd, in, inlen, first_ms, &latency, parser);
+		if (!slot && (len > 0))
+			slot = em_latency_slot(out, outlen, in, len);
+		em_latency_add(slot, (len == -EIO) ? first_ms / 1000.0 : latency, len == -EIO, learned);
+	}
+	return len;
+}
+
+ssize_t mbus_io(int fd, unsigned char *out, const size_t outlen, unsigned char *in, size_t inlen) {
+	return mbus_io_parse(fd, out, outlen, in, inlen, NULL);
 }
 
 ssize_t mbus_io_acked(int fd, unsigned char *out, const size_t outlen) {
@@ -388,69 +1399,113 @@ void mbus_wakeup(int fd) {
 	unsigned char frame_out[25];
 	memset(frame_out, MBUS_WAKEUP_CHAR, sizeof(frame_out));
 	log_line(LOG_INFO, "Sending wakeup bytes");
+	mbus_stats.wakeups++;
 	for (unsigned int i = 0; i < 20; i++)
 		serial_write(fd, frame_out, sizeof(frame_out));
 }
 
-int em_set_time(int fd) {
-	time_t rawtime;
-	struct tm *timeinfo;
-	time(&rawtime);
-	timeinfo = localtime(&rawtime);
+/* Local standard (no DST) time as expected by the meter, returned in seconds as if it were UTC */
+time_t em_std_clock(struct tm *tm) {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);	/* time() is a tick behind, too late after a minute boundary */
+	time_t rawtime = now.tv_sec;
+	localtime_r(&rawtime, tm);
 	/* Device time is supposed to be standard (no DST) time */
-	if (timeinfo->tm_isdst > 0) {
+	if (tm->tm_isdst > 0) {
 		rawtime -= 60 * 60;		/* this is might be wrong somewhere on the planet */
-		timeinfo = localtime(&rawtime);
+		localtime_r(&rawtime, tm);
 	}
+	struct tm t = *tm;
+	return timegm(&t);
+}
 
-	log_line(LOG_INFO,
-		 "Setting device time to: %02d.%02d.%d %02d:%02d (no DST)",
-		 timeinfo->tm_mday, timeinfo->tm_mon + 1,
-		 timeinfo->tm_year + 1900, timeinfo->tm_hour, timeinfo->tm_min);
+void em_time_record(unsigned char *rec, const struct tm *tm) {
+	rec[0] = 0x04;				/* DIF, VIF, VIFE: set time */
+	rec[1] = 0xed;
+	rec[2] = 0x00;
+	rec[3] = tm->tm_min;			/* 4 bytes CP32 "F" type time and date */
+	rec[4] = tm->tm_hour;
+	rec[5] = (((tm->tm_year + 1900 - 2000) & 0b00000111) << 5) | tm->tm_mday;
+	rec[6] = (((tm->tm_year + 1900 - 2000) & 0b01111000) << 1) | (tm->tm_mon + 1);
+}
 
-	unsigned char frame_out[] = {
+void em_keyday_record(unsigned char *rec, const unsigned int day, const unsigned int month) {
+	rec[0] = 0x02;				/* DIF, VIF: set key date */
+	rec[1] = 0xec;
+	rec[2] = 0x00;				/* Unknown or reserved */
+	rec[3] = day | 0b11100000;
+	rec[4] = month | 0b11110000;
+}
+
+/* Send data records, several of them in one frame if the meter accepts it */
+int em_snd_ud(int fd, const unsigned char *recs, const size_t len) {
+	unsigned char frame_out[MBUS_FRAME_LONG_HDR_LEN + EM_TIME_REC_LEN + EM_KEYDAY_REC_LEN + MBUS_FRAME_FTR_LEN] = {
 		MBUS_FRAME_LONG_START,
-		10,				/* Frame length */
-		10,				/* Frame length */
+		3 + len,			/* Frame length */
+		3 + len,			/* Frame length */
 		MBUS_FRAME_LONG_START,
 		MBUS_C_SND_UD,			/* Control */
 		254,				/* Address */
 		MBUS_CI_DATA_SEND,		/* Control info */
-		0x04, 0xed, 0x00,		/* DIF, VIF, VIFE: set time */
-		timeinfo->tm_min,		/* 4 bytes CP32 "F" type time and date */
-		timeinfo->tm_hour,
-		((((timeinfo->tm_year + 1900 - 2000) & 0b00000111) << 5) | timeinfo->tm_mday),
-		((((timeinfo->tm_year + 1900 - 2000) & 0b01111000) << 1) | (timeinfo->tm_mon + 1)),
-		0x00,				/* Checksum */
-		MBUS_FRAME_STOP
 	};
 
-	return mbus_io_acked(fd, frame_out, sizeof(frame_out));
+	if (len > sizeof(frame_out) - MBUS_FRAME_LONG_HDR_LEN - MBUS_FRAME_FTR_LEN)
+		return EMSGSIZE;
+	memcpy(frame_out + MBUS_FRAME_LONG_HDR_LEN, recs, len);
+	frame_out[MBUS_FRAME_LONG_HDR_LEN + len] = 0x00;	/* Checksum */
+	frame_out[MBUS_FRAME_LONG_HDR_LEN + len + 1] = MBUS_FRAME_STOP;
+	return mbus_io_acked(fd, frame_out, MBUS_FRAME_LONG_HDR_LEN + len + MBUS_FRAME_FTR_LEN);
 }
 
-int em_set_keyday(int fd) {
-	unsigned char frame_out[] = {
-		MBUS_FRAME_LONG_START,
-		8,				/* Frame length */
-		8,				/* Frame length */
-		MBUS_FRAME_LONG_START,
-		MBUS_C_SND_UD,			/* Control */
-		254,				/* Address */
-		MBUS_CI_DATA_SEND,		/* Control info */
-		0x02, 0xec,			/* DIF, VIF: set key date */
-		0x00,				/* Unknown or reserved */
-		(EM_SET_KEYDAY_DAY | 0b11100000),
-		(EM_SET_KEYDAY_MONTH | 0b11110000),
-		0x00,				/* Checksum */
-		MBUS_FRAME_STOP
-	};
+/* In real-time mode, wait for the next minute if it is close: the meter clock has no seconds */
+void em_rt_align_minute(void) {
+	struct timespec now, at = { 0, 0 };
+
+	if (!em_rt)
+		return;
+	clock_gettime(CLOCK_REALTIME, &now);
+	at.tv_sec = now.tv_sec - (now.tv_sec % 60) + 60;
+	double wait = (at.tv_sec - now.tv_sec) - now.tv_nsec / 1e9;
+	if (wait > EM_RT_ALIGN_WAIT) {
+		log_line(LOG_INFO, "Next minute in %.0f s, not waiting for it", wait);
+		return;
+	}
+	log_line(LOG_INFO, "Waiting %.3f s for the next minute", wait);
+	while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &at, NULL) == EINTR)
+		;
+}
+
+int em_set_time(int fd) {
+	unsigned char rec[EM_TIME_REC_LEN];
+	struct tm tm;
+
+	em_rt_align_minute();
+	em_std_clock(&tm);
+	log_line(LOG_INFO,
+		 "Setting device time to: %02d.%02d.%d %02d:%02d (no DST)",
+		 tm.tm_mday, tm.tm_mon + 1, tm.tm_year + 1900, tm.tm_hour, tm.tm_min);
+
+	em_time_record(rec, &tm);
+	return em_snd_ud(fd, rec, sizeof(rec));
+}
+
+int em_set_keyday_date(int fd, const unsigned int day, const unsigned int month) {
+	unsigned char rec[EM_KEYDAY_REC_LEN];
 
 	log_line(LOG_INFO, "Setting keydate");
-	return mbus_io_acked(fd, frame_out, sizeof(frame_out));
+	em_keyday_record(rec, day, month);
+	return em_snd_ud(fd, rec, sizeof(rec));
 }
 
-int em_read_info(int fd) {
-	unsigned char frame_in[256];
+int em_set_keyday(int fd) {
+	return em_set_keyday_date(fd, EM_SET_KEYDAY_DAY, EM_SET_KEYDAY_MONTH);
+}
+
+int em_read_info(int fd);
+
+/* Read the meter header unless this session has seen it already, em_model follows it */
+int em_identify(int fd) {
+	unsigned char frame_in[MBUS_FRAME_MAX_LEN];
 	unsigned char frame_out[] = {
 		MBUS_FRAME_SHORT_START,
 		MBUS_C_REQ_UD2,			/* Control */
@@ -459,67 +1514,156 @@ int em_read_info(int fd) {
 		MBUS_FRAME_STOP
 	};
 
-	log_line(LOG_INFO, "Reading info");
+	if (em_meter.valid)
+		return 0;
+	log_line(LOG_INFO, "Identifying meter");
 	ssize_t len = mbus_io(fd, frame_out, sizeof(frame_out), frame_in, sizeof(frame_in));
 	if (len < 0) {
 		log_line(LOG_ERR, "M-Bus i/o failed: %s", strerror(-len));
 		return -len;
 	}
-
-	if (mbus_checklong(frame_in, len) < 71) {
+	if (!mbus_checklong(frame_in, len) || !em_meter.valid) {
 		log_line(LOG_ERR, "M-Bus protocol error, received %d unprocessable bytes.", len);
 		return EPROTO;
 	}
+	return 0;
+}
 
-	/* this is nonsense, (very) poor man's DIF/VIF decoding */
-	size_t p = MBUS_FRAME_LONG_HDR_LEN + MBUS_RSPUD12_HDR_LEN;
-	for (unsigned int i = 0; ; i++) {
-		char buf[64];
-		size_t b = 0;
-		const unsigned char ldb[] = { 0, 1, 2, 3, 4, 4, 6, 8 };
-		unsigned int hasdife = (frame_in[p] & 0x80) >> 7;
-		unsigned int hasvife = (frame_in[p + 1 + hasdife] & 0x80) >> 7;
-		unsigned int d = p + 1 + hasdife + 1 + hasvife;
-
-		b += sprintf(buf + b, "DIF: %02x", frame_in[p]);
-		b += sprintf(buf + b, hasdife ? "-%02x" : "   ", frame_in[p + 1]);
-		b += sprintf(buf + b, " VIF: %02x", frame_in[p + hasdife + 1]);
-		b += sprintf(buf + b, hasvife ? "-%02x" : "   ", frame_in[p + 1 + hasdife + 1]);
-		unsigned int df = (frame_in[p] & 0b1111);
-		if (df > 7) break;
-		unsigned int l = ldb[df];
-
-		unsigned int sn = (frame_in[p] & 0b1000000) >> 6;
-		if (hasdife) sn |= ((frame_in[p + 1] & 0b1111) << 1);
-		b += sprintf(buf + b, " SN: %d", sn);
-
-		b += sprintf(buf + b, " RAW: ");
-		for (unsigned int j = 0; j < l; j++) b += sprintf(buf + b, "%02x ", frame_in[d + j]);
-
-		if ((df == 4) && (frame_in[p + hasdife + 1] == 0x6d)) {
-			b += sprintf(buf + b, " VAL: %04d-%02d-%02d %02d:%02d",
-				2000 + (frame_in[d + 2] >> 5 | (frame_in[d + 3] & 0b11110000) >> 1),
-				frame_in[d + 3] & 0b1111, frame_in[d + 2] & 0b11111, frame_in[d + 1], frame_in[d]);
-		} else if (df == 4) {
-			b += sprintf(buf + b, " VAL: %ld", (unsigned long int) frame_in[d + 3] << 24 |
-				frame_in[d + 2] << 16 | frame_in[d + 1] << 8 | frame_in[d + 0]);
-		} else if ((df == 2) && (frame_in[p + hasdife + 1] == 0x6c)) {
-			b += sprintf(buf + b, "       VAL: %04d-%02d-%02d",
-				2000 + (frame_in[d] >> 5 | (frame_in[d + 1] & 0b11110000) >> 1),
-				frame_in[d + 1] & 0b1111, frame_in[d] & 0b11111);
-		}
-
-		log_line(LOG_INFO, "%02d: %s", i, buf);
-		p = d + l;
-		if (p > frame_in[1]) break;
+/*
+   set_time and set_keyday given together: one SND_UD with both records
+   if the model accepts it, else one frame each, then a single REQ_UD2
+   verifies both. The meter is identified first unless the session read it
+   already. A rejected combined write is remembered per model by this
+   process only: a route stops trying it, every new run or supervised
+   session tries once more.
+*/
+int em_set_time_keyday(int fd) {
+	unsigned char recs[EM_TIME_REC_LEN + EM_KEYDAY_REC_LEN];
+	struct tm tm;
+	int ret;
+
+	if ((ret = em_identify(fd)))
+		return ret;
+	if ((em_model->flags & EM_MODEL_MULTIREC) && !em_multirec_rejected[em_model - em_models]) {
+		em_rt_align_minute();
+		em_std_clock(&tm);
+		log_line(LOG_INFO,
+			 "Setting device time to: %02d.%02d.%d %02d:%02d (no DST) and keydate",
+			 tm.tm_mday, tm.tm_mon + 1, tm.tm_year + 1900, tm.tm_hour, tm.tm_min);
+		em_time_record(recs, &tm);
+		em_keyday_record(recs + EM_TIME_REC_LEN, EM_SET_KEYDAY_DAY, EM_SET_KEYDAY_MONTH);
+		ret = em_snd_ud(fd, recs, sizeof(recs));
+		/* only an answer other than ACK is a rejection, after a lost one the write may have been applied */
+		if (ret && (ret != EPROTO))
+			return ret;
+		if (ret) {
+			log_line(LOG_WARNING, "Combined write rejected, sending records separately");
+			em_multirec_rejected[em_model - em_models] = 1;
+		}
+	} else {
+		ret = 1;
+	}
+	if (ret && ((ret = em_set_time(fd)) || (ret = em_set_keyday(fd))))
+		return ret;
+
+	em_meter.clock_valid = em_meter.keyday_valid = 0;
+	if ((ret = em_read_info(fd)))
+		return ret;
+	if (!em_meter.clock_valid || (labs(em_meter.clock - em_std_clock(&tm)) > EM_CLOCK_TOLERANCE) ||
+	    !em_meter.keyday_valid || (em_meter.keyday_day != EM_SET_KEYDAY_DAY) || (em_meter.keyday_month != EM_SET_KEYDAY_MONTH)) {
+		log_line(LOG_ERR, "Verification of device time and keydate failed");
+		return EIO;
+	}
+	log_line(LOG_INFO, "Device time and keydate verified");
+	return 0;
+}
+
+/* Log a record of the RSP_UD while the rest of the frame arrives, ctx collects clock and keyday */
+void em_info_record(const struct mbus_record *r, void *ctx) {
+	struct em_meter *info = ctx;
+	const unsigned char *d = r->data;
+	char buf[96];				/* a clock record is the longest, 68 chars */
+	size_t b = 0;
+
+	/* the first record of a retry starts over */
+	if (!r->index)
+		info->clock_valid = info->keyday_valid = 0;
+
+	/* this is nonsense, (very) poor man's DIF/VIF decoding */
+	b += sprintf(buf + b, "DIF: %02x", r->dif);
+	b += sprintf(buf + b, (r->dif & 0x80) ? "-%02x" : "   ", r->dife);
+	b += sprintf(buf + b, " VIF: %02x", r->vif);
+	b += sprintf(buf + b, (r->vif & 0x80) ? "-%02x" : "   ", r->vife);
+	b += sprintf(buf + b, " SN: %d", r->sn);
+
+	b += sprintf(buf + b, " RAW: ");
+	for (unsigned int j = 0; j < r->len; j++) b += sprintf(buf + b, "%02x ", d[j]);
+
+	if ((r->df == 4) && (r->vif == 0x6d)) {
+		struct tm tm = {
+			.tm_year = 100 + (d[2] >> 5 | (d[3] & 0b11110000) >> 1),
+			.tm_mon = (d[3] & 0b1111) - 1, .tm_mday = d[2] & 0b11111,
+			.tm_hour = d[1] & 0b11111, .tm_min = d[0] & 0b111111,
+		};
+		b += sprintf(buf + b, " VAL: %04d-%02d-%02d %02d:%02d",
+			2000 + (d[2] >> 5 | (d[3] & 0b11110000) >> 1),
+			d[3] & 0b1111, d[2] & 0b11111, d[1] & 0b11111, d[0] & 0b111111);
+		if (!info->clock_valid && (r->sn == 0)) {
+			info->clock_valid = 1;
+			info->clock = timegm(&tm);
+		}
+	} else if (r->df == 4) {
+		b += sprintf(buf + b, " VAL: %ld", (unsigned long int) d[3] << 24 | d[2] << 16 | d[1] << 8 | d[0]);
+	} else if ((r->df == 2) && (r->vif == 0x6c)) {
+		b += sprintf(buf + b, "       VAL: %04d-%02d-%02d",
+			2000 + (d[0] >> 5 | (d[1] & 0b11110000) >> 1), d[1] & 0b1111, d[0] & 0b11111);
+		/* the date of storage 1 is the key date (billing date) */
+		if (!info->keyday_valid || (r->sn == 1)) {
+			info->keyday_valid = 1;
+			info->keyday_day = d[0] & 0b11111;
+			info->keyday_month = d[1] & 0b1111;
+		}
+	}
+
+	log_line(LOG_INFO, "%02d: %s", r->index, buf);
+}
+
+int em_read_info(int fd) {
+	unsigned char frame_in[MBUS_FRAME_MAX_LEN];
+	unsigned char frame_out[] = {
+		MBUS_FRAME_SHORT_START,
+		MBUS_C_REQ_UD2,			/* Control */
+		254,				/* Address */
+		0x00,				/* Checksum */
+		MBUS_FRAME_STOP
+	};
+	struct em_meter info = em_meter;
+	struct mbus_parser parser = { .record = em_info_record, .ctx = &info };
+
+	log_line(LOG_INFO, "Reading info");
+	ssize_t len = mbus_io_parse(fd, frame_out, sizeof(frame_out), frame_in, sizeof(frame_in), &parser);
+	if (len < 0) {
+		log_line(LOG_ERR, "M-Bus i/o failed: %s", strerror(-len));
+		return -len;
+	}
+
+	if (mbus_checklong(frame_in, len) < 71) {
+		log_line(LOG_ERR, "M-Bus protocol error, received %d unprocessable bytes.", len);
+		return EPROTO;
 	}
+	/* the records seen are only good now that the checksum is */
+	em_meter.clock_valid = info.clock_valid;
+	em_meter.clock = info.clock;
+	em_meter.keyday_valid = info.keyday_valid;
+	em_meter.keyday_day = info.keyday_day;
+	em_meter.keyday_month = info.keyday_month;
 
 	log_line(LOG_INFO, "Operation completed successfully");
 	return 0;
 }
 
 int em_read_highres(int fd) {
-	unsigned char frame_in[64];
+	unsigned char frame_in[MBUS_FRAME_MAX_LEN];
 	unsigned char frame_out[] = {
 		MBUS_FRAME_LONG_START,
 		8,				/* Frame length */
@@ -546,18 +1690,19 @@ int em_read_highres(int fd) {
 		return EPROTO;
 	}
 
-	log_line(LOG_INFO, "EM_HIGHRES_READING: %ld ml",
-		 frame_in[MBUS_FRAME_LONG_HDR_LEN + MBUS_RSPUD12_HDR_LEN + 3] << 24 |
-		 frame_in[MBUS_FRAME_LONG_HDR_LEN + MBUS_RSPUD12_HDR_LEN + 2] << 16 |
-		 frame_in[MBUS_FRAME_LONG_HDR_LEN + MBUS_RSPUD12_HDR_LEN + 1] << 8 |
-		 frame_in[MBUS_FRAME_LONG_HDR_LEN + MBUS_RSPUD12_HDR_LEN]);
+	em_meter.highres = frame_in[MBUS_FRAME_LONG_HDR_LEN + MBUS_RSPUD12_HDR_LEN + 3] << 24 |
+			   frame_in[MBUS_FRAME_LONG_HDR_LEN + MBUS_RSPUD12_HDR_LEN + 2] << 16 |
+			   frame_in[MBUS_FRAME_LONG_HDR_LEN + MBUS_RSPUD12_HDR_LEN + 1] << 8 |
+			   frame_in[MBUS_FRAME_LONG_HDR_LEN + MBUS_RSPUD12_HDR_LEN];
+	em_meter.highres_valid = 1;
+	log_line(LOG_INFO, "EM_HIGHRES_READING: %ld ml", em_meter.highres);
 
 	log_line(LOG_INFO, "Operation completed successfully");
 	return 0;
 }
 
 int em_read_months(int fd) {
-	unsigned char frame_in[256];
+	unsigned char frame_in[MBUS_FRAME_MAX_LEN];
 	unsigned char frame_out[] = {
 		MBUS_FRAME_LONG_START,
 		8,				/* Frame length */
@@ -587,13 +1732,17 @@ int em_read_months(int fd) {
 			return EPROTO;
 		}
 
-		for (unsigned int i = 0; i < 15; i++) {
-			unsigned int off = MBUS_FRAME_LONG_HDR_LEN + MBUS_RSPUD12_HDR_LEN + i * 6;
+		for (unsigned int j = 0; j < 15; j++) {
+			unsigned int off = MBUS_FRAME_LONG_HDR_LEN + MBUS_RSPUD12_HDR_LEN + j * 6;
+			em_meter.month_date[i * 15 + j] = frame_in[off + 1] << 8 | frame_in[off];
+			em_meter.month_value[i * 15 + j] = frame_in[off + 5] << 24 | frame_in[off + 4] << 16 |
+							   frame_in[off + 3] << 8 | frame_in[off + 2];
 			log_line(LOG_INFO, "EM_METER_READING_%04d-%02d-%02d: %d", 2000 + ((frame_in[off + 1] & 0b11111110) >> 1),
 				 ((frame_in[off + 1] << 8 | frame_in[off]) & 0b111100000) >> 5, frame_in[off] & 0b11111,
 				 frame_in[off + 5] << 24 | frame_in[off + 4] << 16 | frame_in[off + 3] << 8 | frame_in[off + 2] );
 		}
 	}
+	em_meter.months_valid = 1;
 
 	log_line(LOG_INFO, "Operation completed successfully");
 	return 0;
@@ -601,7 +1750,7 @@ int em_read_months(int fd) {
 
 void em_dump_settings(const unsigned char *data) {
 	char buf[64];
-	char buf2[96];
+	char buf2[160];				/* up to 5 chars per day, "1 - 2, 4 - 5, ..." */
 	const unsigned int em_months = data[6] << 8 | data[5];
 	const unsigned long em_weekoms = data[10] << 24 | data[9] << 16 | data[8] << 8 | data[7];
 	const unsigned long em_hours = data[14] << 16 | data[13] << 8 | data[12];
@@ -626,7 +1775,7 @@ void em_dump_settings(const unsigned char *data) {
 }
 
 int em_get_params(int fd) {
-	unsigned char frame_in[64];
+	unsigned char frame_in[MBUS_FRAME_MAX_LEN];
 	unsigned char frame_out[] = {
 		MBUS_FRAME_LONG_START,
 		8,				/* Frame length */
@@ -654,12 +1803,14 @@ int em_get_params(int fd) {
 	}
 
 	em_dump_settings(frame_in + MBUS_FRAME_LONG_HDR_LEN + MBUS_RSPUD12_HDR_LEN);
+	memcpy(em_meter.params, frame_in + MBUS_FRAME_LONG_HDR_LEN + MBUS_RSPUD12_HDR_LEN, EM_PARAMS_LEN);
+	em_meter.params_valid = 1;
 
 	log_line(LOG_INFO, "Operation completed successfully");
 	return 0;
 }
 
-int em_set_params(int fd) {
+int em_set_params_block(int fd, const unsigned char *params) {
 	unsigned char frame_out[] = {
 		MBUS_FRAME_LONG_START,
 		36,				/* Frame length */
@@ -671,36 +1822,49 @@ int em_set_params(int fd) {
 		0x0f, 0x81,			/* DIF, VIF: set parameters (0x81) */
 		0x00, 0x00, 0x60,		/* Unknown or reserved */
 		0x00, 0x00, 0x00, 0x00,		/* Unknown or reserved */
-		EM_SET_FLAGS,
-		EM_SET_OMSMODE,
-		EM_SET_FRAMETYPE,
-		(EM_SET_INTERVAL >> 0) & 0xFF,
-		(EM_SET_INTERVAL >> 8) & 0xFF,
-		(EM_SET_MONTHS >> 0) & 0xFF,
-		(EM_SET_MONTHS >> 8) & 0xFF,
-		(EM_SET_WEEKOMS >> 0) & 0xFF,
-		(EM_SET_WEEKOMS >> 8) & 0xFF,
-		(EM_SET_WEEKOMS >> 16) & 0xFF,
-		(EM_SET_WEEKOMS >> 24) & 0xFF,
-		EM_SET_DAYOWS,
-		(EM_SET_HOURS >> 0) & 0xFF,
-		(EM_SET_HOURS >> 8) & 0xFF,
-		(EM_SET_HOURS >> 16) & 0xFF,
-		(((EM_SET_ONDAY_YEAR - 2000) << 9 | EM_SET_ONDAY_MONTH << 5 | EM_SET_ONDAY_DAY) >> 0) & 0xFF,
-		(((EM_SET_ONDAY_YEAR - 2000) << 9 | EM_SET_ONDAY_MONTH << 5 | EM_SET_ONDAY_DAY) >> 8) & 0xFF,
-		(EM_SET_ONVOL >> 0) & 0xFF,
-		(EM_SET_ONVOL >> 8) & 0xFF,
-		EM_SET_OPYEARS,
+		0x00, 0x00, 0x00, 0x00, 0x00,	/* Parameters, see em_set_params() */
+		0x00, 0x00, 0x00, 0x00, 0x00,
+		0x00, 0x00, 0x00, 0x00, 0x00,
+		0x00, 0x00, 0x00, 0x00, 0x00,
 		0x00, 0x00, 0x00, 0x00,		/* Unknown or reserved */
 		0x00,				/* Checksum */
 		MBUS_FRAME_STOP
 	};
 
+	memcpy(frame_out + MBUS_FRAME_LONG_HDR_LEN + 9, params, EM_PARAMS_LEN);
 	log_line(LOG_INFO, "Setting device parameters");
 	em_dump_settings(frame_out + MBUS_FRAME_LONG_HDR_LEN + 9);
 	return mbus_io_acked(fd, frame_out, sizeof(frame_out));
 }
 
+/* Parameter block as configured by the EM_SET_* defines */
+const unsigned char em_default_params[EM_PARAMS_LEN] = {
+	EM_SET_FLAGS,
+	EM_SET_OMSMODE,
+	EM_SET_FRAMETYPE,
+	(EM_SET_INTERVAL >> 0) & 0xFF,
+	(EM_SET_INTERVAL >> 8) & 0xFF,
+	(EM_SET_MONTHS >> 0) & 0xFF,
+	(EM_SET_MONTHS >> 8) & 0xFF,
+	(EM_SET_WEEKOMS >> 0) & 0xFF,
+	(EM_SET_WEEKOMS >> 8) & 0xFF,
+	(EM_SET_WEEKOMS >> 16) & 0xFF,
+	(EM_SET_WEEKOMS >> 24) & 0xFF,
+	EM_SET_DAYOWS,
+	(EM_SET_HOURS >> 0) & 0xFF,
+	(EM_SET_HOURS >> 8) & 0xFF,
+	(EM_SET_HOURS >> 16) & 0xFF,
+	(((EM_SET_ONDAY_YEAR - 2000) << 9 | EM_SET_ONDAY_MONTH << 5 | EM_SET_ONDAY_DAY) >> 0) & 0xFF,
+	(((EM_SET_ONDAY_YEAR - 2000) << 9 | EM_SET_ONDAY_MONTH << 5 | EM_SET_ONDAY_DAY) >> 8) & 0xFF,
+	(EM_SET_ONVOL >> 0) & 0xFF,
+	(EM_SET_ONVOL >> 8) & 0xFF,
+	EM_SET_OPYEARS
+};
+
+int em_set_params(int fd) {
+	return em_set_params_block(fd, em_default_params);
+}
+
 int em_set_aes(int fd) {
 	unsigned char frame_out[] = {
 		MBUS_FRAME_LONG_START,
@@ -719,65 +1883,4745 @@ int em_set_aes(int fd) {
 		MBUS_FRAME_STOP
 	};
 
-	return 7; /* NOT TESTED, remove if you know what you're doing */
+	if (!EM_SET_AES_TESTED) {
+		log_line(LOG_ERR, "set_aes is untested, see EM_SET_AES_TESTED");
+		return EOPNOTSUPP;
+	}
 
 	log_line(LOG_INFO, "Setting AES key");
 	return mbus_io_acked(fd, frame_out, sizeof(frame_out));
 }
 
-int main(int argc, char *argv[]) {
-	int err;
-	int ret = 1;
-	int serial_fd;
+struct em_snapshot_rec {
+	uint32_t secadr;
+	uint32_t time;
+	uint8_t params[EM_PARAMS_LEN];
+	uint8_t keyday_day;
+	uint8_t keyday_month;			/* 0 if unknown */
+	uint8_t reserved[2];
+};
 
-	if ((argc != 2) && (argc != 3)) {
-		log_line(LOG_ERR, "Usage: %s <serial port> [get_params|set_params|set_time|set_aes|set_keyday|read_months|read_info]\n", argv[0]);
-		goto fail;
+/* Archive header, followed by the records sorted by secondary address */
+struct em_snapshot {
+	uint32_t magic;
+	uint32_t count;
+	uint32_t reserved[6];
+	struct em_snapshot_rec rec[];
+};
+
+const char *em_snapshot_path(void) {
+	return getenv("EM_SNAPSHOT_FILE") ? getenv("EM_SNAPSHOT_FILE") : EM_SNAPSHOT_FILE;
+}
+
+/* First record not below secadr */
+unsigned int em_snapshot_bsearch(const struct em_snapshot *sn, const uint32_t secadr) {
+	unsigned int lo = 0, hi = sn->count;
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (sn->rec[mid].secadr < secadr) lo = mid + 1;
+		else hi = mid;
 	}
+	return lo;
+}
 
-	serial_fd = open(argv[1], O_RDWR | O_NOCTTY | O_SYNC | O_NONBLOCK);
-	if (serial_fd < 0) {
-		log_line(LOG_ERR, "Failed to open serial port '%s': %s", argv[1], strerror(errno));
+/* Map the archive read-only, the shared lock on *fd keeps writers out until em_snapshot_unmap */
+const struct em_snapshot *em_snapshot_map(const char *path, size_t *size, int *fd) {
+	struct em_snapshot *sn;
+	struct stat sb;
+
+	if ((*fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+		log_line(LOG_ERR, "Failed to open snapshot archive '%s': %s", path, strerror(errno));
+		return NULL;
+	}
+	if (flock(*fd, LOCK_SH) || fstat(*fd, &sb) || (sb.st_size < sizeof(*sn)) ||
+	    ((sn = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, *fd, 0)) == MAP_FAILED)) {
+		log_line(LOG_ERR, "Invalid snapshot archive '%s'", path);
+		close(*fd);
+		return NULL;
+	}
+	if ((sn->magic != EM_SNAPSHOT_MAGIC) || (sizeof(*sn) + sn->count * sizeof(sn->rec[0]) > sb.st_size)) {
+		log_line(LOG_ERR, "Incompatible snapshot archive '%s'", path);
+		munmap(sn, sb.st_size);
+		close(*fd);
+		return NULL;
+	}
+	*size = sb.st_size;
+	return sn;
+}
+
+void em_snapshot_unmap(const struct em_snapshot *sn, const size_t size, const int fd) {
+	munmap((void *) sn, size);
+	close(fd);
+}
+
+const struct em_snapshot_rec *em_snapshot_find(const struct em_snapshot *sn, const uint32_t secadr) {
+	unsigned int i = em_snapshot_bsearch(sn, secadr);
+	return ((i < sn->count) && (sn->rec[i].secadr == secadr)) ? &sn->rec[i] : NULL;
+}
+
+/* Insert or replace a record, sessions on other heads may store concurrently */
+int em_snapshot_store(const char *path, const struct em_snapshot_rec *rec) {
+	struct em_snapshot *sn;
+	struct stat sb;
+	size_t size;
+	uint32_t magic = 0;
+	int ret = EIO;
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+	if (fd < 0) {
+		log_line(LOG_ERR, "Failed to open snapshot archive '%s': %s", path, strerror(errno));
+		return errno;
+	}
+	flock(fd, LOCK_EX);
+	if (fstat(fd, &sb) || (pread(fd, &magic, sizeof(magic), 0) < 0))
+		goto fail;
+	/* leave foreign files alone, a new one is all zeros */
+	if (magic && (magic != EM_SNAPSHOT_MAGIC)) {
+		log_line(LOG_ERR, "Incompatible snapshot archive '%s'", path);
 		goto fail;
 	}
+	size = (sb.st_size < sizeof(*sn)) ? sizeof(*sn) : sb.st_size;
+	if (ftruncate(fd, size + sizeof(*rec)))
+		goto fail;
+	if ((sn = mmap(NULL, size + sizeof(*rec), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		ret = errno;
+		if (ftruncate(fd, sb.st_size))
+			log_line(LOG_WARNING, "Failed to truncate snapshot archive '%s': %s", path, strerror(errno));
+		goto fail;
+	}
+	sn->magic = EM_SNAPSHOT_MAGIC;
+
+	unsigned int i = em_snapshot_bsearch(sn, rec->secadr);
+	if ((i < sn->count) && (sn->rec[i].secadr == rec->secadr)) {
+		sn->rec[i] = *rec;
+	} else {
+		memmove(&sn->rec[i + 1], &sn->rec[i], (sn->count - i) * sizeof(*rec));
+		sn->rec[i] = *rec;
+		sn->count++;
+	}
+	const size_t mapped = size + sizeof(*rec);
+	size = sizeof(*sn) + sn->count * sizeof(*rec);
+	munmap(sn, mapped);
+	ret = ftruncate(fd, size) ? errno : 0;
+
+ fail:
+	close(fd);
+	return ret;
+}
+
+/* Back up the parameter block and key day of the meter */
+int em_snapshot(int fd) {
+	struct em_snapshot_rec rec = { 0 };
+	int ret;
+
+	if ((ret = em_get_params(fd)) || (ret = em_read_info(fd)))
+		return ret;
+
+	rec.secadr = em_meter.secadr;
+	rec.time = time(NULL);
+	memcpy(rec.params, em_meter.params, EM_PARAMS_LEN);
+	if (em_meter.keyday_valid) {
+		rec.keyday_day = em_meter.keyday_day;
+		rec.keyday_month = em_meter.keyday_month;
+	}
+
+	if ((ret = em_snapshot_store(em_snapshot_path(), &rec)))
+		return ret;
+	log_line(LOG_INFO, "Snapshot of 0x%08x stored in '%s'", rec.secadr, em_snapshot_path());
+	return 0;
+}
+
+/* Re-apply the archived parameters and key day, but only what differs */
+int em_restore(int fd) {
+	struct em_snapshot_rec rec;
+	const struct em_snapshot *sn;
+	size_t size;
+	int ret, sn_fd;
+
+	if ((ret = em_get_params(fd)))
+		return ret;
+
+	if (!(sn = em_snapshot_map(em_snapshot_path(), &size, &sn_fd)))
+		return ENOENT;
+	const struct em_snapshot_rec *r = em_snapshot_find(sn, em_meter.secadr);
+	if (r) rec = *r;
+	em_snapshot_unmap(sn, size, sn_fd);
+	if (!r) {
+		log_line(LOG_ERR, "No snapshot of 0x%08x in '%s'", em_meter.secadr, em_snapshot_path());
+		return ENOENT;
+	}
+
+	if (memcmp(em_meter.params, rec.params, EM_PARAMS_LEN)) {
+		log_line(LOG_INFO, "Restoring parameters of 0x%08x", rec.secadr);
+		if ((ret = em_set_params_block(fd, rec.params)) || (ret = em_get_params(fd)))
+			return ret;
+		if (memcmp(em_meter.params, rec.params, EM_PARAMS_LEN)) {
+			log_line(LOG_ERR, "Verification of parameters failed");
+			return EIO;
+		}
+	} else {
+		log_line(LOG_INFO, "Parameters of 0x%08x unchanged", rec.secadr);
+	}
+
+	if (!rec.keyday_month)
+		return 0;
+	if ((ret = em_read_info(fd)))
+		return ret;
+	if (em_meter.keyday_valid && (em_meter.keyday_day == rec.keyday_day) && (em_meter.keyday_month == rec.keyday_month)) {
+		log_line(LOG_INFO, "Keydate of 0x%08x unchanged", rec.secadr);
+		return 0;
+	}
+	log_line(LOG_INFO, "Restoring keydate of 0x%08x", rec.secadr);
+	em_meter.keyday_valid = 0;
+	if ((ret = em_set_keyday_date(fd, rec.keyday_day, rec.keyday_month)) || (ret = em_read_info(fd)))
+		return ret;
+	if (!em_meter.keyday_valid || (em_meter.keyday_day != rec.keyday_day) || (em_meter.keyday_month != rec.keyday_month)) {
+		log_line(LOG_ERR, "Verification of keydate failed");
+		return EIO;
+	}
+	return 0;
+}
+
+int em_snapshot_dump(const char *path, const char *secadr) {
+	const struct em_snapshot *sn;
+	size_t size;
+	int fd;
+
+	if (!(sn = em_snapshot_map(path, &size, &fd)))
+		return 1;
+
+	for (unsigned int i = 0; i < sn->count; i++) {
+		const struct em_snapshot_rec *r = &sn->rec[i];
+		char buf[32];
+		time_t ts = r->time;
+
+		if (secadr && (r->secadr != strtoul(secadr, NULL, 16)))
+			continue;
+		strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&ts));
+		log_line(LOG_INFO, "0x%08x %s EM_KEYDAY: %02d-%02d", r->secadr, buf, r->keyday_month, r->keyday_day);
+		if (secadr)
+			em_dump_settings(r->params);
+	}
+
+	em_snapshot_unmap(sn, size, fd);
+	return 0;
+}
+
+int em_flow(int fd);
+
+struct em_cmd {
+	const char *name;
+	int (*func)(int fd);
+};
+
+const struct em_cmd em_cmds[] = {
+	{ "get_params",		em_get_params },
+	{ "set_params",		em_set_params },
+	{ "set_time",		em_set_time },
+	{ "set_aes",		em_set_aes },
+	{ "set_keyday",		em_set_keyday },
+	{ "read_months",	em_read_months },
+	{ "read_info",		em_read_info },
+	{ "read_highres",	em_read_highres },
+	{ "snapshot",		em_snapshot },
+	{ "restore",		em_restore },
+	{ "flow",		em_flow },
+	{ NULL, NULL }
+};
+
+const struct em_cmd *em_find_cmd(const char *name) {
+	for (const struct em_cmd *c = em_cmds; c->name; c++)
+		if (!strcmp(c->name, name)) return c;
+	return NULL;
+}
+
+int em_wakeup(int fd) {
+	struct timespec until;
 
 	log_line(LOG_INFO, "Setting serial port to 2400 baud 8N1");
-	err = serial_interface_attribs(serial_fd, B2400, 0);
-	if (err < 0) {
+	if (serial_interface_attribs(fd, B2400, 0) < 0) {
 		log_line(LOG_ERR, "Failed to set serial port attribs");
-		goto fail_cs;
+		return -1;
 	}
 
-	mbus_wakeup(serial_fd);
-	sleep(MBUS_WAKEUP_TIME);
+	mbus_wakeup(fd);
+	clock_gettime(CLOCK_MONOTONIC, &until);
+	until.tv_sec += MBUS_WAKEUP_TIME;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR)
+		;
 
 	log_line(LOG_INFO, "Setting serial port to 2400 baud 8E1");
-	err = serial_interface_attribs(serial_fd, B2400, PARENB);
-	if (err < 0) {
+	if (serial_interface_attribs(fd, B2400, PARENB) < 0) {
 		log_line(LOG_ERR, "Failed to set serial port attribs");
-		goto fail_cs;
-	}
-
-	if (argv[2] && !strcmp(argv[2], "set_time")) {
-		ret = em_set_time(serial_fd);
-	} else if (argv[2] && !strcmp(argv[2], "set_aes")) {
-		ret = em_set_aes(serial_fd);
-	} else if (argv[2] && !strcmp(argv[2], "set_keyday")) {
-		ret = em_set_keyday(serial_fd);
-	} else if (argv[2] && !strcmp(argv[2], "set_params")) {
-		ret = em_set_params(serial_fd);
-	} else if (argv[2] && !strcmp(argv[2], "read_months")) {
-		ret = em_read_months(serial_fd);
-	} else if (argv[2] && !strcmp(argv[2], "read_info")) {
-		ret = em_read_info(serial_fd);
-	} else if (argv[2] && !strcmp(argv[2], "read_highres")) {
-		ret = em_read_highres(serial_fd);
-	} else {
-		ret = em_get_params(serial_fd);
+		return -1;
 	}
+	return 0;
+}
 
- fail_cs:
-	close(serial_fd);
- fail:
-	return ret;
+void __attribute__ ((noinline)) em_rt_prefault(void) {
+	volatile unsigned char stack[EM_RT_PREFAULT];
+	memset((unsigned char *) stack, 0, sizeof(stack));
+}
+
+/* Cpu of a head from a list like "2,4-7": heads take the cpus in turn, -1 if the list is invalid */
+int em_rt_cpu(const char *list, const unsigned int head) {
+	const long ncpu = sysconf(_SC_NPROCESSORS_CONF);
+	int cpus[CPU_SETSIZE];
+	unsigned int n = 0;
+	const char *p = list;
+
+	for (;;) {
+		char *end;
+		long first = strtol(p, &end, 10), last = first;
+		if (end == p)
+			break;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if (end == p)
+				break;
+		}
+		if ((first < 0) || (last < first) || (last >= ncpu) || (last >= CPU_SETSIZE))
+			break;
+		for (long c = first; (c <= last) && (n < CPU_SETSIZE); c++)
+			cpus[n++] = c;
+		if (!*end)
+			return cpus[head % n];
+		if (*end != ',')
+			break;
+		p = end + 1;
+	}
+	log_line(LOG_WARNING, "Invalid cpu list '%s' (%ld cpus), not pinning", list, ncpu);
+	return -1;
+}
+
+/* Pin to a cpu, run with SCHED_FIFO and locked memory, then measure how late absolute sleeps wake up */
+void em_rt_setup(const char *list) {
+	struct sched_param sp = { .sched_priority = EM_RT_PRIORITY };
+	struct timespec until, now;
+	double sum = 0, max = 0;
+	int cpu;
+
+	if (*list && ((cpu = em_rt_cpu(list, em_rt_head)) >= 0)) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set))
+			log_line(LOG_WARNING, "Failed to pin to cpu %d: %s", cpu, strerror(errno));
+	}
+	if (sched_setscheduler(0, SCHED_FIFO, &sp))
+		log_line(LOG_WARNING, "Failed to set real-time scheduling: %s", strerror(errno));
+	/* not MCL_FUTURE: the stores mapped later (readings table alone is 64 MB) would all be locked */
+	if (mlockall(MCL_CURRENT))
+		log_line(LOG_WARNING, "Failed to lock memory: %s", strerror(errno));
+	em_rt_prefault();
+
+	clock_gettime(CLOCK_MONOTONIC, &until);
+	for (unsigned int i = 0; i < EM_RT_SAMPLES; i++) {
+		if ((until.tv_nsec += 1000000) >= 1000000000) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		double late = (now.tv_sec - until.tv_sec) + (now.tv_nsec - until.tv_nsec) / 1e9;
+		sum += late;
+		if (late > max)
+			max = late;
+	}
+	log_line(LOG_INFO, "Real-time mode: scheduling latency avg %.0f us, max %.0f us", sum * 1e6 / EM_RT_SAMPLES, max * 1e6);
+	em_rt = 1;
+}
+
+int em_open(const char *port) {
+	static int backend_selected = 0;
+
+	/* after fork: ring and epoll instances must not be shared between heads, pin each head separately */
+	if (!backend_selected++) {
+		if (getenv("EM_IO_BACKEND"))
+			serial_backend_select(getenv("EM_IO_BACKEND"));
+		if (getenv("EM_RT"))
+			em_rt_setup(getenv("EM_RT"));
+	}
+
+	int serial_fd = open(port, O_RDWR | O_NOCTTY | O_SYNC | O_NONBLOCK);
+	if (serial_fd < 0) {
+		log_line(LOG_ERR, "Failed to open serial port '%s': %s", port, strerror(errno));
+		return -1;
+	}
+
+	if (em_wakeup(serial_fd) < 0) {
+		serial_close(serial_fd);
+		return -1;
+	}
+	return serial_fd;
+}
+
+struct em_counters {
+	uint64_t sessions;
+	uint64_t failed;
+	uint64_t wakeups;
+	uint64_t requests;
+	uint64_t retries;
+	uint64_t timeouts;
+	uint64_t parity_errors;
+	uint64_t checksum_errors;
+	uint64_t framing_errors;
+	uint64_t bytes;
+	uint64_t err;			/* error rates per mille, EWMA over ~4 (bits 0-31) and ~32 sessions (bits 32-62) */
+	int64_t last;			/* time of last session */
+};
+
+#define EM_STATS_ERR_SEEDED	(1ULL << 63)
+#define EM_STATS_ERR_FAST(err)	((uint32_t) ((err) & 0xffffffff))
+#define EM_STATS_ERR_SLOW(err)	((uint32_t) (((err) >> 32) & 0x7fffffff))
+
+struct em_stats_slot {
+	uint32_t used;			/* see em_claim_wait() */
+	uint32_t secadr;		/* meters only */
+	char port[64];			/* heads only */
+	struct em_counters c;
+};
+
+struct em_stats {
+	uint32_t magic;
+	uint32_t size;
+	struct em_stats_slot heads[EM_STATS_HEADS];
+	struct em_stats_slot meters[EM_STATS_METERS];
+};
+
+struct em_stats *em_stats_map(const char *path, const int create) {
+	struct em_stats *st;
+	struct stat sb;
+	int fd = open(path, create ? (O_RDWR | O_CREAT | O_CLOEXEC) : (O_RDONLY | O_CLOEXEC), 0644);
+
+	if (fd < 0) {
+		log_line(create ? LOG_WARNING : LOG_ERR, "Failed to open statistics '%s': %s", path, strerror(errno));
+		return NULL;
+	}
+	if (fstat(fd, &sb) || ((sb.st_size < sizeof(*st)) && (!create || ftruncate(fd, sizeof(*st))))) {
+		log_line(LOG_ERR, "Invalid statistics '%s'", path);
+		close(fd);
+		return NULL;
+	}
+	st = mmap(NULL, sizeof(*st), create ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (st == MAP_FAILED) {
+		log_line(LOG_ERR, "Failed to map statistics '%s': %s", path, strerror(errno));
+		return NULL;
+	}
+
+	if (create && !st->magic) {
+		st->size = sizeof(*st);
+		__atomic_store_n(&st->magic, EM_STATS_MAGIC, __ATOMIC_RELEASE);
+	}
+	if ((st->magic != EM_STATS_MAGIC) || (st->size != sizeof(*st))) {
+		log_line(LOG_ERR, "Incompatible statistics '%s'", path);
+		munmap(st, sizeof(*st));
+		return NULL;
+	}
+	return st;
+}
+
+/* Claim a slot, concurrent sessions (supervise mode) share the file */
+struct em_stats_slot *em_stats_slot(struct em_stats_slot *slots, const unsigned int n,
+				    unsigned int h, const char *port, const uint32_t secadr) {
+	for (unsigned int i = 0; i < n; i++, h++) {
+		struct em_stats_slot *slot = &slots[h & (n - 1)];
+		uint32_t used = __atomic_load_n(&slot->used, __ATOMIC_ACQUIRE);
+		if (!used && __atomic_compare_exchange_n(&slot->used, &used, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			slot->secadr = secadr;
+			snprintf(slot->port, sizeof(slot->port), "%s", port);
+			__atomic_store_n(&slot->used, 2, __ATOMIC_RELEASE);
+			return slot;
+		}
+		used = em_claim_wait(&slot->used, used);
+		if ((used == 2) && (slot->secadr == secadr) && !strcmp(slot->port, port))
+			return slot;
+	}
+	return NULL;
+}
+
+void em_stats_add(struct em_counters *c, const int failed) {
+	const uint64_t errors = mbus_stats.timeouts + mbus_stats.checksum_errors + mbus_stats.framing_errors;
+	uint32_t rate = mbus_stats.requests ? 1000 * errors / mbus_stats.requests : 1000;
+
+	if (rate > 1000) rate = 1000;
+	__atomic_add_fetch(&c->sessions, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&c->failed, failed ? 1 : 0, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&c->wakeups, mbus_stats.wakeups, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&c->requests, mbus_stats.requests, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&c->retries, mbus_stats.retries, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&c->timeouts, mbus_stats.timeouts, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&c->parity_errors, mbus_stats.parity_errors, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&c->checksum_errors, mbus_stats.checksum_errors, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&c->framing_errors, mbus_stats.framing_errors, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&c->bytes, mbus_stats.bytes_out + mbus_stats.bytes_in, __ATOMIC_RELAXED);
+	/* both averages in one word, so concurrent sessions neither lose updates nor seed twice */
+	uint64_t err = __atomic_load_n(&c->err, __ATOMIC_RELAXED), next;
+	do {
+		uint64_t fast = rate, slow = rate;
+		if (err & EM_STATS_ERR_SEEDED) {
+			fast = (EM_STATS_ERR_FAST(err) * 3 + rate) / 4;
+			slow = (EM_STATS_ERR_SLOW(err) * 31 + rate) / 32;
+		}
+		next = EM_STATS_ERR_SEEDED | slow << 32 | fast;
+	} while (!__atomic_compare_exchange_n(&c->err, &err, next, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	__atomic_store_n(&c->last, (int64_t) time(NULL), __ATOMIC_RELAXED);
+}
+
+/* Add the link counters of the finished session to the per head and per meter statistics */
+void em_stats_record(const char *port, const int failed) {
+	const char *path = getenv("EM_STATS_FILE");
+	struct em_stats_slot *slot;
+	struct em_stats *st;
+
+	if (!path || !path[0] || !(st = em_stats_map(path, 1)))
+		return;
+
+	if ((slot = em_stats_slot(st->heads, EM_STATS_HEADS, 0, port, 0)))
+		em_stats_add(&slot->c, failed);
+	if (em_meter.valid &&
+	    (slot = em_stats_slot(st->meters, EM_STATS_METERS, em_meter.secadr * 2654435761u, "", em_meter.secadr)))
+		em_stats_add(&slot->c, failed);
+	munmap(st, sizeof(*st));
+}
+
+/* Error rate is drifting away from its long-term level or is high anyway */
+int em_stats_degraded(const struct em_counters *c) {
+	const uint32_t fast = EM_STATS_ERR_FAST(c->err), slow = EM_STATS_ERR_SLOW(c->err);
+	return (c->sessions >= 8) && ((fast > 2 * slow + 20) || (fast > 250));
+}
+
+void em_stats_print(const char *name, const struct em_counters *c) {
+	char buf[32];
+	time_t last = c->last;
+	strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M", localtime(&last));
+	log_line(LOG_INFO, "%-24s %6lu %5lu %6lu %7lu %6lu %6lu %6lu %6lu %6lu %7lu %4u.%u%% %4u.%u%%  %s%s", name,
+		 c->sessions, c->failed, c->wakeups, c->requests, c->retries, c->timeouts, c->parity_errors,
+		 c->checksum_errors, c->framing_errors, c->sessions ? c->bytes / c->sessions : 0,
+		 EM_STATS_ERR_FAST(c->err) / 10, EM_STATS_ERR_FAST(c->err) % 10,
+		 EM_STATS_ERR_SLOW(c->err) / 10, EM_STATS_ERR_SLOW(c->err) % 10, buf,
+		 em_stats_degraded(c) ? "  DEGRADED" : "");
+}
+
+int em_stats_report(const char *path) {
+	struct em_stats *st = em_stats_map(path, 0);
+	unsigned int degraded = 0;
+
+	if (!st)
+		return 1;
+
+	log_line(LOG_INFO, "%-24s %6s %5s %6s %7s %6s %6s %6s %6s %6s %7s %6s %6s  %s", "HEAD/METER", "SESS", "FAIL",
+		 "WAKEUP", "REQ", "RETRY", "TMOUT", "PARITY", "CHKSUM", "FRAME", "B/SESS", "ERR", "ERRLT", "LAST");
+	for (unsigned int i = 0; i < EM_STATS_HEADS; i++) {
+		if (st->heads[i].used != 2) continue;
+		em_stats_print(st->heads[i].port, &st->heads[i].c);
+		degraded += em_stats_degraded(&st->heads[i].c);
+	}
+	for (unsigned int i = 0; i < EM_STATS_METERS; i++) {
+		char name[16];
+		if (st->meters[i].used != 2) continue;
+		snprintf(name, sizeof(name), "0x%08x", st->meters[i].secadr);
+		em_stats_print(name, &st->meters[i].c);
+	}
+	if (degraded)
+		log_line(LOG_WARNING, "%d opto head(s) with drifting error rate, check alignment and clean the optics", degraded);
+
+	munmap(st, sizeof(*st));
+	return 0;
+}
+
+struct em_readings *em_readings_map(const char *path, const int create) {
+	struct em_readings *t;
+	struct stat sb;
+	int fd = open(path, create ? (O_RDWR | O_CREAT | O_CLOEXEC) : (O_RDONLY | O_CLOEXEC), 0644);
+
+	if (fd < 0) {
+		log_line(create ? LOG_WARNING : LOG_ERR, "Failed to open readings table '%s': %s", path, strerror(errno));
+		return NULL;
+	}
+	if (fstat(fd, &sb) || ((sb.st_size < sizeof(*t)) && (!create || ftruncate(fd, sizeof(*t))))) {
+		log_line(LOG_ERR, "Invalid readings table '%s'", path);
+		close(fd);
+		return NULL;
+	}
+	t = mmap(NULL, sizeof(*t), create ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (t == MAP_FAILED) {
+		log_line(LOG_ERR, "Failed to map readings table '%s': %s", path, strerror(errno));
+		return NULL;
+	}
+
+	if (create && !t->magic) {
+		t->size = sizeof(*t);
+		t->slots = EM_READINGS_SLOTS;
+		__atomic_store_n(&t->magic, EM_READINGS_MAGIC, __ATOMIC_RELEASE);
+	}
+	if ((t->magic != EM_READINGS_MAGIC) || (t->size != sizeof(*t))) {
+		log_line(LOG_ERR, "Incompatible readings table '%s'", path);
+		munmap(t, sizeof(*t));
+		return NULL;
+	}
+	return t;
+}
+
+/* Publish the readings of the last session for local consumers, only if $EM_READINGS_FILE is set */
+void em_readings_publish(void) {
+	const char *path = getenv("EM_READINGS_FILE");
+	struct em_readings *t;
+	struct em_reading *r = NULL;
+	uint32_t h = em_readings_hash(em_meter.secadr);
+	uint32_t seq;
+
+	if (!em_meter.valid || !path || !path[0] || !(t = em_readings_map(path, 1)))
+		return;
+
+	for (unsigned int i = 0; !r && (i < EM_READINGS_SLOTS); i++, h++) {
+		struct em_reading *slot = &t->slot[h & (EM_READINGS_SLOTS - 1)];
+		uint32_t used = __atomic_load_n(&slot->used, __ATOMIC_ACQUIRE);
+		if (!used && __atomic_compare_exchange_n(&slot->used, &used, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			slot->secadr = em_meter.secadr;
+			__atomic_store_n(&slot->used, 2, __ATOMIC_RELEASE);
+			r = slot;
+			break;
+		}
+		used = em_claim_wait(&slot->used, used);
+		if ((used == 2) && (slot->secadr == em_meter.secadr)) r = slot;
+	}
+	if (!r) {
+		log_line(LOG_WARNING, "Readings table '%s' is full", path);
+		munmap(t, sizeof(*t));
+		return;
+	}
+
+	/* sequence lock, odd while writing, writers of other processes wait */
+	double stale = 0;
+	uint32_t held = 0;			/* odd sequence the stale timer runs for */
+	for (;;) {
+		uint32_t cur = __atomic_load_n(&r->seq, __ATOMIC_RELAXED);
+		if (!(cur & 1)) {
+			seq = cur;
+			if (__atomic_compare_exchange_n(&r->seq, &cur, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				break;
+			continue;
+		}
+		if (!stale || (cur != held)) {
+			/* another writer may have come and gone meanwhile, its lock is a new one */
+			held = cur;
+			stale = em_now() + EM_READINGS_STALE / 1000.0;
+		} else if (em_now() > stale) {
+			/* the writer died mid-update, take over its lock with a new odd sequence */
+			seq = cur + 1;
+			if (__atomic_compare_exchange_n(&r->seq, &cur, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				log_line(LOG_WARNING, "Taking over stale lock of reading 0x%08x", em_meter.secadr);
+				break;
+			}
+			stale = 0;
+		}
+		sched_yield();
+	}
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	r->manufacturer = em_meter.manufacturer;
+	r->version = em_meter.version;
+	r->medium = em_meter.medium;
+	r->accesscount = em_meter.accesscount;
+	r->state = em_meter.state;
+	r->time = time(NULL);
+	if (em_meter.highres_valid) {
+		r->flags |= EM_READING_HIGHRES;
+		r->highres = em_meter.highres;
+		r->highres_time = r->time;
+	}
+	if (em_meter.months_valid) {
+		r->flags |= EM_READING_MONTHS;
+		memcpy(r->month_date, em_meter.month_date, sizeof(r->month_date));
+		memcpy(r->month_value, em_meter.month_value, sizeof(r->month_value));
+		r->months_time = r->time;
+	}
+
+	__atomic_store_n(&r->seq, seq + 2, __ATOMIC_RELEASE);
+	munmap(t, sizeof(*t));
+}
+
+int em_readings_dump(const char *path, const char *secadr) {
+	struct em_readings *t = em_readings_map(path, 0);
+	struct em_reading r;
+	char buf[32];
+
+	if (!t)
+		return 1;
+
+	for (unsigned int i = 0; i < EM_READINGS_SLOTS; i++) {
+		if ((__atomic_load_n(&t->slot[i].used, __ATOMIC_ACQUIRE) != 2) || !em_readings_copy(&t->slot[i], &r))
+			continue;
+		if (secadr && (r.secadr != strtoul(secadr, NULL, 16)))
+			continue;
+		time_t ts = r.time;
+		strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&ts));
+		if (r.flags & EM_READING_HIGHRES)
+			log_line(LOG_INFO, "0x%08x %c%c%c v%d %s ACC %3d STATE 0x%02x HIGHRES %u ml", r.secadr,
+				 64 + ((r.manufacturer >> 10) & 0b11111), 64 + ((r.manufacturer >> 5) & 0b11111),
+				 64 + (r.manufacturer & 0b11111), r.version, buf, r.accesscount, r.state, r.highres);
+		else
+			log_line(LOG_INFO, "0x%08x %c%c%c v%d %s ACC %3d STATE 0x%02x", r.secadr,
+				 64 + ((r.manufacturer >> 10) & 0b11111), 64 + ((r.manufacturer >> 5) & 0b11111),
+				 64 + (r.manufacturer & 0b11111), r.version, buf, r.accesscount, r.state);
+		for (unsigned int j = 0; secadr && (r.flags & EM_READING_MONTHS) && (j < 30); j++)
+			log_line(LOG_INFO, "EM_METER_READING_%s: %u", em_datestr(buf, r.month_date[j]), r.month_value[j]);
+	}
+
+	munmap(t, sizeof(*t));
+	return 0;
+}
+
+typedef int32_t em_v8si __attribute__ ((vector_size(32)));
+typedef float em_v8sf __attribute__ ((vector_size(32)));
+
+#define EM_V8(p)		(*(em_v8si *) (p))
+
+enum {
+	EM_ANOMALY_NONE = 0,
+	EM_ANOMALY_ZERO,
+	EM_ANOMALY_VACANCY,
+	EM_ANOMALY_STEP,
+	EM_ANOMALY_RISE,
+	EM_ANOMALY_BACKFLOW,
+};
+
+const char *em_anomaly_names[] = { "-", "zero use", "vacancy", "stepped baseline", "sudden rise", "backflow" };
+
+/* Monthly histories of the whole fleet, one column per half-month, oldest first */
+struct em_fleet {
+	unsigned int meters;
+	unsigned int stride;			/* meters rounded up to the vector width */
+	unsigned int next;			/* work distribution, in vector blocks */
+	uint32_t *secadr;
+	int32_t *value;				/* [period][meter] */
+	uint16_t *date;				/* [period][meter] */
+	float *score;
+	uint8_t *reason;
+	uint8_t *rollovers;
+	int32_t *median;
+	int32_t *recent;
+	int32_t *last;
+	int64_t *usage;				/* per date, summed up over all meters */
+	pthread_mutex_t lock;
+};
+
+void em_v8si_sort(em_v8si *v, const unsigned int n) {
+	/* odd-even transposition network, sorts 8 meters at once */
+	for (unsigned int r = 0; r < n; r++) {
+		for (unsigned int i = r & 1; i + 1 < n; i += 2) {
+			em_v8si m = v[i] < v[i + 1];
+			em_v8si lo = (v[i] & m) | (v[i + 1] & ~m);
+			v[i + 1] = (v[i + 1] & m) | (v[i] & ~m);
+			v[i] = lo;
+		}
+	}
+}
+
+void em_fleet_block(struct em_fleet *f, const unsigned int b, int64_t *usage) {
+	const unsigned int n = EM_ANALYZE_PERIODS - 1;
+	const unsigned int s = f->stride;
+	const unsigned int m0 = b * 8;
+	em_v8si d[EM_ANALYZE_PERIODS - 1], t[EM_ANALYZE_PERIODS - 1];
+	em_v8si zeros = { 0 }, run = { 0 }, neg = { 0 }, roll = { 0 }, med, base, recent, mad;
+
+	for (unsigned int k = 0; k < n; k++) {
+		const em_v8si prev = EM_V8(&f->value[k * s + m0]);
+		const em_v8si next = EM_V8(&f->value[(k + 1) * s + m0]);
+		d[k] = next - prev;
+		/* counter wrapped around */
+		em_v8si wrap = (d[k] < 0) & (prev > EM_ROLLOVER / 2) & (next < EM_ROLLOVER / 2);
+		d[k] += wrap & EM_ROLLOVER;
+		roll -= wrap;
+		neg -= d[k] < 0;
+		zeros -= d[k] == 0;
+		run = (run + 1) & (d[k] == 0);
+	}
+
+	memcpy(t, d, sizeof(t));
+	em_v8si_sort(t, n);
+	med = t[n / 2];
+	memcpy(t, d, (n - 6) * sizeof(t[0]));
+	em_v8si_sort(t, n - 6);
+	base = t[(n - 6) / 2];
+	memcpy(t, d + n - 6, 6 * sizeof(t[0]));
+	em_v8si_sort(t, 6);
+	recent = (t[2] + t[3]) / 2;
+	for (unsigned int k = 0; k < n; k++) {
+		t[k] = d[k] - med;
+		t[k] = (t[k] ^ (t[k] >> 31)) - (t[k] >> 31);
+	}
+	em_v8si_sort(t, n);
+	mad = t[n / 2];
+
+	/* robust z-scores, MAD scaled to standard deviation, +1 l against zero spread */
+	const em_v8sf sigma = __builtin_convertvector(mad, em_v8sf) * 1.4826f + 1.0f;
+	const em_v8sf zstep = __builtin_convertvector(recent - base, em_v8sf) / sigma;
+	const em_v8sf zrise = __builtin_convertvector(d[n - 1] - med, em_v8sf) / sigma;
+
+	for (unsigned int l = 0; (l < 8) && (m0 + l < f->meters); l++) {
+		float score = 0;
+		uint8_t reason = EM_ANOMALY_NONE;
+
+		if (zeros[l] == n) {
+			score = 1;
+			reason = EM_ANOMALY_ZERO;
+		}
+		if ((run[l] >= 4) && (med[l] > 0) && (run[l] * 2.0f > score)) {
+			score = run[l] * 2.0f;
+			reason = EM_ANOMALY_VACANCY;
+		}
+		if (zstep[l] > score) {
+			score = zstep[l];
+			reason = EM_ANOMALY_STEP;
+		}
+		if (zrise[l] > score) {
+			score = zrise[l];
+			reason = EM_ANOMALY_RISE;
+		}
+		if (neg[l] && (10.0f * neg[l] > score)) {
+			score = 10.0f * neg[l];
+			reason = EM_ANOMALY_BACKFLOW;
+		}
+
+		f->score[m0 + l] = score;
+		f->reason[m0 + l] = reason;
+		f->rollovers[m0 + l] = roll[l];
+		f->median[m0 + l] = med[l];
+		f->recent[m0 + l] = recent[l];
+		f->last[m0 + l] = d[n - 1][l];
+		for (unsigned int k = 0; k < n; k++)
+			usage[f->date[(k + 1) * s + m0 + l]] += d[k][l];
+	}
+}
+
+void *em_fleet_worker(void *arg) {
+	struct em_fleet *f = arg;
+	int64_t *usage = calloc(65536, sizeof(*usage));
+	unsigned int b;
+
+	if (!usage)
+		return NULL;
+	while ((b = __atomic_fetch_add(&f->next, 16, __ATOMIC_RELAXED)) < f->stride / 8)
+		for (unsigned int i = b; (i < b + 16) && (i < f->stride / 8); i++)
+			em_fleet_block(f, i, usage);
+
+	pthread_mutex_lock(&f->lock);
+	for (unsigned int i = 0; i < 65536; i++)
+		f->usage[i] += usage[i];
+	pthread_mutex_unlock(&f->lock);
+	free(usage);
+	return NULL;
+}
+
+/* Sort a meter's readings by date, readings of unused storage get the oldest valid value */
+void em_fleet_add(struct em_fleet *f, const struct em_reading *r) {
+	const unsigned int i = f->meters++;
+	uint16_t date[EM_ANALYZE_PERIODS];
+	int32_t value[EM_ANALYZE_PERIODS];
+	unsigned int first = 0;
+
+	for (unsigned int k = 0; k < EM_ANALYZE_PERIODS; k++) {
+		unsigned int j = k;
+		uint16_t dt = r->month_date[k];
+		if (!dt || (dt == 0xffff)) dt = 0;
+		while (j && (date[j - 1] > dt)) {
+			date[j] = date[j - 1];
+			value[j] = value[j - 1];
+			j--;
+		}
+		date[j] = dt;
+		value[j] = r->month_value[k];
+	}
+	while ((first < EM_ANALYZE_PERIODS - 1) && !date[first]) first++;
+
+	f->secadr[i] = r->secadr;
+	for (unsigned int k = 0; k < EM_ANALYZE_PERIODS; k++) {
+		f->value[k * f->stride + i] = value[(k < first) ? first : k];
+		f->date[k * f->stride + i] = date[k];
+	}
+}
+
+int em_cmp_score(const void *a, const void *b, void *arg) {
+	const float *score = arg;
+	const float sa = score[*(const unsigned int *) a], sb = score[*(const unsigned int *) b];
+	return (sa < sb) - (sa > sb);
+}
+
+/*
+   Fleet analytics on the monthly histories in a readings table: consumption
+   per half-month, rollover and backflow checks and robust (median/MAD)
+   anomaly detection, computed column-wise for 8 meters per vector
+   instruction on all cores, then a ranked anomaly report.
+*/
+int em_analyze(const char *path, const unsigned int top) {
+	struct em_readings *t = em_readings_map(path, 0);
+	struct em_fleet f = { .lock = PTHREAD_MUTEX_INITIALIZER };
+	struct em_reading r;
+	unsigned int n = 0, nanom = 0;
+	unsigned int *rank = NULL;
+	int ret = 1;
+
+	if (!t)
+		return ret;
+
+	const double t0 = em_now();
+	for (unsigned int i = 0; i < EM_READINGS_SLOTS; i++)
+		n += (t->slot[i].used == 2) && (t->slot[i].flags & EM_READING_MONTHS);
+	f.stride = (n + 7) & ~7U;
+	f.secadr = calloc(f.stride, sizeof(*f.secadr));
+	f.value = aligned_alloc(64, EM_ANALYZE_PERIODS * f.stride * sizeof(*f.value) + 64);
+	f.date = calloc(EM_ANALYZE_PERIODS * f.stride, sizeof(*f.date));
+	f.score = calloc(f.stride, sizeof(*f.score));
+	f.reason = calloc(f.stride, sizeof(*f.reason));
+	f.rollovers = calloc(f.stride, sizeof(*f.rollovers));
+	f.median = calloc(f.stride, sizeof(*f.median));
+	f.recent = calloc(f.stride, sizeof(*f.recent));
+	f.last = calloc(f.stride, sizeof(*f.last));
+	f.usage = calloc(65536, sizeof(*f.usage));
+	rank = calloc(f.stride, sizeof(*rank));
+	if (!f.secadr || !f.value || !f.date || !f.score || !f.reason || !f.rollovers || !f.median ||
+	    !f.recent || !f.last || !f.usage || !rank) {
+		log_line(LOG_ERR, "Out of memory");
+		goto fail;
+	}
+	memset(f.value, 0, EM_ANALYZE_PERIODS * f.stride * sizeof(*f.value));
+
+	for (unsigned int i = 0; (i < EM_READINGS_SLOTS) && (f.meters < n); i++) {
+		if ((t->slot[i].used != 2) || !em_readings_copy(&t->slot[i], &r) || !(r.flags & EM_READING_MONTHS))
+			continue;
+		em_fleet_add(&f, &r);
+	}
+	const double t1 = em_now();
+
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_t threads[64];
+	if (nthreads < 1) nthreads = 1;
+	if (nthreads > 64) nthreads = 64;
+	for (long i = 1; i < nthreads; i++)
+		if (pthread_create(&threads[i], NULL, em_fleet_worker, &f)) nthreads = i;
+	em_fleet_worker(&f);
+	for (long i = 1; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	for (unsigned int i = 0; i < f.meters; i++)
+		if (f.score[i] >= EM_ANALYZE_THRESHOLD) rank[nanom++] = i;
+	qsort_r(rank, nanom, sizeof(*rank), em_cmp_score, f.score);
+	const double t2 = em_now();
+
+	log_line(LOG_INFO, "Analyzed %u meters with %d half-month periods in %.3f s (load %.3f s, %ld threads)",
+		 f.meters, EM_ANALYZE_PERIODS - 1, t2 - t0, t1 - t0, nthreads);
+
+	log_line(LOG_INFO, "Fleet consumption per half-month:");
+	for (unsigned int d = 65535, shown = 0; d && (shown < 12); d--) {
+		char buf[16];
+		if (!f.usage[d]) continue;
+		log_line(LOG_INFO, "  until %s: %ld l", em_datestr(buf, d), f.usage[d]);
+		shown++;
+	}
+
+	unsigned int rollovers = 0;
+	for (unsigned int i = 0; i < f.meters; i++)
+		rollovers += !!f.rollovers[i];
+	if (rollovers)
+		log_line(LOG_INFO, "%u meters with counter rollover (corrected)", rollovers);
+
+	log_line(LOG_INFO, "Anomalies (top %u of %u, score >= %d):", (nanom < top) ? nanom : top, nanom, EM_ANALYZE_THRESHOLD);
+	log_line(LOG_INFO, "%5s %-10s %7s  %-16s %8s %8s %8s", "RANK", "SECADR", "SCORE", "REASON", "MEDIAN", "RECENT", "LAST");
+	for (unsigned int i = 0; (i < nanom) && (i < top); i++) {
+		const unsigned int m = rank[i];
+		log_line(LOG_INFO, "%5u 0x%08x %7.1f  %-16s %8d %8d %8d", i + 1, f.secadr[m], f.score[m],
+			 em_anomaly_names[f.reason[m]], f.median[m], f.recent[m], f.last[m]);
+	}
+	ret = 0;
+
+ fail:
+	free(f.secadr);
+	free(f.value);
+	free(f.date);
+	free(f.score);
+	free(f.reason);
+	free(f.rollovers);
+	free(f.median);
+	free(f.recent);
+	free(f.last);
+	free(f.usage);
+	free(rank);
+	munmap(t, sizeof(*t));
+	return ret;
+}
+
+/* Run commands on an awake meter */
+int em_run(const int serial_fd, char *cmds[], const int ncmds) {
+	int ret;
+
+	if (!ncmds) {
+		ret = em_get_params(serial_fd);
+	} else {
+		int combine = 0;
+		for (int i = 0; i < ncmds; i++)
+			combine |= (em_find_cmd(cmds[i])->func == em_set_time) | (em_find_cmd(cmds[i])->func == em_set_keyday) << 1;
+
+		ret = 0;
+		for (int i = 0; !ret && (i < ncmds); i++) {
+			int (*func)(int) = em_find_cmd(cmds[i])->func;
+			if (((combine & 3) == 3) && ((func == em_set_time) || (func == em_set_keyday))) {
+				if (combine & 4)
+					continue;
+				combine |= 4;
+				func = em_set_time_keyday;
+			}
+			ret = func(serial_fd);
+		}
+	}
+	return ret;
+}
+
+/* Wake up the meter once and run all commands, stop at the first failing one */
+int em_session(const char *port, char *cmds[], const int ncmds) {
+	int ret;
+	int serial_fd;
+
+	memset(&mbus_stats, 0, sizeof(mbus_stats));
+	memset(&em_meter, 0, sizeof(em_meter));
+	em_model = &em_models[EM_MODEL_DEFAULT];
+	serial_fd = em_open(port);
+	if (serial_fd < 0) {
+		em_stats_record(port, 1);
+		return 1;
+	}
+
+	ret = em_run(serial_fd, cmds, ncmds);
+
+	serial_close(serial_fd);
+	if (em_rt && mbus_stats.timeouts)
+		log_line(LOG_INFO, "Real-time mode: timed out reads returned up to %.0f us late", em_rt_late_max * 1e6);
+	em_stats_record(port, ret);
+	em_readings_publish();
+	return ret;
+}
+
+volatile sig_atomic_t em_probe_stop = 0;
+
+void em_probe_sigint(int sig) {
+	em_probe_stop = 1;
+}
+
+int em_cmp_uint(const void *a, const void *b) {
+	return (*(const unsigned int *) a > *(const unsigned int *) b) - (*(const unsigned int *) a < *(const unsigned int *) b);
+}
+
+void em_probe_show(const unsigned int *rtt, const unsigned char *ok, const unsigned long n, const int live) {
+	unsigned int sorted[EM_PROBE_WINDOW];
+	unsigned int w = (n < EM_PROBE_WINDOW) ? n : EM_PROBE_WINDOW;
+	unsigned int good = 0;
+
+	for (unsigned int i = 0; i < w; i++)
+		if (ok[i]) sorted[good++] = rtt[i];
+	qsort(sorted, good, sizeof(sorted[0]), em_cmp_uint);
+
+	printf("%sRTT p50/p90/p99: %4u/%4u/%4u ms  OK: %2u/%2u (%3u%%)  timeouts: %lu  parity: %lu  checksum: %lu  framing: %lu%s",
+	       live ? "\r" : "",
+	       good ? sorted[good / 2] : 0, good ? sorted[good * 90 / 100] : 0, good ? sorted[good * 99 / 100] : 0,
+	       good, w, w ? 100 * good / w : 0,
+	       mbus_stats.timeouts, mbus_stats.parity_errors, mbus_stats.checksum_errors, mbus_stats.framing_errors,
+	       live ? "\033[K" : "\n");
+	fflush(stdout);
+}
+
+/*
+   Head alignment assistant: wake up once, then repeatedly send the cheapest
+   request (REQ_UD2 short frame) and show link quality of the last exchanges.
+   Each request increments the meter's access counter and costs battery.
+*/
+int em_probe(const char *port, const unsigned long count) {
+	unsigned char frame_in[MBUS_FRAME_MAX_LEN];
+	unsigned char frame_out[] = {
+		MBUS_FRAME_SHORT_START,
+		MBUS_C_REQ_UD2,			/* Control */
+		254,				/* Address */
+		0x00,				/* Checksum */
+		MBUS_FRAME_STOP
+	};
+	unsigned int rtt[EM_PROBE_WINDOW];
+	unsigned char ok[EM_PROBE_WINDOW];
+	unsigned int fails = 0;
+	unsigned long n;
+	const int live = isatty(STDOUT_FILENO);
+
+	int serial_fd = em_open(port);
+	if (serial_fd < 0)
+		return 1;
+
+	signal(SIGINT, em_probe_sigint);
+	log_prio = LOG_CRIT;
+	for (n = 0; !em_probe_stop && (!count || (n < count)); n++) {
+		struct timespec t0, t1;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		ssize_t len = mbus_io(serial_fd, frame_out, sizeof(frame_out), frame_in, sizeof(frame_in));
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+
+		ok[n % EM_PROBE_WINDOW] = (len > 0) && (mbus_checklong(frame_in, len) > 0);
+		rtt[n % EM_PROBE_WINDOW] = (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000;
+		fails = ok[n % EM_PROBE_WINDOW] ? 0 : fails + 1;
+		em_probe_show(rtt, ok, n + 1, live);
+
+		/* meter probably went back to sleep */
+		if (fails >= EM_PROBE_REWAKE) {
+			if (em_wakeup(serial_fd) < 0) break;
+			fails = 0;
+		}
+	}
+	log_prio = LOG_DEBUG;
+	if (live) printf("\n");
+
+	log_line(LOG_INFO, "%lu requests, %lu wakeups, %lu bytes sent, %lu bytes received", mbus_stats.requests,
+		 mbus_stats.wakeups, mbus_stats.bytes_out, mbus_stats.bytes_in);
+	serial_close(serial_fd);
+	em_stats_record(port, 0);
+	return 0;
+}
+
+/*
+   Online segmentation of the high resolution reading into draws (flow of at
+   least EM_FLOW_DRAW) and continuous flow without a pause of EM_FLOW_QUIET,
+   which over EM_FLOW_LEAK hints at a leak. Constant state per head, events
+   are reported as they close.
+*/
+struct em_flow {
+	unsigned long samples;
+	double t;				/* s, monotonic */
+	uint32_t ml;
+	double wall0;				/* realtime of monotonic 0 */
+	double draw_start;			/* 0 if no draw */
+	double draw_last;			/* last sample at draw flow */
+	uint32_t draw_ml;
+	double draw_peak;			/* ml/s */
+	double run_start;			/* 0 if no flow */
+	double run_last;			/* last sample with flow */
+	uint32_t run_ml;
+	uint32_t run_low_ml;			/* outside draws */
+	double run_low_s;
+	int run_leak;				/* reported as a leak */
+	unsigned long draws;
+	uint64_t drawn_ml;
+	unsigned long leaks;
+};
+
+char *em_flow_time(char *buf, const struct em_flow *f, const double t) {
+	const double wall = f->wall0 + t;
+	const time_t s = wall;
+	struct tm tm;
+
+	localtime_r(&s, &tm);
+	sprintf(buf, "%02d:%02d:%04.1f", tm.tm_hour, tm.tm_min, tm.tm_sec + (wall - s));
+	return buf;
+}
+
+void em_flow_draw_end(struct em_flow *f) {
+	const double secs = f->draw_last - f->draw_start;
+	char b0[16], b1[16];
+
+	log_line(LOG_NOTICE, "Draw %s - %s (%.1f s): %u ml, peak %.1f ml/s, mean %.1f ml/s", em_flow_time(b0, f, f->draw_start),
+		 em_flow_time(b1, f, f->draw_last), secs, f->draw_ml, f->draw_peak, secs ? f->draw_ml / secs : 0);
+	f->draws++;
+	f->drawn_ml += f->draw_ml;
+	f->draw_start = 0;
+}
+
+void em_flow_run_end(struct em_flow *f) {
+	char b0[16], b1[16];
+
+	if (f->run_leak)
+		log_line(LOG_NOTICE, "Continuous flow %s - %s (%.0f s) ended: %u ml, %.2f ml/s outside draws",
+			 em_flow_time(b0, f, f->run_start), em_flow_time(b1, f, f->run_last), f->run_last - f->run_start,
+			 f->run_ml, f->run_low_s ? f->run_low_ml / f->run_low_s : 0);
+	f->run_start = 0;
+}
+
+void em_flow_sample(struct em_flow *f, const double t, const uint32_t ml) {
+	char buf[16];
+
+	if (!f->samples++) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		f->wall0 = ts.tv_sec + ts.tv_nsec / 1e9 - t;
+		f->t = t;
+		f->ml = ml;
+		return;
+	}
+	const uint32_t dv = ml - f->ml;
+	const double t0 = f->t, dt = t - t0, rate = (dt > 0) ? dv / dt : 0;
+	f->t = t;
+	f->ml = ml;
+
+	if (dv) {
+		if (!f->run_start) {
+			f->run_start = t0;
+			f->run_ml = f->run_low_ml = f->run_leak = 0;
+			f->run_low_s = 0;
+		}
+		f->run_ml += dv;
+		f->run_last = t;
+	} else if (f->run_start && (t - f->run_last >= EM_FLOW_QUIET)) {
+		em_flow_run_end(f);
+	}
+	if (f->run_start && !f->draw_start && (rate < EM_FLOW_DRAW)) {
+		f->run_low_ml += dv;
+		f->run_low_s += dt;
+	}
+	if (f->run_start && !f->run_leak && (t - f->run_start >= EM_FLOW_LEAK)) {
+		log_line(LOG_NOTICE, "Continuous flow since %s for %.0f s, %.2f ml/s outside draws, leak?",
+			 em_flow_time(buf, f, f->run_start), t - f->run_start, f->run_low_s ? f->run_low_ml / f->run_low_s : 0);
+		f->run_leak = 1;
+		f->leaks++;
+	}
+
+	if (rate >= EM_FLOW_DRAW) {
+		if (!f->draw_start) {
+			f->draw_start = t0;
+			f->draw_ml = 0;
+			f->draw_peak = 0;
+		}
+		f->draw_last = t;
+		if (rate > f->draw_peak)
+			f->draw_peak = rate;
+	}
+	if (f->draw_start) {
+		f->draw_ml += dv;
+		if (t - f->draw_last >= EM_FLOW_DRAW_END)
+			em_flow_draw_end(f);
+	}
+}
+
+/* Read the high resolution volume continuously and segment it, until interrupted */
+int em_flow(int fd) {
+	struct em_flow f = { 0 };
+	struct timespec next;
+	const int prio = log_prio;
+	unsigned int fails = 0;
+	int ret = 0;
+
+	signal(SIGINT, em_probe_sigint);
+	signal(SIGTERM, em_probe_sigint);
+	log_line(LOG_INFO, "Segmenting the flow, reading every %d ms, Ctrl-C to stop", EM_FLOW_INTERVAL);
+	if (log_prio > LOG_NOTICE)
+		log_prio = LOG_NOTICE;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (!em_probe_stop) {
+		struct timespec now;
+
+		if (!(ret = em_read_highres(fd))) {
+			fails = 0;
+			em_flow_sample(&f, em_now(), em_meter.highres);
+		} else if ((++fails >= EM_PROBE_REWAKE) && (em_wakeup(fd) < 0)) {
+			break;
+		} else if (fails >= EM_PROBE_REWAKE) {
+			fails = 0;
+		}
+
+		next.tv_nsec += EM_FLOW_INTERVAL * 1000000L;
+		next.tv_sec += next.tv_nsec / 1000000000;
+		next.tv_nsec %= 1000000000;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if ((next.tv_sec < now.tv_sec) || ((next.tv_sec == now.tv_sec) && (next.tv_nsec < now.tv_nsec)))
+			next = now;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+	if (f.draw_start)
+		em_flow_draw_end(&f);
+	em_flow_run_end(&f);
+	log_line(LOG_NOTICE, "%lu readings, %lu draws with %lu ml, %lu leak suspects (continuous flow > %d s)",
+		 f.samples, f.draws, (unsigned long) f.drawn_ml, f.leaks, EM_FLOW_LEAK);
+	log_prio = prio;
+	return em_probe_stop ? 0 : ret;
+}
+
+struct em_sniff_line {
+	const char *name;
+	int fd;
+	uint8_t dir;
+	uint8_t flags;
+	unsigned int mark;			/* parity mark state, see serial_read */
+	size_t len;
+	uint64_t start_us;			/* first byte of the pending frame */
+	uint64_t last_us;			/* last byte */
+	uint64_t read_us;			/* previous read */
+	unsigned char buf[512];
+};
+
+struct em_sniff {
+	FILE *capture;
+	uint64_t t0_us;
+	int64_t wall_us;			/* realtime minus monotonic clock, for capture timestamps */
+	uint64_t prev_end_us;			/* last byte of the previous frame, either line */
+	uint8_t prev_dir;
+	int prev_wakeup;
+	unsigned long frames[2];
+	unsigned long wakeups, responses;
+	double wakeup_min, wakeup_max;		/* ms */
+	double pause_min;			/* ms from end of wakeup to first request */
+	double resp_sum, resp_min, resp_max;	/* ms from end of request to answer */
+};
+
+/* Monotonic, gaps must not jump with the wall clock */
+uint64_t em_sniff_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Log, decode and store the pending frame of a line */
+void em_sniff_flush(struct em_sniff *sn, struct em_sniff_line *l) {
+	char buf[LOG_BUFSIZE];
+	const size_t fl = mbus_framelen(l->buf, l->len);
+	const double gap = sn->prev_end_us ? (double) ((int64_t) (l->start_us - sn->prev_end_us)) / 1000 : 0;
+	const int wakeup = (l->buf[0] == MBUS_WAKEUP_CHAR);
+
+	if (!l->len)
+		return;
+	if (fl > l->len)
+		l->flags |= EM_FRAME_TRUNCATED;
+
+	for (size_t i = 0; i < l->len; i++) {
+		if ((3 * (i + 1) + 32) >= LOG_BUFSIZE) {
+			sprintf(buf + (3 * i), "(%ld bytes not shown)", l->len - i);
+			break;
+		}
+		sprintf(buf + (3 * i), "%02x ", l->buf[i]);
+	}
+	log_line(LOG_INFO, "%12.6f %+9.1f ms %s%03d%s %s", (l->start_us - sn->t0_us) / 1e6, gap, l->name, l->len,
+		 (l->flags & EM_FRAME_PARITY) ? "!" : ">", wakeup ? "(wakeup)" : buf);
+
+	if (wakeup) {
+		double ms = (l->last_us - l->start_us) / 1e3;
+		log_line(LOG_INFO, "Wakeup: %zu bytes in %.1f ms", l->len, ms);
+		if (!sn->wakeups++ || (ms < sn->wakeup_min)) sn->wakeup_min = ms;
+		if (ms > sn->wakeup_max) sn->wakeup_max = ms;
+	} else {
+		if (sn->prev_wakeup && (l->dir == EM_FRAME_TO_METER)) {
+			log_line(LOG_INFO, "First request %.1f ms after wakeup", gap);
+			if (!sn->pause_min || (gap < sn->pause_min)) sn->pause_min = gap;
+		}
+		if ((l->dir == EM_FRAME_FROM_METER) && (sn->prev_dir == EM_FRAME_TO_METER) && sn->prev_end_us) {
+			if (!sn->responses++ || (gap < sn->resp_min)) sn->resp_min = gap;
+			if (gap > sn->resp_max) sn->resp_max = gap;
+			sn->resp_sum += gap;
+		}
+		if (l->buf[0] == MBUS_FRAME_SHORT_START)
+			mbus_checkshort(l->buf, l->len);
+		else if (l->buf[0] == MBUS_FRAME_LONG_START)
+			mbus_checklong(l->buf, l->len);
+	}
+
+	if (sn->capture) {
+		struct em_frame_rec rec = { .ts_us = l->start_us + sn->wall_us, .dir = l->dir, .flags = l->flags, .len = l->len };
+		if ((fwrite(&rec, sizeof(rec), 1, sn->capture) != 1) || (fwrite(l->buf, l->len, 1, sn->capture) != 1) ||
+		    fflush(sn->capture)) {
+			log_line(LOG_ERR, "Failed to write capture: %s", strerror(errno));
+			fclose(sn->capture);
+			sn->capture = NULL;
+		}
+	}
+
+	sn->frames[l->dir]++;
+	sn->prev_end_us = l->last_us;
+	sn->prev_dir = l->dir;
+	sn->prev_wakeup = wakeup;
+	l->len = 0;
+	l->flags = 0;
+}
+
+/* Split the byte stream of a line into frames: complete M-Bus frames, runs of wakeup bytes, silence */
+void em_sniff_byte(struct em_sniff *sn, struct em_sniff_line *l, const unsigned char c, const uint64_t ts) {
+	if (l->len && ((ts - l->last_us > EM_SNIFF_GAP * 1000) ||
+		       ((l->buf[0] == MBUS_WAKEUP_CHAR) && (c != MBUS_WAKEUP_CHAR))))
+		em_sniff_flush(sn, l);
+	if (!l->len)
+		l->start_us = ts;
+	l->buf[l->len++] = c;
+	l->last_us = ts;
+
+	size_t fl = mbus_framelen(l->buf, l->len);
+	if ((fl && (l->len >= fl)) || (l->len == sizeof(l->buf)))
+		em_sniff_flush(sn, l);
+}
+
+void em_sniff_read(struct em_sniff *sn, struct em_sniff_line *l) {
+	unsigned char raw[256];
+	ssize_t n = read(l->fd, raw, sizeof(raw));
+	const uint64_t now = em_sniff_now();
+
+	/*
+	 * A read returns after the last byte, earlier ones arrived a character time apart,
+	 * but not before the previous read or the end of the previous frame (ptys deliver at once).
+	 */
+	const uint64_t floor = (l->read_us > sn->prev_end_us) ? l->read_us : sn->prev_end_us;
+	l->read_us = now;
+	for (ssize_t i = 0; i < n; i++) {
+		uint64_t ts = now - (n - 1 - i) * EM_SNIFF_CHAR_US;
+		if (ts < floor)
+			ts = floor;
+		if (serial_parmrk) {
+			if (!l->mark && (raw[i] == 0xff)) {
+				l->mark = 1;
+				continue;
+			}
+			if (l->mark == 1) {
+				l->mark = (raw[i] == 0xff) ? 0 : 2;
+				if (l->mark) continue;
+			} else if (l->mark == 2) {
+				l->flags |= EM_FRAME_PARITY;
+				mbus_stats.parity_errors++;
+				l->mark = 0;
+			}
+		}
+		em_sniff_byte(sn, l, raw[i], ts);
+	}
+}
+
+/* Listen on the tapped TX and RX lines of an opto head and reconstruct the conversation */
+int em_sniff(const char *tx, const char *rx, const char *path) {
+	struct em_sniff_line lines[2] = {
+		{ .name = "TX>", .dir = EM_FRAME_TO_METER, .fd = -1 },
+		{ .name = "RX<", .dir = EM_FRAME_FROM_METER, .fd = -1 },
+	};
+	const char *ports[2] = { tx, rx };
+	struct em_sniff sn = { 0 };
+	int ret = 1;
+
+	for (int i = 0; i < 2; i++) {
+		if ((lines[i].fd = open(ports[i], O_RDONLY | O_NOCTTY | O_NONBLOCK)) < 0) {
+			log_line(LOG_ERR, "Failed to open serial port '%s': %s", ports[i], strerror(errno));
+			goto out;
+		}
+		if (serial_interface_attribs(lines[i].fd, B2400, PARENB) < 0) {
+			log_line(LOG_ERR, "Failed to set serial port attribs");
+			goto out;
+		}
+	}
+	if (path) {
+		struct em_frames_hdr hdr = { .magic = EM_FRAMES_MAGIC };
+		if (!(sn.capture = fopen(path, "w")) || (fwrite(&hdr, sizeof(hdr), 1, sn.capture) != 1)) {
+			log_line(LOG_ERR, "Failed to create capture '%s': %s", path, strerror(errno));
+			goto out;
+		}
+	}
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	signal(SIGINT, em_probe_sigint);
+	log_line(LOG_INFO, "Sniffing TX '%s' and RX '%s', Ctrl-C to stop", tx, rx);
+	struct timespec wall;
+	clock_gettime(CLOCK_REALTIME, &wall);
+	sn.t0_us = em_sniff_now();
+	sn.wall_us = wall.tv_sec * 1000000LL + wall.tv_nsec / 1000 - (int64_t) sn.t0_us;
+
+	struct pollfd pfd[2] = { { .fd = lines[0].fd, .events = POLLIN }, { .fd = lines[1].fd, .events = POLLIN } };
+	while (!em_probe_stop) {
+		if ((poll(pfd, 2, EM_SNIFF_GAP) < 0) && (errno != EINTR))
+			break;
+		for (int i = 0; i < 2; i++)
+			if (pfd[i].revents & POLLIN)
+				em_sniff_read(&sn, &lines[i]);
+		/* frames cut short by silence */
+		const uint64_t now = em_sniff_now();
+		for (int i = 0; i < 2; i++)
+			if (lines[i].len && (now - lines[i].last_us > EM_SNIFF_GAP * 1000))
+				em_sniff_flush(&sn, &lines[i]);
+	}
+	for (int i = 0; i < 2; i++)
+		em_sniff_flush(&sn, &lines[i]);
+
+	log_line(LOG_INFO, "%lu frames to the meter, %lu from the meter, %lu parity and %lu checksum errors",
+		 sn.frames[EM_FRAME_TO_METER], sn.frames[EM_FRAME_FROM_METER], mbus_stats.parity_errors, mbus_stats.checksum_errors);
+	if (sn.wakeups)
+		log_line(LOG_INFO, "Wakeup: %lu times, %.1f - %.1f ms, first request %.1f ms after it at the earliest",
+			 sn.wakeups, sn.wakeup_min, sn.wakeup_max, sn.pause_min);
+	if (sn.responses)
+		log_line(LOG_INFO, "Response latency: min %.1f ms, avg %.1f ms, max %.1f ms (%lu responses)",
+			 sn.resp_min, sn.resp_sum / sn.responses, sn.resp_max, sn.responses);
+	ret = 0;
+ out:
+	if (sn.capture) fclose(sn.capture);
+	for (int i = 0; i < 2; i++)
+		if (lines[i].fd >= 0) close(lines[i].fd);
+	return ret;
+}
+
+typedef uint8_t em_v16qu __attribute__ ((vector_size(16)));
+
+#define EM_IMPORT_SECADR	0xff		/* internal record: meter of the session, data is the address */
+
+struct em_import_event {
+	uint32_t tag;				/* hash of the log tag (port), 0 if none */
+	struct em_frame_rec rec;
+} __attribute__ ((packed));
+
+struct em_import_chunk {
+	const char *data;
+	size_t len;
+	int year;				/* for syslog timestamps */
+	size_t map;				/* first chunk of its log file: length of the mapping */
+	int done;
+	int err;				/* events lost, the import fails */
+	unsigned char *out;			/* events */
+	size_t outlen;
+	size_t outcap;
+	unsigned long lines;
+	unsigned long frames;
+	unsigned long truncated;
+	unsigned long readings;
+};
+
+struct em_import {
+	struct em_import_chunk *chunks;
+	unsigned int nchunks;
+	unsigned int next;			/* work distribution */
+	unsigned int written;			/* chunks handed to the writer, limits the lead of the workers */
+	unsigned int lead;
+	int stop;				/* writer failed, workers quit */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static inline em_v16qu em_import_nibbles(const em_v16qu c) {
+	const em_v16qu d = c - '0', a = (c | 0x20) - ('a' - 10);
+	const em_v16qu digit = d < 10;
+	return (d & digit) | (a & ~digit);
+}
+
+/* Hex dump "xx xx xx ..." to bytes, 10 bytes from 32 characters per vector step */
+size_t em_import_hex(const char *s, const char *end, unsigned char *out, const size_t max) {
+	const em_v16qu hi = { 0, 3, 6, 9, 12, 15, 18, 21, 24, 27, 0, 0, 0, 0, 0, 0 };
+	const em_v16qu lo = { 1, 4, 7, 10, 13, 16, 19, 22, 25, 28, 1, 1, 1, 1, 1, 1 };
+	const em_v16qu sp = { 2, 5, 8, 11, 14, 17, 20, 23, 26, 29, 2, 2, 2, 2, 2, 2 };
+	size_t n = 0;
+
+	while ((end - s >= 32) && (n + 16 <= max)) {
+		em_v16qu a, b;
+		memcpy(&a, s, 16);
+		memcpy(&b, s + 16, 16);
+		const em_v16qu h = em_import_nibbles(__builtin_shuffle(a, b, hi));
+		const em_v16qu l = em_import_nibbles(__builtin_shuffle(a, b, lo));
+		const em_v16qu bad = ((h | l) > 15) | (__builtin_shuffle(a, b, sp) != ' ');
+		uint64_t b0, b1;
+		memcpy(&b0, &bad, 8);
+		memcpy(&b1, (const char *) &bad + 8, 8);
+		if (b0 || (b1 & 0xffff))
+			break;
+		const em_v16qu v = (h << 4) | l;
+		memcpy(out + n, &v, 16);
+		n += 10;
+		s += 30;
+	}
+	while ((end - s >= 2) && (n < max) && isxdigit((unsigned char) s[0]) && isxdigit((unsigned char) s[1])) {
+		out[n++] = (s[0] <= '9' ? s[0] - '0' : (s[0] | 0x20) - 'a' + 10) << 4 |
+			   (s[1] <= '9' ? s[1] - '0' : (s[1] | 0x20) - 'a' + 10);
+		s += 2;
+		if ((s == end) || (*s != ' '))
+			break;
+		s++;
+	}
+	return n;
+}
+
+/* Days since 1970-01-01 of a proleptic Gregorian date */
+int64_t em_import_days(int y, const unsigned int m, const unsigned int d) {
+	y -= m <= 2;
+	const int64_t era = (y >= 0 ? y : y - 399) / 400;
+	const unsigned int yoe = y - era * 400;
+	const unsigned int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+unsigned int em_import_num(const char *s, const unsigned int digits) {
+	unsigned int v = 0;
+	for (unsigned int i = 0; i < digits; i++) {
+		if ((s[i] < '0') || (s[i] > '9'))
+			return UINT_MAX;
+		v = v * 10 + s[i] - '0';
+	}
+	return v;
+}
+
+/* Leading "YYYY-MM-DD HH:MM:SS[.ffffff]" or syslog "Mmm dd HH:MM:SS", taken as UTC; 0 if none */
+uint64_t em_import_time(const char *s, const char *end, const int year) {
+	static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	unsigned int y, mo, d, off;
+
+	if ((end - s >= 19) && (s[4] == '-') && (s[7] == '-') && ((s[10] == ' ') || (s[10] == 'T'))) {
+		y = em_import_num(s, 4);
+		mo = em_import_num(s + 5, 2);
+		d = em_import_num(s + 8, 2);
+		off = 11;
+	} else if ((end - s >= 15) && (s[3] == ' ')) {
+		const char *m = memmem(months, sizeof(months) - 1, s, 3);
+		if (!m || ((m - months) % 3))
+			return 0;
+		y = year;
+		mo = (m - months) / 3 + 1;
+		d = em_import_num(s + 4 + (s[4] == ' '), 2 - (s[4] == ' '));
+		off = 7;
+	} else {
+		return 0;
+	}
+	const unsigned int hh = em_import_num(s + off, 2), mm = em_import_num(s + off + 3, 2), ss = em_import_num(s + off + 6, 2);
+	if ((y == UINT_MAX) || (mo < 1) || (mo > 12) || (d < 1) || (d > 31) || (hh > 23) || (mm > 59) || (ss > 60) ||
+	    (s[off + 2] != ':') || (s[off + 5] != ':'))
+		return 0;
+	uint64_t us = ((em_import_days(y, mo, d) * 24 + hh) * 60 + mm) * 60 + ss;
+	us *= 1000000;
+	if ((end - s > off + 9) && (s[off + 8] == '.')) {
+		unsigned int scale = 100000;
+		for (const char *f = s + off + 9; (f < end) && (*f >= '0') && (*f <= '9') && scale; f++, scale /= 10)
+			us += (*f - '0') * scale;
+	}
+	return us;
+}
+
+void *em_import_add(struct em_import_chunk *c, const uint32_t tag, const uint64_t ts, const uint8_t dir,
+		    const uint8_t flags, const size_t len) {
+	const struct em_import_event ev = { .tag = tag, .rec = { .ts_us = ts, .dir = dir, .flags = flags, .len = len } };
+
+	if (c->err)
+		return NULL;
+	if (c->outlen + sizeof(ev) + len > c->outcap) {
+		const size_t cap = c->outcap ? 2 * c->outcap : (c->len / 2 + 4096);
+		unsigned char *out = realloc(c->out, cap);
+		if (!out) {
+			c->err = ENOMEM;
+			return NULL;
+		}
+		c->out = out;
+		c->outcap = cap;
+	}
+	memcpy(c->out + c->outlen, &ev, sizeof(ev));
+	c->outlen += sizeof(ev) + len;
+	return c->out + c->outlen - len;
+}
+
+/* One log line: frames, readings, meter address and session starts, in the context of its tag */
+void em_import_line(struct em_import_chunk *c, const char *s, const char *end) {
+	unsigned char frame[512];
+	const char *p, *name = NULL;
+	uint32_t tag = 0;
+
+	if (!(p = memmem(s, end - s, "UART", 4)) && !(p = memmem(s, end - s, "EM_", 3)) &&
+	    !(p = memmem(s, end - s, "MBUS_SECADR: ", 13)) && !(p = memmem(s, end - s, "Sending wakeup", 14)))
+		return;
+	const uint64_t ts = em_import_time(s, end, c->year);
+
+	/* "[port] " of supervise mode */
+	const char *t = p;
+	if ((t - s >= 3) && (t[-1] == ' ') && (t[-2] == ']')) {
+		const char *open = t - 2;
+		while ((open > s) && (*open != '['))
+			open--;
+		if (*open == '[') {
+			name = open + 1;
+			tag = 2166136261u;
+			for (const char *q = open + 1; q < t - 2; q++)
+				tag = (tag ^ (unsigned char) *q) * 16777619;
+			tag |= 1;
+		}
+	}
+
+	if ((end - p >= 9) && (p[0] == 'U') && ((p[4] == '>') || (p[4] == '<')) && (p[8] == p[4])) {
+		const unsigned int len = em_import_num(p + 5, 3);
+		const size_t n = em_import_hex(p + 10, end, frame, sizeof(frame) - 16);
+		if (!n || (len == UINT_MAX) || (frame[0] == MBUS_WAKEUP_CHAR))
+			return;
+		const int truncated = (n < len);
+		void *d = em_import_add(c, tag, ts, (p[4] == '>') ? EM_FRAME_TO_METER : EM_FRAME_FROM_METER,
+					truncated ? EM_FRAME_TRUNCATED : 0, n);
+		if (d)
+			memcpy(d, frame, n);
+		c->frames++;
+		c->truncated += truncated;
+	} else if ((end - p > 17) && !memcmp(p, "EM_METER_READING_", 17)) {
+		struct em_frame_reading r = { .kind = EM_FRAME_READING_MONTH };
+		const unsigned int y = em_import_num(p + 17, 4), mo = em_import_num(p + 22, 2), d = em_import_num(p + 25, 2);
+		if ((end - p < 30) || (y == UINT_MAX) || (mo == UINT_MAX) || (d == UINT_MAX) || (p[27] != ':'))
+			return;
+		r.date = (y - 2000) << 9 | mo << 5 | d;
+		r.value = strtoul(p + 28, NULL, 10);
+		void *e = em_import_add(c, tag, ts, EM_FRAME_READING, 0, sizeof(r));
+		if (e)
+			memcpy(e, &r, sizeof(r));
+		c->readings++;
+	} else if ((end - p > 20) && !memcmp(p, "EM_HIGHRES_READING: ", 20)) {
+		struct em_frame_reading r = { .kind = EM_FRAME_READING_HIGHRES, .value = strtoul(p + 20, NULL, 10) };
+		void *e = em_import_add(c, tag, ts, EM_FRAME_READING, 0, sizeof(r));
+		if (e)
+			memcpy(e, &r, sizeof(r));
+		c->readings++;
+	} else if ((end - p > 13) && !memcmp(p, "MBUS_SECADR: ", 13)) {
+		uint32_t secadr = strtoul(p + 13, NULL, 16);
+		void *e = em_import_add(c, tag, ts, EM_IMPORT_SECADR, 0, sizeof(secadr));
+		if (e)
+			memcpy(e, &secadr, sizeof(secadr));
+	} else if (p[0] == 'S') {
+		const size_t len = name ? (size_t) (p - name - 2) : 0;
+		char *e = em_import_add(c, tag, ts, EM_FRAME_SESSION, 0, len);
+		if (e && len)
+			memcpy(e, name, len);
+	}
+}
+
+void *em_import_worker(void *arg) {
+	struct em_import *im = arg;
+	unsigned int i;
+
+	while ((i = __atomic_fetch_add(&im->next, 1, __ATOMIC_RELAXED)) < im->nchunks) {
+		struct em_import_chunk *c = &im->chunks[i];
+
+		/* do not run too far ahead of the writer, the events are held in memory */
+		pthread_mutex_lock(&im->lock);
+		while ((i >= im->written + im->lead) && !im->stop)
+			pthread_cond_wait(&im->cond, &im->lock);
+		pthread_mutex_unlock(&im->lock);
+		if (im->stop)
+			break;
+
+		for (const char *s = c->data, *end = c->data + c->len; s < end; ) {
+			const char *nl = memchr(s, '\n', end - s);
+			const char *e = nl ? nl : end;
+			em_import_line(c, s, e);
+			c->lines++;
+			s = e + 1;
+		}
+		pthread_mutex_lock(&im->lock);
+		c->done = 1;
+		pthread_cond_broadcast(&im->cond);
+		pthread_mutex_unlock(&im->lock);
+	}
+	return NULL;
+}
+
+/* Import em-admin console logs into a frame archive, in order, using all cores */
+int em_import(const char *path, char *logs[], const int nlogs) {
+	struct em_import im = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+	struct { uint32_t tag; uint32_t secadr; } tags[EM_IMPORT_TAGS] = { { 0 } };
+	unsigned long lines = 0, frames = 0, truncated = 0, readings = 0, sessions = 0, unknown = 0;
+	size_t total = 0, cap = 0;
+	uint64_t last_ts = 0;
+	int ret = 1;
+
+	const double t0 = em_now();
+	for (int f = 0; f < nlogs; f++) {
+		struct stat sb;
+		struct tm tm;
+		int fd = open(logs[f], O_RDONLY | O_CLOEXEC);
+		if ((fd < 0) || fstat(fd, &sb)) {
+			log_line(LOG_ERR, "Failed to open log '%s': %s", logs[f], strerror(errno));
+			if (fd >= 0) close(fd);
+			goto out;
+		}
+		if (!sb.st_size) {
+			close(fd);
+			continue;
+		}
+		const char *data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (data == MAP_FAILED) {
+			log_line(LOG_ERR, "Failed to map log '%s': %s", logs[f], strerror(errno));
+			goto out;
+		}
+		madvise((void *) data, sb.st_size, MADV_SEQUENTIAL);
+		gmtime_r(&sb.st_mtime, &tm);
+		total += sb.st_size;
+
+		/* chunks end at line ends */
+		for (size_t s = 0; s < sb.st_size; ) {
+			size_t e = s + EM_IMPORT_CHUNK;
+			if (e >= sb.st_size) {
+				e = sb.st_size;
+			} else {
+				const char *nl = memchr(data + e, '\n', sb.st_size - e);
+				e = nl ? (size_t) (nl - data) + 1 : sb.st_size;
+			}
+			if (im.nchunks == cap) {
+				const size_t ncap = cap ? 2 * cap : 64;
+				struct em_import_chunk *chunks = realloc(im.chunks, ncap * sizeof(*im.chunks));
+				if (!chunks) {
+					log_line(LOG_ERR, "Out of memory");
+					if (!s)
+						munmap((void *) data, sb.st_size);
+					goto out;
+				}
+				im.chunks = chunks;
+				cap = ncap;
+			}
+			im.chunks[im.nchunks++] = (struct em_import_chunk) {
+				.data = data + s, .len = e - s, .year = tm.tm_year + 1900, .map = s ? 0 : sb.st_size
+			};
+			s = e;
+		}
+	}
+
+	FILE *out = fopen(path, "w");
+	struct em_frames_hdr hdr = { .magic = EM_FRAMES_MAGIC };
+	if (!out || (fwrite(&hdr, sizeof(hdr), 1, out) != 1)) {
+		log_line(LOG_ERR, "Failed to create archive '%s': %s", path, strerror(errno));
+		if (out) fclose(out);
+		goto out;
+	}
+	setvbuf(out, NULL, _IOFBF, 1 << 20);
+
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_t threads[64];
+	if (nthreads < 1) nthreads = 1;
+	if (nthreads > 64) nthreads = 64;
+	im.lead = 2 * nthreads;
+	for (long i = 0; i < nthreads; i++)
+		if (pthread_create(&threads[i], NULL, em_import_worker, &im)) nthreads = i;
+	if (!nthreads) {
+		im.lead = im.nchunks;
+		em_import_worker(&im);
+	}
+
+	/* write in log order, tracking the meter of each port's session */
+	for (unsigned int i = 0; i < im.nchunks; i++) {
+		struct em_import_chunk *c = &im.chunks[i];
+
+		pthread_mutex_lock(&im.lock);
+		while (!c->done)
+			pthread_cond_wait(&im.cond, &im.lock);
+		pthread_mutex_unlock(&im.lock);
+
+		if (c->err) {
+			log_line(LOG_ERR, "Failed to import '%s': %s", path, strerror(c->err));
+			break;
+		}
+		if (c->map)
+			last_ts = 0;
+		for (size_t p = 0; p < c->outlen; ) {
+			struct em_import_event ev;
+			memcpy(&ev, c->out + p, sizeof(ev));
+			unsigned char *data = c->out + p + sizeof(ev);
+			unsigned int h = ev.tag % EM_IMPORT_TAGS, n = 0;
+			p += sizeof(ev) + ev.rec.len;
+
+			while (tags[h].tag && (tags[h].tag != ev.tag) && (++n < EM_IMPORT_TAGS))
+				h = (h + 1) % EM_IMPORT_TAGS;
+			if (n == EM_IMPORT_TAGS) {
+				log_line(LOG_ERR, "More than %d ports in the logs", EM_IMPORT_TAGS);
+				c->err = ENOSPC;
+				break;
+			}
+			tags[h].tag = ev.tag;
+			if (ev.rec.ts_us)
+				last_ts = ev.rec.ts_us;
+			else
+				ev.rec.ts_us = last_ts;
+			if (ev.rec.dir == EM_IMPORT_SECADR) {
+				memcpy(&tags[h].secadr, data, sizeof(tags[h].secadr));
+				continue;
+			}
+			if (ev.rec.dir == EM_FRAME_SESSION) {
+				tags[h].secadr = 0;
+				sessions++;
+			}
+			if (ev.rec.dir == EM_FRAME_READING) {
+				memcpy(data, &tags[h].secadr, sizeof(tags[h].secadr));
+				unknown += !tags[h].secadr;
+			}
+			fwrite(&ev.rec, sizeof(ev.rec), 1, out);
+			fwrite(data, ev.rec.len, 1, out);
+		}
+		if (c->err)
+			break;
+		lines += c->lines;
+		frames += c->frames;
+		truncated += c->truncated;
+		readings += c->readings;
+		free(c->out);
+		c->out = NULL;
+
+		pthread_mutex_lock(&im.lock);
+		im.written = i + 1;
+		pthread_cond_broadcast(&im.cond);
+		pthread_mutex_unlock(&im.lock);
+	}
+	pthread_mutex_lock(&im.lock);
+	im.stop = 1;
+	pthread_cond_broadcast(&im.cond);
+	pthread_mutex_unlock(&im.lock);
+	for (long i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	if (fclose(out) || (im.written < im.nchunks)) {
+		if (im.written == im.nchunks)
+			log_line(LOG_ERR, "Failed to write archive '%s': %s", path, strerror(errno));
+		unlink(path);
+		goto out;
+	}
+
+	const double t = em_now() - t0;
+	log_line(LOG_INFO, "Imported %lu lines (%.1f MB) in %.3f s, %.1f MB/s with %ld threads", lines, total / 1e6, t,
+		 total / 1e6 / t, nthreads ? nthreads : 1);
+	log_line(LOG_INFO, "%lu sessions, %lu frames (%lu truncated), %lu readings (%lu without meter address)",
+		 sessions, frames, truncated, readings, unknown);
+	ret = 0;
+ out:
+	for (unsigned int i = 0; i < im.nchunks; i++) {
+		free(im.chunks[i].out);
+		if (im.chunks[i].map)
+			munmap((void *) im.chunks[i].data, im.chunks[i].map);
+	}
+	free(im.chunks);
+	return ret;
+}
+
+/* Flatbuffers built front to back: children follow the tables referencing them, offsets are patched in */
+struct em_fb {
+	uint8_t *buf;
+	size_t len;
+};
+
+size_t em_fb_alloc(struct em_fb *fb, const size_t size, const size_t align) {
+	const size_t pos = (fb->len + align - 1) & ~(align - 1);
+	memset(fb->buf + fb->len, 0, pos + size - fb->len);
+	fb->len = pos + size;
+	return pos;
+}
+
+void em_fb_put(struct em_fb *fb, const size_t pos, const uint64_t v, const unsigned int size) {
+	memcpy(fb->buf + pos, &v, size);
+}
+
+void em_fb_ref(struct em_fb *fb, const size_t pos, const size_t target) {
+	em_fb_put(fb, pos, target - pos, 4);
+}
+
+/* Table preceded by its vtable, fields of size 0 are absent; returns the table and the field positions */
+size_t em_fb_table(struct em_fb *fb, const unsigned int n, const uint8_t *sizes, size_t *field) {
+	const size_t vt = em_fb_alloc(fb, 4 + 2 * n, 2);
+	uint16_t off = 4;
+
+	for (unsigned int i = 0; i < n; i++)
+		if (sizes[i] == 8) off = 8;
+	for (unsigned int s = 8; s; s >>= 1)
+		for (unsigned int i = 0; i < n; i++)
+			if (sizes[i] == s) {
+				em_fb_put(fb, vt + 4 + 2 * i, off, 2);
+				off += s;
+			}
+	const size_t t = em_fb_alloc(fb, off, 8);
+	em_fb_put(fb, vt, 4 + 2 * n, 2);
+	em_fb_put(fb, vt + 2, off, 2);
+	em_fb_put(fb, t, t - vt, 4);
+	for (unsigned int i = 0; i < n; i++) {
+		uint16_t o;
+		memcpy(&o, fb->buf + vt + 4 + 2 * i, 2);
+		field[i] = t + o;
+	}
+	return t;
+}
+
+/* Vector of n elements, they start 4 bytes after the returned length field */
+size_t em_fb_vector(struct em_fb *fb, const unsigned int n, const size_t size, const size_t align) {
+	const size_t a = (align < 4) ? 4 : align;
+	const size_t pos = ((fb->len + 4 + a - 1) & ~(a - 1)) - 4;
+	em_fb_alloc(fb, pos + 4 + n * size - fb->len, 1);
+	em_fb_put(fb, pos, n, 4);
+	return pos;
+}
+
+size_t em_fb_string(struct em_fb *fb, const char *s) {
+	const size_t v = em_fb_vector(fb, strlen(s) + 1, 1, 4);
+	em_fb_put(fb, v, strlen(s), 4);
+	memcpy(fb->buf + v + 4, s, strlen(s));
+	return v;
+}
+
+#define EM_ARROW_SECADR		0		/* dictionary encoded uint32, the value is the dictionary index */
+#define EM_ARROW_U8		1
+#define EM_ARROW_U16		2
+#define EM_ARROW_U32		3
+#define EM_ARROW_TIME		4		/* timestamp[s, UTC] */
+#define EM_ARROW_DATE		5		/* date32, days since epoch */
+#define EM_ARROW_BOOL		6
+#define EM_ARROW_STR		7		/* utf8, up to EM_ARROW_STR_MAX bytes */
+
+#define EM_ARROW_STR_MAX	8
+#define EM_ARROW_COLS		16
+
+const uint8_t em_arrow_width[] = { 4, 1, 2, 4, 8, 4, 0, 4 };
+
+struct em_arrow_col {
+	const char *name;
+	uint8_t type;
+	uint8_t nullable;
+	uint8_t *valid;				/* bitmap */
+	uint8_t *data;				/* values, offsets for strings */
+	uint8_t *str;
+	unsigned int nulls;
+};
+
+struct em_arrow_block {
+	uint64_t off;
+	uint32_t meta;
+	uint64_t body;
+};
+
+struct em_arrow_buf {
+	const void *data;
+	uint64_t len;
+};
+
+/* Arrow IPC file, written in record batches of EM_ARROW_BATCH rows */
+struct em_arrow {
+	FILE *out;
+	uint64_t off;				/* file position */
+	struct em_arrow_col col[EM_ARROW_COLS];
+	unsigned int ncols;
+	unsigned int c;				/* next column of the row */
+	unsigned int rows;			/* of the current batch */
+	unsigned long total;
+	const uint32_t *dict;
+	unsigned int ndict;
+	struct em_arrow_block dict_block;
+	struct em_arrow_block *blocks;
+	unsigned int nblocks;
+	struct em_fb fb;
+};
+
+/* Message of the given header type, returns the position of the header reference */
+size_t em_arrow_message(struct em_fb *fb, const uint8_t type, const uint64_t body) {
+	size_t f[4];
+
+	fb->len = 0;
+	em_fb_alloc(fb, 4, 4);
+	em_fb_ref(fb, 0, em_fb_table(fb, 4, (const uint8_t []) { 2, 1, 4, 8 }, f));
+	em_fb_put(fb, f[0], 4, 2);		/* MetadataVersion V5 */
+	em_fb_put(fb, f[1], type, 1);
+	em_fb_put(fb, f[3], body, 8);
+	return f[2];
+}
+
+size_t em_arrow_int(struct em_fb *fb, const unsigned int bits, const int is_signed) {
+	size_t f[2];
+	const size_t t = em_fb_table(fb, 2, (const uint8_t []) { 4, 1 }, f);
+	em_fb_put(fb, f[0], bits, 4);
+	em_fb_put(fb, f[1], is_signed, 1);
+	return t;
+}
+
+size_t em_arrow_schema(struct em_arrow *a) {
+	struct em_fb *fb = &a->fb;
+	size_t f[6];
+
+	const size_t schema = em_fb_table(fb, 2, (const uint8_t []) { 2, 4 }, f);
+	em_fb_put(fb, f[0], 0, 2);		/* little endian */
+	const size_t fields = em_fb_vector(fb, a->ncols, 4, 4);
+	em_fb_ref(fb, f[1], fields);
+
+	for (unsigned int i = 0; i < a->ncols; i++) {
+		const struct em_arrow_col *c = &a->col[i];
+		static const uint8_t types[] = { 2, 2, 2, 2, 10, 8, 6, 5 };	/* Int, Timestamp, Date, Bool, Utf8 */
+		size_t t[4];
+
+		em_fb_ref(fb, fields + 4 + 4 * i, em_fb_table(fb, 6, (const uint8_t []) { 4, 1, 1, 4,
+				(c->type == EM_ARROW_SECADR) ? 4 : 0, 4 }, f));
+		em_fb_ref(fb, f[0], em_fb_string(fb, c->name));
+		em_fb_put(fb, f[1], c->nullable, 1);
+		em_fb_put(fb, f[2], types[c->type], 1);
+		em_fb_ref(fb, f[5], em_fb_vector(fb, 0, 4, 4));
+		switch (c->type) {
+		case EM_ARROW_SECADR:
+		case EM_ARROW_U8:
+		case EM_ARROW_U16:
+		case EM_ARROW_U32:
+			em_fb_ref(fb, f[3], em_arrow_int(fb, 8 * ((c->type == EM_ARROW_SECADR) ? 4 : em_arrow_width[c->type]), 0));
+			break;
+		case EM_ARROW_TIME:
+			em_fb_ref(fb, f[3], em_fb_table(fb, 2, (const uint8_t []) { 2, 4 }, t));
+			em_fb_put(fb, t[0], 0, 2);	/* SECOND */
+			em_fb_ref(fb, t[1], em_fb_string(fb, "UTC"));
+			break;
+		case EM_ARROW_DATE:
+			em_fb_ref(fb, f[3], em_fb_table(fb, 1, (const uint8_t []) { 2 }, t));
+			em_fb_put(fb, t[0], 0, 2);	/* DAY */
+			break;
+		default:
+			em_fb_ref(fb, f[3], em_fb_table(fb, 0, NULL, t));
+		}
+		if (c->type == EM_ARROW_SECADR) {
+			/* sorted secondary addresses, dictionary 0 */
+			em_fb_ref(fb, f[4], em_fb_table(fb, 3, (const uint8_t []) { 8, 4, 1 }, t));
+			em_fb_put(fb, t[0], 0, 8);
+			em_fb_ref(fb, t[1], em_arrow_int(fb, 32, 1));
+			em_fb_put(fb, t[2], 1, 1);
+		}
+	}
+	return schema;
+}
+
+/* RecordBatch of one node per column and its buffers */
+size_t em_arrow_batch(struct em_fb *fb, const uint64_t rows, const uint64_t *nulls, const unsigned int nnodes,
+		      const struct em_arrow_buf *b, const unsigned int nbufs) {
+	size_t f[3];
+	uint64_t off = 0;
+
+	const size_t t = em_fb_table(fb, 3, (const uint8_t []) { 8, 4, 4 }, f);
+	em_fb_put(fb, f[0], rows, 8);
+	const size_t nodes = em_fb_vector(fb, nnodes, 16, 8);
+	em_fb_ref(fb, f[1], nodes);
+	for (unsigned int i = 0; i < nnodes; i++) {
+		em_fb_put(fb, nodes + 4 + 16 * i, rows, 8);
+		em_fb_put(fb, nodes + 4 + 16 * i + 8, nulls[i], 8);
+	}
+	const size_t bufs = em_fb_vector(fb, nbufs, 16, 8);
+	em_fb_ref(fb, f[2], bufs);
+	for (unsigned int i = 0; i < nbufs; i++) {
+		em_fb_put(fb, bufs + 4 + 16 * i, off, 8);
+		em_fb_put(fb, bufs + 4 + 16 * i + 8, b[i].len, 8);
+		off += (b[i].len + EM_ARROW_ALIGN - 1) & ~(EM_ARROW_ALIGN - 1);
+	}
+	return t;
+}
+
+/* Encapsulated message: metadata padded so that the body starts aligned, then the body */
+void em_arrow_send(struct em_arrow *a, const struct em_arrow_buf *b, const unsigned int nbufs, struct em_arrow_block *block) {
+	static const uint8_t zero[EM_ARROW_ALIGN];
+	const uint32_t cont = 0xffffffff;
+	const uint32_t meta = ((a->off + 8 + a->fb.len + EM_ARROW_ALIGN - 1) & ~(EM_ARROW_ALIGN - 1)) - a->off - 8;
+
+	fwrite(&cont, 4, 1, a->out);
+	fwrite(&meta, 4, 1, a->out);
+	fwrite(a->fb.buf, a->fb.len, 1, a->out);
+	fwrite(zero, meta - a->fb.len, 1, a->out);
+	if (block)
+		*block = (struct em_arrow_block) { .off = a->off, .meta = 8 + meta };
+	a->off += 8 + meta;
+
+	for (unsigned int i = 0; i < nbufs; i++) {
+		const uint64_t pad = (EM_ARROW_ALIGN - (b[i].len & (EM_ARROW_ALIGN - 1))) & (EM_ARROW_ALIGN - 1);
+		fwrite(b[i].data, b[i].len, 1, a->out);
+		fwrite(zero, pad, 1, a->out);
+		a->off += b[i].len + pad;
+		if (block)
+			block->body += b[i].len + pad;
+	}
+}
+
+int em_arrow_flush(struct em_arrow *a) {
+	struct em_arrow_buf b[3 * EM_ARROW_COLS];
+	uint64_t nulls[EM_ARROW_COLS];
+	uint64_t body = 0;
+	unsigned int n = 0;
+
+	for (unsigned int i = 0; i < a->ncols; i++) {
+		struct em_arrow_col *c = &a->col[i];
+		nulls[i] = c->nulls;
+		b[n++] = (struct em_arrow_buf) { c->valid, c->nulls ? (a->rows + 7) / 8 : 0 };
+		if (c->type == EM_ARROW_STR) {
+			b[n++] = (struct em_arrow_buf) { c->data, 4 * (a->rows + 1) };
+			b[n++] = (struct em_arrow_buf) { c->str, ((uint32_t *) c->data)[a->rows] };
+		} else if (c->type == EM_ARROW_BOOL) {
+			b[n++] = (struct em_arrow_buf) { c->data, (a->rows + 7) / 8 };
+		} else {
+			b[n++] = (struct em_arrow_buf) { c->data, (uint64_t) a->rows * em_arrow_width[c->type] };
+		}
+		c->nulls = 0;
+	}
+	for (unsigned int i = 0; i < n; i++)
+		body += (b[i].len + EM_ARROW_ALIGN - 1) & ~(EM_ARROW_ALIGN - 1);
+
+	struct em_arrow_block *blocks = realloc(a->blocks, (a->nblocks + 1) * sizeof(*blocks));
+	if (!blocks)
+		return ENOMEM;
+	a->blocks = blocks;
+	const size_t h = em_arrow_message(&a->fb, 3, body);	/* RecordBatch */
+	em_fb_ref(&a->fb, h, em_arrow_batch(&a->fb, a->rows, nulls, a->ncols, b, n));
+	em_arrow_send(a, b, n, &a->blocks[a->nblocks++]);
+	a->rows = 0;
+	return 0;
+}
+
+/* Value of the next column, the secondary address as index into the dictionary */
+void em_arrow_set(struct em_arrow *a, const uint64_t v) {
+	struct em_arrow_col *c = &a->col[a->c++];
+	const unsigned int r = a->rows;
+
+	c->valid[r >> 3] |= 1 << (r & 7);
+	switch (c->type) {
+	case EM_ARROW_U8:
+		c->data[r] = v;
+		break;
+	case EM_ARROW_U16:
+		((uint16_t *) c->data)[r] = v;
+		break;
+	case EM_ARROW_TIME:
+		((int64_t *) c->data)[r] = v;
+		break;
+	case EM_ARROW_BOOL:
+		if (v) c->data[r >> 3] |= 1 << (r & 7);
+		else c->data[r >> 3] &= ~(1 << (r & 7));
+		break;
+	case EM_ARROW_STR:
+		((uint32_t *) c->data)[r + 1] = ((uint32_t *) c->data)[r];
+		break;
+	default:
+		((uint32_t *) c->data)[r] = v;
+	}
+}
+
+void em_arrow_null(struct em_arrow *a) {
+	struct em_arrow_col *c = &a->col[a->c];
+	const unsigned int r = a->rows;
+
+	em_arrow_set(a, 0);
+	c->valid[r >> 3] &= ~(1 << (r & 7));
+	c->nulls++;
+}
+
+void em_arrow_str(struct em_arrow *a, const char *s) {
+	struct em_arrow_col *c = &a->col[a->c];
+	uint32_t *off = (uint32_t *) c->data;
+	const size_t len = strnlen(s, EM_ARROW_STR_MAX);
+
+	em_arrow_set(a, 0);
+	memcpy(c->str + off[a->rows], s, len);
+	off[a->rows + 1] += len;
+}
+
+int em_arrow_row(struct em_arrow *a) {
+	a->c = 0;
+	a->total++;
+	return (++a->rows == EM_ARROW_BATCH) ? em_arrow_flush(a) : 0;
+}
+
+void em_arrow_free(struct em_arrow *a) {
+	for (unsigned int i = 0; i < a->ncols; i++) {
+		free(a->col[i].valid);
+		free(a->col[i].data);
+		free(a->col[i].str);
+	}
+	free(a->blocks);
+	free(a->fb.buf);
+	if (a->out)
+		fclose(a->out);
+	memset(a, 0, sizeof(*a));
+}
+
+/* Create the file with its schema and the dictionary of secondary addresses */
+int em_arrow_open(struct em_arrow *a, const char *path, const struct em_arrow_col *cols, const unsigned int ncols,
+		  const uint32_t *dict, const unsigned int ndict) {
+	memset(a, 0, sizeof(*a));
+	a->ncols = ncols;
+	a->dict = dict;
+	a->ndict = ndict;
+	a->fb.buf = malloc(EM_ARROW_META);
+	int oom = !a->fb.buf;
+	for (unsigned int i = 0; i < ncols; i++) {
+		struct em_arrow_col *c = &a->col[i];
+		*c = cols[i];
+		c->valid = calloc(EM_ARROW_BATCH / 8, 1);
+		c->data = calloc(EM_ARROW_BATCH + 1, 8);
+		c->str = (c->type == EM_ARROW_STR) ? calloc(EM_ARROW_BATCH, EM_ARROW_STR_MAX) : NULL;
+		oom |= !c->valid || !c->data || ((c->type == EM_ARROW_STR) && !c->str);
+	}
+	if (oom) {
+		log_line(LOG_ERR, "Out of memory");
+		em_arrow_free(a);
+		return ENOMEM;
+	}
+	if (!(a->out = fopen(path, "w"))) {
+		log_line(LOG_ERR, "Failed to create Arrow file '%s': %s", path, strerror(errno));
+		em_arrow_free(a);
+		return EIO;
+	}
+	setvbuf(a->out, NULL, _IOFBF, 1 << 20);
+
+	fwrite("ARROW1\0\0", 8, 1, a->out);
+	a->off = 8;
+	em_fb_ref(&a->fb, em_arrow_message(&a->fb, 1, 0), em_arrow_schema(a));		/* Schema */
+	em_arrow_send(a, NULL, 0, NULL);
+
+	const struct em_arrow_buf b[2] = { { NULL, 0 }, { dict, 4ULL * ndict } };
+	const uint64_t nulls = 0;
+	size_t f[2];
+	const size_t h = em_arrow_message(&a->fb, 2, (4ULL * ndict + EM_ARROW_ALIGN - 1) & ~(EM_ARROW_ALIGN - 1));
+	em_fb_ref(&a->fb, h, em_fb_table(&a->fb, 2, (const uint8_t []) { 8, 4 }, f));	/* DictionaryBatch */
+	em_fb_put(&a->fb, f[0], 0, 8);
+	em_fb_ref(&a->fb, f[1], em_arrow_batch(&a->fb, ndict, &nulls, 1, b, 2));
+	em_arrow_send(a, b, 2, &a->dict_block);
+	return 0;
+}
+
+/* Last batch, end of stream marker and the footer */
+int em_arrow_close(struct em_arrow *a, const char *path) {
+	const uint32_t eos[2] = { 0xffffffff, 0 };
+	int ret = (a->rows || !a->nblocks) ? em_arrow_flush(a) : 0;
+	size_t f[4];
+	uint8_t *buf;
+
+	if (!ret && (buf = realloc(a->fb.buf, EM_ARROW_META + sizeof(struct em_arrow_block) * (a->nblocks + 1)))) {
+		struct em_fb *fb = &a->fb;
+		fb->buf = buf;
+		fwrite(eos, sizeof(eos), 1, a->out);
+		a->off += sizeof(eos);
+
+		fb->len = 0;
+		em_fb_alloc(fb, 4, 4);
+		em_fb_ref(fb, 0, em_fb_table(fb, 4, (const uint8_t []) { 2, 4, 4, 4 }, f));	/* Footer */
+		em_fb_put(fb, f[0], 4, 2);
+		em_fb_ref(fb, f[1], em_arrow_schema(a));
+		for (unsigned int i = 0; i < 2; i++) {
+			const struct em_arrow_block *bl = i ? a->blocks : &a->dict_block;
+			const unsigned int n = i ? a->nblocks : 1;
+			const size_t v = em_fb_vector(fb, n, 24, 8);
+			em_fb_ref(fb, f[2 + i], v);
+			for (unsigned int j = 0; j < n; j++) {
+				em_fb_put(fb, v + 4 + 24 * j, bl[j].off, 8);
+				em_fb_put(fb, v + 4 + 24 * j + 8, bl[j].meta, 4);
+				em_fb_put(fb, v + 4 + 24 * j + 16, bl[j].body, 8);
+			}
+		}
+		const uint32_t len = fb->len;
+		fwrite(fb->buf, fb->len, 1, a->out);
+		fwrite(&len, 4, 1, a->out);
+		fwrite("ARROW1", 6, 1, a->out);
+	} else if (!ret) {
+		ret = ENOMEM;
+	}
+
+	if (ferror(a->out) | fclose(a->out)) {
+		log_line(LOG_ERR, "Failed to write Arrow file '%s': %s", path, strerror(errno));
+		ret = EIO;
+	}
+	a->out = NULL;
+	em_arrow_free(a);
+	return ret;
+}
+
+const struct em_arrow_col em_arrow_meter_cols[] = {
+	{ "secadr", EM_ARROW_SECADR },
+	{ "manufacturer", EM_ARROW_STR },
+	{ "version", EM_ARROW_U8 },
+	{ "medium", EM_ARROW_U8 },
+	{ "accesscount", EM_ARROW_U8 },
+	{ "state", EM_ARROW_U8 },
+	{ "time", EM_ARROW_TIME },
+	{ "highres_ml", EM_ARROW_U32, 1 },
+	{ "highres_time", EM_ARROW_TIME, 1 },
+	{ "months_time", EM_ARROW_TIME, 1 },
+};
+
+const struct em_arrow_col em_arrow_month_cols[] = {
+	{ "secadr", EM_ARROW_SECADR },
+	{ "date", EM_ARROW_DATE, 1 },
+	{ "mid_month", EM_ARROW_BOOL },
+	{ "value_l", EM_ARROW_U32 },
+};
+
+const struct em_arrow_col em_arrow_snapshot_cols[] = {
+	{ "secadr", EM_ARROW_SECADR },
+	{ "time", EM_ARROW_TIME },
+	{ "flags", EM_ARROW_U8 },
+	{ "omsmode", EM_ARROW_U8 },
+	{ "frametype", EM_ARROW_U8 },
+	{ "interval_s", EM_ARROW_U16 },
+	{ "months", EM_ARROW_U16 },
+	{ "weekoms", EM_ARROW_U32 },
+	{ "dayows", EM_ARROW_U8 },
+	{ "hours", EM_ARROW_U32 },
+	{ "onday", EM_ARROW_DATE, 1 },
+	{ "onvol_l", EM_ARROW_U16 },
+	{ "opyears", EM_ARROW_U8 },
+	{ "keyday_month", EM_ARROW_U8, 1 },
+	{ "keyday_day", EM_ARROW_U8, 1 },
+};
+
+/* Meter date, null if the meter has none */
+void em_arrow_date(struct em_arrow *a, const unsigned int date) {
+	const unsigned int m = (date >> 5) & 0b1111, d = date & 0b11111;
+
+	if (!m || (m > 12) || !d)
+		em_arrow_null(a);
+	else
+		em_arrow_set(a, em_import_days(2000 + (date >> 9), m, d));
+}
+
+int em_arrow_readings(const char *path, const char *out, const char *months) {
+	struct em_readings *t = em_readings_map(path, 0);
+	struct em_arrow a, am;
+	struct em_reading r;
+	unsigned int n = 0;
+	int ret = 1;
+
+	if (!t)
+		return ret;
+
+	const double t0 = em_now();
+	for (unsigned int i = 0; i < EM_READINGS_SLOTS; i++)
+		n += __atomic_load_n(&t->slot[i].used, __ATOMIC_ACQUIRE) == 2;
+	uint32_t *dict = malloc((n + 1) * sizeof(*dict));
+	if (!dict) {
+		log_line(LOG_ERR, "Out of memory");
+		goto fail;
+	}
+	n = 0;
+	for (unsigned int i = 0; i < EM_READINGS_SLOTS; i++)
+		if (__atomic_load_n(&t->slot[i].used, __ATOMIC_ACQUIRE) == 2) dict[n++] = t->slot[i].secadr;
+	qsort(dict, n, sizeof(*dict), em_cmp_uint);
+
+	if (em_arrow_open(&a, out, em_arrow_meter_cols, 10, dict, n))
+		goto fail;
+	if (months && em_arrow_open(&am, months, em_arrow_month_cols, 4, dict, n)) {
+		em_arrow_free(&a);
+		goto fail;
+	}
+
+	ret = 0;
+	for (unsigned int i = 0; !ret && (i < n); i++) {
+		const struct em_reading *slot = em_readings_find(t, dict[i]);
+		char man[4] = { 0 };
+
+		if (!slot || !em_readings_copy(slot, &r))
+			continue;
+		man[0] = 64 + ((r.manufacturer >> 10) & 0b11111);
+		man[1] = 64 + ((r.manufacturer >> 5) & 0b11111);
+		man[2] = 64 + (r.manufacturer & 0b11111);
+		em_arrow_set(&a, i);
+		em_arrow_str(&a, man);
+		em_arrow_set(&a, r.version);
+		em_arrow_set(&a, r.medium);
+		em_arrow_set(&a, r.accesscount);
+		em_arrow_set(&a, r.state);
+		em_arrow_set(&a, r.time);
+		if (r.flags & EM_READING_HIGHRES) {
+			em_arrow_set(&a, r.highres);
+			em_arrow_set(&a, r.highres_time);
+		} else {
+			em_arrow_null(&a);
+			em_arrow_null(&a);
+		}
+		if (r.flags & EM_READING_MONTHS)
+			em_arrow_set(&a, r.months_time);
+		else
+			em_arrow_null(&a);
+		ret = em_arrow_row(&a);
+
+		for (unsigned int j = 0; months && !ret && (r.flags & EM_READING_MONTHS) && (j < 30); j++) {
+			em_arrow_set(&am, i);
+			em_arrow_date(&am, r.month_date[j]);
+			em_arrow_set(&am, j >= 15);
+			em_arrow_set(&am, r.month_value[j]);
+			ret = em_arrow_row(&am);
+		}
+	}
+
+	const unsigned long meters = a.total, readings = months ? am.total : 0;
+	if (months && (em_arrow_close(&am, months) || ret))
+		ret = 1;
+	if (em_arrow_close(&a, out) || ret) {
+		ret = 1;
+		goto fail;
+	}
+	log_line(LOG_INFO, "Exported %lu meters to '%s' in %.3f s", meters, out, em_now() - t0);
+	if (months)
+		log_line(LOG_INFO, "Exported %lu monthly readings to '%s'", readings, months);
+
+ fail:
+	free(dict);
+	munmap(t, sizeof(*t));
+	return ret;
+}
+
+int em_arrow_snapshots(const char *path, const char *out) {
+	const struct em_snapshot *sn;
+	struct em_arrow a;
+	size_t size;
+	int ret = 1, fd;
+
+	if (!(sn = em_snapshot_map(path, &size, &fd)))
+		return ret;
+
+	/* records are sorted by secondary address, each meter once */
+	uint32_t *dict = malloc((sn->count + 1) * sizeof(*dict));
+	if (!dict) {
+		log_line(LOG_ERR, "Out of memory");
+		goto fail;
+	}
+	for (unsigned int i = 0; i < sn->count; i++)
+		dict[i] = sn->rec[i].secadr;
+	if (em_arrow_open(&a, out, em_arrow_snapshot_cols, 15, dict, sn->count))
+		goto fail;
+
+	ret = 0;
+	for (unsigned int i = 0; !ret && (i < sn->count); i++) {
+		const struct em_snapshot_rec *r = &sn->rec[i];
+		const uint8_t *p = r->params;
+
+		em_arrow_set(&a, i);
+		em_arrow_set(&a, r->time);
+		em_arrow_set(&a, p[0]);
+		em_arrow_set(&a, p[1]);
+		em_arrow_set(&a, p[2]);
+		em_arrow_set(&a, p[4] << 8 | p[3]);
+		em_arrow_set(&a, p[6] << 8 | p[5]);
+		em_arrow_set(&a, (uint32_t) p[10] << 24 | p[9] << 16 | p[8] << 8 | p[7]);
+		em_arrow_set(&a, p[11]);
+		em_arrow_set(&a, p[14] << 16 | p[13] << 8 | p[12]);
+		em_arrow_date(&a, p[16] << 8 | p[15]);
+		em_arrow_set(&a, p[18] << 8 | p[17]);
+		em_arrow_set(&a, p[19]);
+		if (r->keyday_month) {
+			em_arrow_set(&a, r->keyday_month);
+			em_arrow_set(&a, r->keyday_day);
+		} else {
+			em_arrow_null(&a);
+			em_arrow_null(&a);
+		}
+		ret = em_arrow_row(&a);
+	}
+	if (em_arrow_close(&a, out) || ret) {
+		ret = 1;
+		goto fail;
+	}
+	log_line(LOG_INFO, "Exported %u snapshots to '%s'", sn->count, out);
+
+ fail:
+	free(dict);
+	em_snapshot_unmap(sn, size, fd);
+	return ret;
+}
+
+/* Readings table (meters, optionally their monthly readings) or snapshot archive as Arrow IPC files */
+int em_arrow_export(const char *path, const char *out, const char *months) {
+	uint32_t magic = 0;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd >= 0) {
+		if (read(fd, &magic, sizeof(magic)) != sizeof(magic))
+			magic = 0;
+		close(fd);
+	}
+	if (magic != EM_SNAPSHOT_MAGIC)
+		return em_arrow_readings(path, out, months);
+	if (months) {
+		log_line(LOG_ERR, "Snapshot archives have no monthly readings");
+		return 1;
+	}
+	return em_arrow_snapshots(path, out);
+}
+
+/* Telegrams of a meter per bucket of the sliding window, cleared lazily when the meter is heard again */
+struct em_coverage_meter {
+	uint32_t bucket;			/* newest bucket counted */
+	uint32_t hash;				/* of the last telegram, repeaters send it again */
+	uint32_t last;				/* s, last telegram */
+	uint16_t count[EM_COVERAGE_BUCKETS];
+};
+
+struct em_coverage_row {
+	uint32_t meter;
+	uint32_t received;
+	double expected;
+};
+
+struct em_coverage {
+	const struct em_snapshot *sn;
+	struct em_coverage_meter *m;
+	uint32_t *index;			/* secondary address hash -> meter + 1 */
+	uint32_t mask;
+	struct em_coverage_row *rows;		/* of the report, allocated up front */
+	uint64_t bucket_us;
+	uint64_t first_us;
+	uint64_t now_us;
+	unsigned long telegrams, duplicates, unknown, corrupt;
+};
+
+/* Calendar of an hour (or part of it) of the window, in the bit layout of the parameter masks */
+struct em_coverage_seg {
+	uint32_t secs;
+	uint32_t month;
+	uint32_t mday;
+	uint32_t wday;
+	uint32_t hour;
+	uint16_t date;				/* packed as EM_ONDAY */
+};
+
+/* All memory of the monitor, nothing is allocated per telegram or report */
+int em_coverage_init(struct em_coverage *cv) {
+	for (cv->mask = 1; cv->mask < 2 * cv->sn->count; cv->mask <<= 1);
+	cv->m = calloc(cv->sn->count + 1, sizeof(*cv->m));
+	cv->index = calloc(cv->mask, sizeof(*cv->index));
+	cv->rows = calloc(cv->sn->count + 1, sizeof(*cv->rows));
+	cv->mask--;
+	if (!cv->m || !cv->index || !cv->rows)
+		return ENOMEM;
+	for (uint32_t i = 0; i < cv->sn->count; i++) {
+		uint32_t h = em_readings_hash(cv->sn->rec[i].secadr) & cv->mask;
+		while (cv->index[h])
+			h = (h + 1) & cv->mask;
+		cv->index[h] = i + 1;
+	}
+	return 0;
+}
+
+void em_coverage_free(struct em_coverage *cv) {
+	free(cv->m);
+	free(cv->index);
+	free(cv->rows);
+}
+
+void em_coverage_add(struct em_coverage *cv, const struct em_frame_rec *rec, const uint8_t *f) {
+	uint32_t secadr, hash = 2166136261u;
+
+	if (rec->dir != EM_FRAME_RADIO)
+		return;
+	if (!cv->first_us)
+		cv->first_us = rec->ts_us;
+	if (rec->ts_us > cv->now_us)
+		cv->now_us = rec->ts_us;
+	if ((rec->flags & EM_FRAME_CORRUPT) || (rec->len < 10)) {
+		cv->corrupt++;
+		return;
+	}
+	memcpy(&secadr, f + 4, sizeof(secadr));
+	uint32_t h = em_readings_hash(secadr) & cv->mask;
+	while (cv->index[h] && (cv->sn->rec[cv->index[h] - 1].secadr != secadr))
+		h = (h + 1) & cv->mask;
+	if (!cv->index[h]) {
+		cv->unknown++;
+		return;
+	}
+
+	struct em_coverage_meter *m = &cv->m[cv->index[h] - 1];
+	for (unsigned int i = 0; i < rec->len; i++)
+		hash = (hash ^ f[i]) * 16777619u;
+	if (m->hash == hash) {
+		cv->duplicates++;
+		return;
+	}
+	m->hash = hash;
+
+	const uint32_t b = rec->ts_us / cv->bucket_us;
+	if (b > m->bucket) {
+		for (uint32_t k = m->bucket + 1; (k <= b) && (k <= m->bucket + EM_COVERAGE_BUCKETS); k++)
+			m->count[k % EM_COVERAGE_BUCKETS] = 0;
+		m->bucket = b;
+	} else if (b + EM_COVERAGE_BUCKETS <= m->bucket) {
+		return;
+	}
+	if (m->count[b % EM_COVERAGE_BUCKETS] < UINT16_MAX)
+		m->count[b % EM_COVERAGE_BUCKETS]++;
+	if (rec->ts_us / 1000000 > m->last)
+		m->last = rec->ts_us / 1000000;
+	cv->telegrams++;
+}
+
+/* Telegrams the parameters call for within the window, as the meter evaluates its masks in local time */
+double em_coverage_expected(const uint8_t *p, const struct em_coverage_seg *seg, const unsigned int nseg, const int heard) {
+	const unsigned int flags = EM_ENA_RADIO_AVAIL | EM_ENA_RADIO_ON;
+	const uint32_t months = p[6] << 8 | p[5], weekoms = (uint32_t) p[10] << 24 | p[9] << 16 | p[8] << 8 | p[7];
+	const uint32_t hours = p[14] << 16 | p[13] << 8 | p[12];
+	const unsigned int interval = p[4] << 8 | p[3];
+	uint64_t secs = 0;
+
+	/* activation by volume cannot be predicted, wait for the first telegram */
+	if (((p[0] & flags) != flags) || ((p[0] & EM_ENA_STARTVOL) && !heard))
+		return 0;
+	for (unsigned int i = 0; i < nseg; i++)
+		if ((months & seg[i].month) && (weekoms & seg[i].mday) && (p[11] & seg[i].wday) && (hours & seg[i].hour) &&
+		    (!(p[0] & EM_ENA_STARTDATE) || (seg[i].date >= (p[16] << 8 | p[15]))))
+			secs += seg[i].secs;
+	return (double) secs / ((interval < 2) ? 2 : interval);
+}
+
+int em_cmp_coverage(const void *a, const void *b) {
+	const struct em_coverage_row *x = a, *y = b;
+	const double rx = x->received / x->expected, ry = y->received / y->expected;
+	return (rx > ry) - (rx < ry) ?: (x->expected < y->expected) - (x->expected > y->expected);
+}
+
+/* Expected versus received telegrams of all meters, the worst ones listed if top */
+void em_coverage_report(struct em_coverage *cv, const unsigned int top) {
+	const uint32_t n = cv->now_us / cv->bucket_us;
+	const uint64_t wstart = (n + 1 - EM_COVERAGE_BUCKETS) * cv->bucket_us;
+	const time_t start = ((cv->first_us > wstart) ? cv->first_us : wstart) / 1000000, end = cv->now_us / 1000000;
+	struct em_coverage_seg seg[EM_COVERAGE_WINDOW_MAX / 3600 + 2];
+	struct em_coverage_row *rows = top ? cv->rows : NULL;
+	const uint8_t *cached = NULL;
+	double cached_exp = 0, expected = 0;
+	unsigned long received = 0;
+	unsigned int nseg = 0, silent = 0, poor = 0, nrows = 0;
+	char buf[2][32];
+	struct tm tm;
+
+	if (!cv->now_us)
+		return;
+	for (time_t t = start; t < end; nseg++) {
+		const time_t next = (t / 3600 + 1) * 3600;
+		localtime_r(&t, &tm);
+		seg[nseg] = (struct em_coverage_seg) { .secs = ((next < end) ? next : end) - t,
+			.month = 1 << tm.tm_mon, .mday = 1 << (tm.tm_mday - 1), .wday = 1 << ((tm.tm_wday + 6) % 7),
+			.hour = 1 << tm.tm_hour, .date = (tm.tm_year - 100) << 9 | (tm.tm_mon + 1) << 5 | tm.tm_mday };
+		t = next;
+	}
+
+	for (uint32_t i = 0; i < cv->sn->count; i++) {
+		const struct em_coverage_meter *m = &cv->m[i];
+		const uint8_t *p = cv->sn->rec[i].params;
+		uint32_t got = 0;
+		double exp;
+
+		for (uint32_t b = n + 1 - EM_COVERAGE_BUCKETS; b <= n; b++)
+			if ((b <= m->bucket) && (b + EM_COVERAGE_BUCKETS > m->bucket))
+				got += m->count[b % EM_COVERAGE_BUCKETS];
+		/* the fleet mostly shares a few parameter blocks */
+		if (!(p[0] & EM_ENA_STARTVOL) && cached && !memcmp(cached, p, EM_PARAMS_LEN)) {
+			exp = cached_exp;
+		} else {
+			exp = em_coverage_expected(p, seg, nseg, !!m->last);
+			if (!(p[0] & EM_ENA_STARTVOL)) {
+				cached = p;
+				cached_exp = exp;
+			}
+		}
+		expected += exp;
+		received += got;
+		/* one telegram less is the random phase of the interval */
+		if ((exp < EM_COVERAGE_MIN_EXPECTED) || ((got + 1) * 100 >= exp * EM_COVERAGE_POOR))
+			continue;
+		silent += !got;
+		poor += !!got;
+		if (rows)
+			rows[nrows++] = (struct em_coverage_row) { .meter = i, .received = got, .expected = exp };
+	}
+
+	/* localtime() re-reads the time zone and allocates on every call */
+	strftime(buf[0], sizeof(buf[0]), "%Y-%m-%d %H:%M", localtime_r(&start, &tm));
+	strftime(buf[1], sizeof(buf[1]), "%Y-%m-%d %H:%M", localtime_r(&end, &tm));
+	log_line(LOG_INFO, "Coverage %s - %s: %lu of %.0f expected telegrams (%.1f %%), %u meters silent, %u below %d %%",
+		 buf[0], buf[1], received, expected, expected ? 100.0 * received / expected : 100.0, silent, poor, EM_COVERAGE_POOR);
+	if (!rows)
+		return;
+
+	log_line(LOG_INFO, "%lu telegrams of %u meters, %lu duplicates, %lu corrupt, %lu of unknown meters",
+		 cv->telegrams, cv->sn->count, cv->duplicates, cv->corrupt, cv->unknown);
+	qsort(rows, nrows, sizeof(*rows), em_cmp_coverage);
+	log_line(LOG_INFO, "Worst delivery (top %u of %u):", (nrows < top) ? nrows : top, nrows);
+	log_line(LOG_INFO, "%-10s %8s %8s %6s  %s", "SECADR", "EXPECTED", "RECEIVED", "RATIO", "LAST");
+	for (unsigned int i = 0; (i < nrows) && (i < top); i++) {
+		const struct em_coverage_meter *m = &cv->m[rows[i].meter];
+		const time_t last = m->last;
+		if (last)
+			strftime(buf[0], sizeof(buf[0]), "%Y-%m-%d %H:%M:%S", localtime_r(&last, &tm));
+		log_line(LOG_INFO, "0x%08x %8.0f %8u %5.1f%%  %s", cv->sn->rec[rows[i].meter].secadr, rows[i].expected,
+			 rows[i].received, 100.0 * rows[i].received / rows[i].expected, last ? buf[0] : "never");
+	}
+}
+
+/* A record header to trust: known direction, fits the buffer, timestamp near the stream time */
+int em_coverage_plausible(const struct em_coverage *cv, const struct em_frame_rec *rec, const size_t max) {
+	if ((rec->dir > EM_FRAME_READING) || (sizeof(*rec) + rec->len > max))
+		return 0;
+	return !cv->now_us || ((rec->ts_us < cv->now_us + EM_COVERAGE_RESYNC) && (rec->ts_us + EM_COVERAGE_RESYNC > cv->now_us));
+}
+
+/*
+   Records of one telegram stream, a summary whenever the stream enters a new
+   bucket. A corrupt record is skipped byte by byte until a plausible record
+   header follows.
+*/
+int em_coverage_stream(struct em_coverage *cv, const int fd) {
+	static uint8_t buf[1 << 16];
+	size_t len = 0, pos = 0, skipped = 0;
+	int hdr = 0;
+
+	while (!em_probe_stop) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		if (poll(&pfd, 1, 1000) <= 0)
+			continue;
+		memmove(buf, buf + pos, len - pos);
+		len -= pos;
+		pos = 0;
+		ssize_t r = read(fd, buf + len, sizeof(buf) - len);
+		if (r <= 0)
+			return (r < 0) && (errno != EINTR);
+		len += r;
+
+		if (!hdr) {
+			struct em_frames_hdr h;
+			if (len < sizeof(h))
+				continue;
+			memcpy(&h, buf, sizeof(h));
+			if (h.magic != EM_FRAMES_MAGIC) {
+				log_line(LOG_ERR, "Not a telegram stream");
+				return 1;
+			}
+			pos = sizeof(h);
+			hdr = 1;
+		}
+		for (;;) {
+			struct em_frame_rec rec;
+			if (len - pos < sizeof(rec))
+				break;
+			memcpy(&rec, buf + pos, sizeof(rec));
+			if (!em_coverage_plausible(cv, &rec, sizeof(buf))) {
+				if (!skipped++) {
+					log_line(LOG_WARNING, "Corrupt record in telegram stream, resynchronizing");
+					cv->corrupt++;
+				}
+				pos++;
+				continue;
+			}
+			if (len - pos < sizeof(rec) + rec.len)
+				break;
+			if (skipped) {
+				log_line(LOG_INFO, "Resynchronized after %zu bytes", skipped);
+				skipped = 0;
+			}
+			if (cv->now_us && (rec.ts_us / cv->bucket_us > cv->now_us / cv->bucket_us))
+				em_coverage_report(cv, 0);
+			em_coverage_add(cv, &rec, buf + pos + sizeof(rec));
+			pos += sizeof(rec) + rec.len;
+		}
+	}
+	return 0;
+}
+
+/* Compare the telegrams received from the meters of a snapshot archive with their transmit schedule */
+int em_coverage(const char *archive, const char *src, const unsigned int hours) {
+	struct em_coverage cv = { .bucket_us = hours * 3600000000ULL / EM_COVERAGE_BUCKETS };
+	size_t size;
+	int fd = -1, ret = 1;
+
+	if (!hours || (hours * 3600 > EM_COVERAGE_WINDOW_MAX)) {
+		log_line(LOG_ERR, "Window must be 1 to %d hours", EM_COVERAGE_WINDOW_MAX / 3600);
+		return ret;
+	}
+	/* a private copy, the monitor runs for long and must not keep snapshots from being stored */
+	const struct em_snapshot *sn = em_snapshot_map(archive, &size, &fd);
+	if (!sn)
+		return ret;
+	struct em_snapshot *copy = malloc(size);
+	if (copy)
+		memcpy(copy, sn, size);
+	em_snapshot_unmap(sn, size, fd);
+	fd = -1;
+	if (!(cv.sn = copy) || em_coverage_init(&cv)) {
+		log_line(LOG_ERR, "Out of memory");
+		goto out;
+	}
+
+	if (!strcmp(src, "-")) {
+		fd = STDIN_FILENO;
+	} else if (!strncmp(src, "unix:", 5)) {
+		struct sockaddr_un sa = { .sun_family = AF_UNIX };
+		snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", src + 5);
+		unlink(sa.sun_path);
+		if (((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) ||
+		    bind(fd, (struct sockaddr *) &sa, sizeof(sa)) || listen(fd, 4)) {
+			log_line(LOG_ERR, "Failed to listen on '%s': %s", sa.sun_path, strerror(errno));
+			goto out;
+		}
+	} else if ((fd = open(src, O_RDONLY | O_CLOEXEC)) < 0) {
+		log_line(LOG_ERR, "Failed to open telegram stream '%s': %s", src, strerror(errno));
+		goto out;
+	}
+
+	signal(SIGINT, em_probe_sigint);
+	log_line(LOG_INFO, "Monitoring %u meters over %u h from '%s', Ctrl-C to stop", cv.sn->count, hours, src);
+	if (strncmp(src, "unix:", 5)) {
+		ret = em_coverage_stream(&cv, fd);
+	} else {
+		/* one sender after the other */
+		ret = 0;
+		while (!ret && !em_probe_stop) {
+			struct pollfd pfd = { .fd = fd, .events = POLLIN };
+			if (poll(&pfd, 1, 1000) <= 0)
+				continue;
+			int conn = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+			if (conn < 0)
+				continue;
+			ret = em_coverage_stream(&cv, conn);
+			close(conn);
+		}
+		unlink(src + 5);
+	}
+	em_coverage_report(&cv, EM_COVERAGE_TOP);
+
+ out:
+	if (fd > STDIN_FILENO)
+		close(fd);
+	em_coverage_free(&cv);
+	free(copy);
+	return ret;
+}
+
+struct em_route_stop {
+	uint32_t secadr;
+	char note[64];
+	int done;				/* 1 read, -1 skipped */
+	double secs;
+};
+
+/*
+   Wake up and send a single REQ_UD2, a response means the head is placed on
+   a meter. Without wakeup only a meter still awake from the last session answers.
+*/
+int em_route_detect(const int fd, const int wake) {
+	unsigned char frame_in[MBUS_FRAME_MAX_LEN];
+	unsigned char frame_out[] = {
+		MBUS_FRAME_SHORT_START,
+		MBUS_C_REQ_UD2,			/* Control */
+		254,				/* Address */
+		0x00,				/* Checksum */
+		MBUS_FRAME_STOP
+	};
+	const int prio = log_prio;
+	ssize_t len;
+
+	memset(&mbus_stats, 0, sizeof(mbus_stats));
+	memset(&em_meter, 0, sizeof(em_meter));
+	frame_out[3] = frame_out[1] + frame_out[2];
+	log_prio = LOG_CRIT;
+	if (wake && (em_wakeup(fd) < 0)) {
+		log_prio = prio;
+		return -1;
+	}
+	mbus_stats.requests++;
+	serial_write(fd, frame_out, sizeof(frame_out));
+	len = serial_read(fd, frame_in, sizeof(frame_in));
+	log_prio = prio;
+	return (len > 0) && mbus_checklong(frame_in, len) && em_meter.valid;
+}
+
+int em_route_load(const char *path, struct em_route_stop *stops) {
+	char line[256];
+	int n = 0;
+	FILE *f = fopen(path, "r");
+
+	if (!f) {
+		log_line(LOG_ERR, "Failed to open route '%s': %s", path, strerror(errno));
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		char *p = line, *end;
+		unsigned long secadr;
+
+		while (isspace((unsigned char) *p)) p++;
+		if (!*p || (*p == '#'))
+			continue;
+		secadr = strtoul(p, &end, 16);
+		if ((end == p) || (secadr > 0xffffffffUL)) {
+			log_line(LOG_ERR, "Invalid route entry: %s", line);
+			fclose(f);
+			return -1;
+		}
+		if (n == EM_ROUTE_STOPS) {
+			log_line(LOG_ERR, "Route '%s' has more than %d meters", path, EM_ROUTE_STOPS);
+			fclose(f);
+			return -1;
+		}
+		while (isspace((unsigned char) *end)) end++;
+		end[strcspn(end, "\r\n")] = 0;
+		stops[n].secadr = secadr;
+		snprintf(stops[n].note, sizeof(stops[n].note), "%s", end);
+		stops[n].done = 0;
+		n++;
+	}
+	fclose(f);
+	return n;
+}
+
+/* Operator input, read unbuffered so poll() sees whatever was not taken yet */
+struct em_route_input {
+	char buf[64];
+	size_t len;
+};
+
+/* First character of the next line typed ('\n' for Enter), 0 if none within wait_ms, EOF without operator */
+int em_route_key(struct em_route_input *in, const int wait_ms) {
+	struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+	char *nl;
+
+	while (!(nl = memchr(in->buf, '\n', in->len))) {
+		if (in->len == sizeof(in->buf))
+			in->len = 0;			/* overlong line, dropped */
+		if (poll(&pfd, 1, wait_ms) <= 0)
+			return 0;
+		ssize_t got = read(STDIN_FILENO, in->buf + in->len, sizeof(in->buf) - in->len);
+		if (got <= 0)
+			return ((got < 0) && (errno == EINTR)) ? 0 : EOF;
+		in->len += got;
+	}
+	const int key = in->buf[0];
+	in->len -= nl + 1 - in->buf;
+	memmove(in->buf, nl + 1, in->len);
+	return key;
+}
+
+/*
+   Route mode for meter readers walking a building: the route file lists
+   the meters in walking order (secondary address in hex, optional note).
+   The port is opened and configured once. A meter is read when the operator
+   presses Enter, or as soon as it answers to the wakeup sequence which is
+   repeated while waiting. While the head stays on the meter read last, a
+   bare REQ_UD2 confirms it and the wakeup is skipped. Results go to the
+   statistics and readings stores.
+*/
+int em_route(const char *port, const char *path, char *cmds[], const int ncmds) {
+	static struct em_route_stop stops[EM_ROUTE_STOPS];
+	char *dflt[] = { "read_highres" };
+	struct em_route_input in = { .len = 0 };
+	int n, cur = 0, read = 0, failed = 0, input = 1, on_last = 0;
+	int64_t last = -1;			/* meter read last */
+	double total = 0;
+
+	if ((n = em_route_load(path, stops)) <= 0) {
+		if (!n) log_line(LOG_ERR, "Route '%s' is empty", path);
+		return 1;
+	}
+
+	int serial_fd = open(port, O_RDWR | O_NOCTTY | O_SYNC | O_NONBLOCK);
+	if (serial_fd < 0) {
+		log_line(LOG_ERR, "Failed to open serial port '%s': %s", port, strerror(errno));
+		return 1;
+	}
+
+	signal(SIGINT, em_probe_sigint);
+	while (cur < n) {
+		int ret;
+		double t0 = em_now();
+
+		printf("Next %d/%d: 0x%08x %s -- place head, Enter to start, s to skip, q to quit\n",
+		       cur + 1, n, stops[cur].secadr, stops[cur].note);
+		fflush(stdout);
+
+		/* wait for the operator or the meter, whichever comes first */
+		for (;;) {
+			int key = input ? em_route_key(&in, EM_ROUTE_DETECT_INTERVAL) : 0, detected = 0;
+			if (key == EOF)
+				input = key = 0;	/* no operator, detect only */
+			if (em_probe_stop) {
+				cur = n;
+				break;
+			}
+			if (!key) {
+				if (!input)
+					usleep(EM_ROUTE_DETECT_INTERVAL * 1000);
+				t0 = em_now();
+				if (!on_last || ((detected = em_route_detect(serial_fd, 0)) <= 0))
+					detected = em_route_detect(serial_fd, 1);
+				if (detected < 0) {
+					serial_close(serial_fd);
+					return 1;
+				}
+				/* head still on the meter read last */
+				on_last = detected && (em_meter.secadr == last);
+				if (!detected || on_last)
+					continue;
+				/* Enter, s or q typed during detection still count */
+				if (input && ((key = em_route_key(&in, 0)) == EOF))
+					input = key = 0;
+				if (!key)
+					break;
+			}
+			if (key == 'q') {
+				cur = n;
+				break;
+			}
+			if (key == 's') {
+				stops[cur].done = -1;
+				break;
+			}
+			if (detected)
+				break;
+			t0 = em_now();
+			memset(&mbus_stats, 0, sizeof(mbus_stats));
+			memset(&em_meter, 0, sizeof(em_meter));
+			if (em_wakeup(serial_fd) < 0) {
+				serial_close(serial_fd);
+				return 1;
+			}
+			break;
+		}
+		if ((cur >= n) || stops[cur].done)
+			goto next;
+
+		ret = em_run(serial_fd, ncmds ? cmds : dflt, ncmds ? ncmds : 1);
+		em_stats_record(port, ret);
+		em_readings_publish();
+		if ((on_last = (em_meter.valid && !ret)))
+			last = em_meter.secadr;
+
+		/* the meter under the head counts, wherever it is on the route */
+		int stop = cur;
+		if (em_meter.valid && (em_meter.secadr != stops[cur].secadr)) {
+			for (stop = 0; (stop < n) && (stops[stop].secadr != em_meter.secadr); stop++);
+			if (stop == n) {
+				printf("WARNING: 0x%08x is not on the route, readings stored anyway\n", em_meter.secadr);
+				continue;
+			}
+			printf("WARNING: found 0x%08x (%d/%d) instead of 0x%08x\n", em_meter.secadr, stop + 1, n, stops[cur].secadr);
+		}
+		if (ret) {
+			failed++;
+			printf("FAILED 0x%08x: %s, retry or skip\n", stops[stop].secadr, strerror(ret));
+			continue;
+		}
+		if (stops[stop].done == 1)
+			total -= stops[stop].secs;	/* read again, the last time counts */
+		else
+			read++;
+		stops[stop].done = 1;
+		stops[stop].secs = em_now() - t0;
+		total += stops[stop].secs;
+		printf("OK %d/%d: 0x%08x in %.1f s\n", stop + 1, n, stops[stop].secadr, stops[stop].secs);
+next:
+		while ((cur < n) && stops[cur].done)
+			cur++;
+	}
+	serial_close(serial_fd);
+
+	printf("Route done: %d of %d meters read, %d failed attempts, %.1f s per meter\n",
+	       read, n, failed, read ? total / read : 0);
+	for (int i = 0; i < n; i++)
+		if (stops[i].done != 1)
+			printf("MISSING %d/%d: 0x%08x %s\n", i + 1, n, stops[i].secadr, stops[i].note);
+	return read != n;
+}
+
+/* Result of a refresh session, passed from the session process to the exporter */
+struct em_export_result {
+	int ret;
+	struct em_meter meter;
+	struct mbus_stats stats;
+};
+
+struct em_export {
+	struct em_meter meter;
+	time_t highres_time;
+	time_t months_time;
+	time_t failed_time;
+	struct mbus_stats link;			/* summed up over all refreshes */
+	unsigned long refreshes;
+	unsigned long refresh_failures;
+	double refresh_start;
+	double refresh_duration;
+	double scrape_sum;
+	unsigned long scrapes;
+	struct em_bucket budget;		/* refilled by EM_EXPORT_BUDGET per day */
+};
+
+size_t em_export_metrics(const struct em_export *ex, char *buf, const size_t size) {
+	const time_t now = time(NULL);
+	const struct em_meter *m = &ex->meter;
+	char lbl[64] = "";
+	size_t p = 0;
+
+#define EM_METRIC(...) p += snprintf(buf + p, (p < size) ? size - p : 0, __VA_ARGS__)
+	if (m->valid) {
+		snprintf(lbl, sizeof(lbl), "secadr=\"%08x\"", m->secadr);
+		EM_METRIC("# TYPE em_meter info\n");
+		EM_METRIC("em_meter_info{%s,manufacturer=\"%c%c%c\",version=\"%d\",medium=\"%d\"} 1\n", lbl,
+			  64 + ((m->manufacturer >> 10) & 0b11111), 64 + ((m->manufacturer >> 5) & 0b11111),
+			  64 + (m->manufacturer & 0b11111), m->version, m->medium);
+		EM_METRIC("# TYPE em_access_count gauge\nem_access_count{%s} %d\n", lbl, m->accesscount);
+		EM_METRIC("# TYPE em_state gauge\nem_state{%s} %d\n", lbl, m->state);
+	}
+	if (m->highres_valid) {
+		EM_METRIC("# TYPE em_volume_liters gauge\n# UNIT em_volume_liters liters\n");
+		EM_METRIC("em_volume_liters{%s} %u.%03u\n", lbl, m->highres / 1000, m->highres % 1000);
+	}
+	if (m->months_valid) {
+		EM_METRIC("# TYPE em_month_volume_liters gauge\n# UNIT em_month_volume_liters liters\n");
+		for (unsigned int i = 0; i < 30; i++) {
+			char date[16];
+			EM_METRIC("em_month_volume_liters{%s,date=\"%s\",period=\"%s\"} %u\n", lbl,
+				  em_datestr(date, m->month_date[i]), (i < 15) ? "end" : "middle", m->month_value[i]);
+		}
+	}
+
+	EM_METRIC("# TYPE em_link_requests counter\nem_link_requests_total %lu\n", ex->link.requests);
+	EM_METRIC("# TYPE em_link_retries counter\nem_link_retries_total %lu\n", ex->link.retries);
+	EM_METRIC("# TYPE em_link_timeouts counter\nem_link_timeouts_total %lu\n", ex->link.timeouts);
+	EM_METRIC("# TYPE em_link_parity_errors counter\nem_link_parity_errors_total %lu\n", ex->link.parity_errors);
+	EM_METRIC("# TYPE em_link_checksum_errors counter\nem_link_checksum_errors_total %lu\n", ex->link.checksum_errors);
+	EM_METRIC("# TYPE em_link_framing_errors counter\nem_link_framing_errors_total %lu\n", ex->link.framing_errors);
+
+	EM_METRIC("# TYPE em_exporter_refreshes counter\nem_exporter_refreshes_total %lu\n", ex->refreshes);
+	EM_METRIC("# TYPE em_exporter_refresh_failures counter\nem_exporter_refresh_failures_total %lu\n",
+		  ex->refresh_failures);
+	EM_METRIC("# TYPE em_exporter_refresh_duration_seconds gauge\nem_exporter_refresh_duration_seconds %.3f\n",
+		  ex->refresh_duration);
+	EM_METRIC("# TYPE em_exporter_cache_age_seconds gauge\n");
+	if (ex->highres_time)
+		EM_METRIC("em_exporter_cache_age_seconds{reading=\"highres\"} %ld\n", now - ex->highres_time);
+	if (ex->months_time)
+		EM_METRIC("em_exporter_cache_age_seconds{reading=\"months\"} %ld\n", now - ex->months_time);
+	EM_METRIC("# TYPE em_exporter_read_budget gauge\nem_exporter_read_budget %.2f\n", ex->budget.tokens);
+	EM_METRIC("# TYPE em_exporter_scrape_duration_seconds summary\n");
+	EM_METRIC("em_exporter_scrape_duration_seconds_sum %.6f\nem_exporter_scrape_duration_seconds_count %lu\n",
+		  ex->scrape_sum, ex->scrapes);
+	EM_METRIC("# EOF\n");
+#undef EM_METRIC
+	return p;
+}
+
+void em_export_scrape(struct em_export *ex, const int listen_fd) {
+	char req[1024];
+	char body[8192];
+	char hdr[256];
+	const double t0 = em_now();
+	struct pollfd pfd = { .events = POLLIN };
+	ssize_t len = 0;
+
+	pfd.fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (pfd.fd < 0)
+		return;
+
+	/* the request line is all we need */
+	while ((len < sizeof(req) - 1) && !memchr(req, '\n', len) && (poll(&pfd, 1, 1000) == 1)) {
+		ssize_t n = read(pfd.fd, req + len, sizeof(req) - 1 - len);
+		if (n <= 0) break;
+		len += n;
+	}
+	req[len] = 0;
+
+	if (!strncmp(req, "GET /metrics ", 13) || !strncmp(req, "GET /metrics?", 13)) {
+		size_t blen = em_export_metrics(ex, body, sizeof(body));
+		if (blen >= sizeof(body)) blen = sizeof(body) - 1;
+		int hlen = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n"
+				    "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+				    "Content-Length: %zu\r\nConnection: close\r\n\r\n", blen);
+		if ((write(pfd.fd, hdr, hlen) == hlen) && (write(pfd.fd, body, blen) == blen)) {
+			ex->scrapes++;
+			ex->scrape_sum += em_now() - t0;
+		}
+	} else {
+		const char nf[] = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+		if (write(pfd.fd, nf, sizeof(nf) - 1) < 0) log_line(LOG_DEBUG, "Scrape aborted by client");
+	}
+	close(pfd.fd);
+}
+
+pid_t em_export_refresh(const char *port, const int months, int *result_fd) {
+	char *cmds[] = { "read_highres", "read_months" };
+	int pfd[2];
+	pid_t pid;
+
+	if (pipe2(pfd, O_CLOEXEC) < 0)
+		return -1;
+
+	fflush(stdout);
+	pid = fork();
+	if (!pid) {
+		struct em_export_result res;
+		close(pfd[0]);
+		res.ret = em_session(port, cmds, months ? 2 : 1);
+		res.meter = em_meter;
+		res.stats = mbus_stats;
+		exit(write(pfd[1], &res, sizeof(res)) != sizeof(res));
+	}
+	close(pfd[1]);
+	if (pid < 0) {
+		close(pfd[0]);
+		return -1;
+	}
+	*result_fd = pfd[0];
+	return pid;
+}
+
+/*
+   Serve OpenMetrics on http://localhost:<port>/metrics from cached readings.
+   The meter is only woken up on a schedule (EM_EXPORT_*_INTERVAL) and
+   never more often than the per-day request budget allows, scrapes never
+   wait for the meter.
+*/
+int em_export(const char *port, const int listen_port) {
+	struct sockaddr_in sa = { .sin_family = AF_INET, .sin_port = htons(listen_port) };
+	struct em_export ex = { .budget = { .tokens = EM_EXPORT_BURST, .time = em_now() } };
+	int result_fd = -1;
+	pid_t pid = 0;
+	int on = 1;
+
+	signal(SIGPIPE, SIG_IGN);
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if ((listen_fd < 0) || setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) ||
+	    bind(listen_fd, (struct sockaddr *) &sa, sizeof(sa)) || listen(listen_fd, 16)) {
+		log_line(LOG_ERR, "Failed to listen on port %d: %s", listen_port, strerror(errno));
+		return 1;
+	}
+	log_line(LOG_INFO, "Serving metrics on http://127.0.0.1:%d/metrics", listen_port);
+
+	for (;;) {
+		const time_t now = time(NULL);
+		const double t = em_now();
+		int timeout = 60 * 1000;
+
+		em_bucket_refill(&ex.budget, t, EM_EXPORT_BUDGET, EM_EXPORT_BURST);
+
+		if (!pid) {
+			const int months = (now >= ex.months_time + EM_EXPORT_MONTHS_INTERVAL);
+			const int due = months || (now >= ex.highres_time + EM_EXPORT_HIGHRES_INTERVAL);
+			const double cost = months ? 3 : 1;
+			time_t next = (ex.highres_time + EM_EXPORT_HIGHRES_INTERVAL < ex.months_time + EM_EXPORT_MONTHS_INTERVAL) ?
+				      ex.highres_time + EM_EXPORT_HIGHRES_INTERVAL : ex.months_time + EM_EXPORT_MONTHS_INTERVAL;
+
+			if (ex.failed_time + EM_EXPORT_RETRY_INTERVAL > now) {
+				next = ex.failed_time + EM_EXPORT_RETRY_INTERVAL;
+			} else if (due && !em_bucket_wait(&ex.budget, cost, EM_EXPORT_BUDGET, EM_EXPORT_BURST)) {
+				log_line(LOG_INFO, "Refreshing %s", months ? "high resolution and monthly readings" :
+					 "high resolution reading");
+				pid = em_export_refresh(port, months, &result_fd);
+				if (pid < 0) {
+					log_line(LOG_ERR, "Failed to start refresh: %s", strerror(errno));
+					pid = 0;
+					ex.failed_time = now;
+				}
+				ex.refresh_start = t;
+				continue;
+			} else if (due) {
+				next = now + em_bucket_wait(&ex.budget, cost, EM_EXPORT_BUDGET, EM_EXPORT_BURST) + 1;
+			}
+			if ((next - now) * 1000 < timeout)
+				timeout = (next - now) * 1000;
+		}
+
+		struct pollfd pfd[2] = { { .fd = listen_fd, .events = POLLIN }, { .fd = result_fd, .events = POLLIN } };
+		if (poll(pfd, pid ? 2 : 1, timeout) < 0)
+			continue;
+
+		if (pfd[0].revents & POLLIN)
+			em_export_scrape(&ex, listen_fd);
+
+		if (pid && pfd[1].revents) {
+			struct em_export_result res;
+			int ok = (read(result_fd, &res, sizeof(res)) == sizeof(res));
+			close(result_fd);
+			waitpid(pid, NULL, 0);
+			pid = 0;
+
+			ex.refreshes++;
+			ex.refresh_duration = em_now() - ex.refresh_start;
+			if (ok) {
+				ex.budget.tokens -= res.stats.requests;
+				ex.link.requests += res.stats.requests;
+				ex.link.retries += res.stats.retries;
+				ex.link.timeouts += res.stats.timeouts;
+				ex.link.parity_errors += res.stats.parity_errors;
+				ex.link.checksum_errors += res.stats.checksum_errors;
+				ex.link.framing_errors += res.stats.framing_errors;
+			}
+			if (!ok || res.ret) {
+				log_line(LOG_ERR, "Refresh failed");
+				ex.refresh_failures++;
+				ex.failed_time = time(NULL);
+				continue;
+			}
+			if (res.meter.valid) {
+				struct em_meter prev = ex.meter;
+				ex.meter = res.meter;
+				if (!res.meter.months_valid && prev.months_valid && (prev.secadr == res.meter.secadr)) {
+					ex.meter.months_valid = 1;
+					memcpy(ex.meter.month_date, prev.month_date, sizeof(prev.month_date));
+					memcpy(ex.meter.month_value, prev.month_value, sizeof(prev.month_value));
+				}
+			}
+			ex.failed_time = 0;
+			ex.highres_time = time(NULL);
+			if (res.meter.months_valid) ex.months_time = ex.highres_time;
+		}
+	}
+	return 0;
+}
+
+/*
+   Cluster mode: a coordinator owns the manifest and its journal, workers
+   (supervisor mode on other bench hosts) pull jobs in batches over TCP and
+   report the results. Each line of the manifest is a job (commands of one
+   session, preceded by an optional count of identical jobs), run on whatever
+   meter is placed under a free head of any worker. The protocol is text,
+   one message per line:
+
+     worker:      HELLO <name>, PULL <jobs> <idle heads>, START <job>,
+                  DONE <job> <ret> <secadr>, RETURN [<job> ...],
+                  HANDOVER [<job> ...]
+     coordinator: JOB <job> [<command> ...], STEAL <jobs>, END
+
+   Jobs asked for but not available are handed out as soon as jobs are
+   returned or fail. Jobs are only queued by workers as long as they have no
+   head to run them on, so when none are left and a head is idle, queued jobs
+   are stolen from the worker holding most (HANDOVER answers STEAL, RETURN
+   gives back jobs unasked, queued or aborted while running). The journal is
+   appended to and replayed on restart. Queued jobs of lost workers are
+   handed out again at once, running ones only if the worker does not say
+   HELLO again within EM_CLUSTER_GRACE to report them.
+*/
+#define EM_JOB_PENDING		0
+#define EM_JOB_QUEUED		1
+#define EM_JOB_RUNNING		2
+#define EM_JOB_DONE		3
+#define EM_JOB_FAILED		4
+
+struct em_cluster_job {
+	const char *cmds;		/* into the manifest, shared by repeated jobs */
+	int state;
+	int worker;			/* queued by or running on, EM_CLUSTER_WORKERS + lost slot if its worker is gone */
+	unsigned int attempts;
+	int ret;			/* of the last attempt */
+	uint32_t secadr;		/* meter provisioned */
+};
+
+struct em_cluster_worker {
+	int fd;				/* -1 if the slot is unused */
+	char name[64];
+	char in[EM_CLUSTER_LINE];
+	size_t len;
+	unsigned int want;		/* jobs asked for but not handed out yet */
+	unsigned int idle;		/* heads waiting for a job */
+	unsigned int queued;
+	unsigned int running;
+	unsigned int done;
+	int stealing;			/* STEAL sent, HANDOVER outstanding */
+};
+
+/* Worker gone while running jobs, they are kept for it for EM_CLUSTER_GRACE */
+struct em_cluster_lost {
+	char name[64];			/* empty if the slot is unused */
+	double since;
+};
+
+struct em_cluster {
+	char *text;			/* manifest */
+	struct em_cluster_job *jobs;
+	unsigned int njobs;
+	unsigned int ndone;
+	unsigned int nfailed;
+	unsigned int *pending;		/* ring of job indices */
+	unsigned int first;
+	unsigned int npending;
+	int journal;
+	struct em_cluster_worker w[EM_CLUSTER_WORKERS];
+	struct em_cluster_lost lost[EM_CLUSTER_WORKERS];
+};
+
+void em_cluster_send(const int fd, const char *fmt, ...) {
+	char line[EM_CLUSTER_LINE + 32];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	if ((len >= sizeof(line)) || (send(fd, line, len, MSG_NOSIGNAL) != len))
+		log_line(LOG_DEBUG, "Failed to send '%.*s'", (int) strcspn(line, "\n"), line);
+}
+
+void em_cluster_log(struct em_cluster *c, const unsigned int j, const char *event, const struct em_cluster_worker *w) {
+	char line[160];
+	int len = snprintf(line, sizeof(line), "%ld %u %s %s 0x%08x %d\n", (long) time(NULL), j + 1, event,
+			   w ? w->name : "-", c->jobs[j].secadr, c->jobs[j].ret);
+
+	if ((write(c->journal, line, len) != len) || fdatasync(c->journal))
+		log_line(LOG_ERR, "Failed to write journal: %s", strerror(errno));
+}
+
+void em_cluster_pend(struct em_cluster *c, const unsigned int j) {
+	c->jobs[j].state = EM_JOB_PENDING;
+	c->jobs[j].worker = -1;
+	c->pending[(c->first + c->npending++) % c->njobs] = j;
+}
+
+int em_cluster_load(struct em_cluster *c, const char *path) {
+	struct stat st;
+	char *line, *next;
+	unsigned int lineno = 0, size = 0;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if ((fd < 0) || fstat(fd, &st)) {
+		log_line(LOG_ERR, "Failed to open manifest '%s': %s", path, strerror(errno));
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+	c->text = malloc(st.st_size + 1);
+	if (!c->text || (read(fd, c->text, st.st_size) != st.st_size)) {
+		log_line(LOG_ERR, "Failed to read manifest '%s'", path);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	c->text[st.st_size] = 0;
+
+	for (line = c->text; line; line = next) {
+		char *p = line, *end;
+		unsigned long count = 1;
+
+		lineno++;
+		if ((next = strchr(line, '\n')))
+			*next++ = 0;
+		line[strcspn(line, "#\r")] = 0;
+		while (isspace((unsigned char) *p)) p++;
+		if (!*p)
+			continue;
+		if (isdigit((unsigned char) *p)) {
+			count = strtoul(p, &p, 10);
+			while (isspace((unsigned char) *p)) p++;
+		}
+		for (end = p + strlen(p); (end > p) && isspace((unsigned char) end[-1]); end--);
+		*end = 0;
+		if ((count > 1000000) || (end - p >= EM_CLUSTER_LINE - 32)) {
+			log_line(LOG_ERR, "Invalid job in line %u of '%s'", lineno, path);
+			return -1;
+		}
+		for (char *cmd = p; *cmd; ) {
+			char name[32];
+			size_t len = strcspn(cmd, " \t");
+			snprintf(name, sizeof(name), "%.*s", (int) len, cmd);
+			if (!em_find_cmd(name)) {
+				log_line(LOG_ERR, "Unknown command '%s' in line %u of '%s'", name, lineno, path);
+				return -1;
+			}
+			cmd += len + strspn(cmd + len, " \t");
+		}
+		if (c->njobs + count > size) {
+			size = (c->njobs + count > 2 * size) ? c->njobs + count : 2 * size;
+			struct em_cluster_job *jobs = realloc(c->jobs, size * sizeof(*jobs));
+			if (!jobs)
+				return -1;
+			c->jobs = jobs;
+		}
+		for (unsigned long i = 0; i < count; i++)
+			c->jobs[c->njobs++] = (struct em_cluster_job) { .cmds = p, .worker = -1 };
+	}
+	if (!c->njobs) {
+		log_line(LOG_ERR, "Manifest '%s' has no jobs", path);
+		return -1;
+	}
+	return (c->pending = calloc(c->njobs, sizeof(*c->pending))) ? 0 : -1;
+}
+
+int em_cluster_replay(struct em_cluster *c, const char *path) {
+	char line[160];
+	unsigned int n;
+	FILE *f = fopen(path, "r");
+
+	if (f) {
+		if (!fgets(line, sizeof(line), f) || (sscanf(line, "# em-admin journal, %u jobs", &n) != 1) ||
+		    (n != c->njobs)) {
+			log_line(LOG_ERR, "Journal '%s' does not belong to a manifest of %u jobs", path, c->njobs);
+			fclose(f);
+			return -1;
+		}
+		while (fgets(line, sizeof(line), f)) {
+			unsigned int j, secadr;
+			char event[16];
+			if ((sscanf(line, "%*d %u %15s %*s %x", &j, event, &secadr) == 3) && j && (j <= c->njobs) &&
+			    !strcmp(event, "done") && (c->jobs[j - 1].state != EM_JOB_DONE)) {
+				c->jobs[j - 1].state = EM_JOB_DONE;
+				c->jobs[j - 1].secadr = secadr;
+				c->ndone++;
+			}
+		}
+		fclose(f);
+	}
+
+	c->journal = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (c->journal < 0) {
+		log_line(LOG_ERR, "Failed to open journal '%s': %s", path, strerror(errno));
+		return -1;
+	}
+	if (!f) {
+		int len = snprintf(line, sizeof(line), "# em-admin journal, %u jobs\n", c->njobs);
+		if (write(c->journal, line, len) != len)
+			return -1;
+	}
+	for (unsigned int j = 0; j < c->njobs; j++)
+		if (c->jobs[j].state != EM_JOB_DONE) em_cluster_pend(c, j);
+	return 0;
+}
+
+void em_cluster_dispatch(struct em_cluster *c) {
+	for (unsigned int i = 0; i < EM_CLUSTER_WORKERS; i++) {
+		struct em_cluster_worker *w = &c->w[i];
+		while ((w->fd >= 0) && w->want && c->npending) {
+			const unsigned int j = c->pending[c->first];
+			c->first = (c->first + 1) % c->njobs;
+			c->npending--;
+			c->jobs[j].state = EM_JOB_QUEUED;
+			c->jobs[j].worker = i;
+			w->queued++;
+			w->want--;
+			em_cluster_send(w->fd, "JOB %u %s\n", j + 1, c->jobs[j].cmds);
+		}
+	}
+
+	/* nothing left to hand out, idle heads steal from the worker holding most */
+	for (unsigned int i = 0; i < EM_CLUSTER_WORKERS; i++) {
+		struct em_cluster_worker *w = &c->w[i], *v = NULL;
+		if ((w->fd < 0) || !w->want || !w->idle)
+			continue;
+		for (unsigned int k = 0; k < EM_CLUSTER_WORKERS; k++)
+			if ((k != i) && (c->w[k].fd >= 0) && !c->w[k].stealing && c->w[k].queued &&
+			    (!v || (c->w[k].queued > v->queued))) v = &c->w[k];
+		if (!v)
+			break;
+		const unsigned int n = (v->queued + 1) / 2;
+		em_cluster_send(v->fd, "STEAL %u\n", (n < w->idle) ? n : w->idle);
+		v->stealing = 1;
+	}
+}
+
+/* Job number from a worker, only valid if the job is held by the worker in the given state */
+int em_cluster_held(const struct em_cluster *c, const unsigned int i, const unsigned int j, const int state) {
+	return j && (j <= c->njobs) && (c->jobs[j - 1].worker == i) && (c->jobs[j - 1].state == state);
+}
+
+void em_cluster_adopt(struct em_cluster *c, const unsigned int i);
+
+void em_cluster_line(struct em_cluster *c, const unsigned int i, char *line) {
+	struct em_cluster_worker *w = &c->w[i];
+	unsigned int j, n, idle, secadr;
+	int ret;
+
+	if (!strncmp(line, "HELLO ", 6)) {
+		snprintf(w->name, sizeof(w->name), "%s", line + 6);
+		log_line(LOG_INFO, "Worker %s joined", w->name);
+		em_cluster_adopt(c, i);
+	} else if (sscanf(line, "PULL %u %u", &n, &idle) == 2) {
+		w->want += n;
+		w->idle = idle;
+	} else if ((sscanf(line, "START %u", &j) == 1) && em_cluster_held(c, i, j, EM_JOB_QUEUED)) {
+		struct em_cluster_job *job = &c->jobs[j - 1];
+		job->state = EM_JOB_RUNNING;
+		w->queued--;
+		w->running++;
+		em_cluster_log(c, j - 1, "start", w);
+	} else if ((sscanf(line, "DONE %u %d %x", &j, &ret, &secadr) == 3) && em_cluster_held(c, i, j, EM_JOB_RUNNING)) {
+		struct em_cluster_job *job = &c->jobs[j - 1];
+		w->running--;
+		job->ret = ret;
+		job->secadr = secadr;
+		job->attempts++;
+		if (!ret) {
+			job->state = EM_JOB_DONE;
+			w->done++;
+			c->ndone++;
+			em_cluster_log(c, j - 1, "done", w);
+			log_line(LOG_INFO, "Job %u done on 0x%08x by %s (%u of %u)", j, secadr, w->name, c->ndone, c->njobs);
+		} else if (job->attempts < EM_CLUSTER_ATTEMPTS) {
+			em_cluster_log(c, j - 1, "retry", w);
+			log_line(LOG_ERR, "Job %u failed on 0x%08x by %s: %s, retrying", j, secadr, w->name, strerror(ret));
+			em_cluster_pend(c, j - 1);
+		} else {
+			job->state = EM_JOB_FAILED;
+			c->nfailed++;
+			em_cluster_log(c, j - 1, "failed", w);
+			log_line(LOG_ERR, "Job %u failed on 0x%08x by %s: %s, giving up", j, secadr, w->name, strerror(ret));
+		}
+	} else if (!strncmp(line, "RETURN", 6) || !strncmp(line, "HANDOVER", 8)) {
+		char *p = line + ((line[0] == 'R') ? 6 : 8);
+		while ((j = strtoul(p, &p, 10))) {
+			if (em_cluster_held(c, i, j, EM_JOB_QUEUED)) {
+				w->queued--;
+				em_cluster_pend(c, j - 1);
+			} else if (em_cluster_held(c, i, j, EM_JOB_RUNNING)) {
+				/* head unplugged during the session */
+				w->running--;
+				em_cluster_log(c, j - 1, "return", w);
+				em_cluster_pend(c, j - 1);
+			}
+		}
+		if (line[0] == 'H')
+			w->stealing = 0;
+	} else if (!strncmp(line, "START ", 6) || !strncmp(line, "DONE ", 5)) {
+		/* a job taken back meanwhile, e.g. after the grace period, it runs elsewhere */
+	} else {
+		log_line(LOG_ERR, "Invalid message from worker %s: '%.40s'", w->name, line);
+	}
+}
+
+/* Worker gone, its queued jobs are handed out again, running ones wait for it to reconnect */
+void em_cluster_lose(struct em_cluster *c, const unsigned int i) {
+	struct em_cluster_worker *w = &c->w[i];
+	unsigned int k = 0;
+
+	while (w->running && (k < EM_CLUSTER_WORKERS) && c->lost[k].name[0])
+		k++;
+	if (w->running && (k < EM_CLUSTER_WORKERS)) {
+		log_line(LOG_INFO, "Worker %s left after %u jobs, %u queued jobs handed out again, %u running kept for %d s",
+			 w->name, w->done, w->queued, w->running, EM_CLUSTER_GRACE);
+		memcpy(c->lost[k].name, w->name, sizeof(c->lost[k].name));
+		c->lost[k].since = em_now();
+	} else {
+		log_line(LOG_INFO, "Worker %s left after %u jobs, %u queued and %u running jobs handed out again",
+			 w->name, w->done, w->queued, w->running);
+		k = EM_CLUSTER_WORKERS;
+	}
+	for (unsigned int j = 0; j < c->njobs; j++) {
+		if (c->jobs[j].worker != i)
+			continue;
+		if (c->jobs[j].state == EM_JOB_QUEUED) {
+			em_cluster_pend(c, j);
+		} else if ((c->jobs[j].state == EM_JOB_RUNNING) && (k < EM_CLUSTER_WORKERS)) {
+			c->jobs[j].worker = EM_CLUSTER_WORKERS + k;
+		} else if (c->jobs[j].state == EM_JOB_RUNNING) {
+			em_cluster_log(c, j, "lost", w);
+			em_cluster_pend(c, j);
+		}
+	}
+	close(w->fd);
+	memset(w, 0, sizeof(*w));
+	w->fd = -1;
+}
+
+/* A worker saying HELLO again takes its running jobs back, a stale connection of it is dropped */
+void em_cluster_adopt(struct em_cluster *c, const unsigned int i) {
+	struct em_cluster_worker *w = &c->w[i];
+
+	for (unsigned int k = 0; k < EM_CLUSTER_WORKERS; k++)
+		if ((k != i) && (c->w[k].fd >= 0) && !strcmp(c->w[k].name, w->name))
+			em_cluster_lose(c, k);
+	for (unsigned int k = 0; k < EM_CLUSTER_WORKERS; k++) {
+		if (strcmp(c->lost[k].name, w->name))
+			continue;
+		for (unsigned int j = 0; j < c->njobs; j++) {
+			if (c->jobs[j].worker != EM_CLUSTER_WORKERS + k)
+				continue;
+			c->jobs[j].worker = i;
+			w->running++;
+		}
+		log_line(LOG_INFO, "Worker %s is back, %u running jobs kept", w->name, w->running);
+		c->lost[k].name[0] = 0;
+	}
+}
+
+/* Running jobs of workers that did not come back are handed out again */
+void em_cluster_expire(struct em_cluster *c) {
+	const double now = em_now();
+
+	for (unsigned int k = 0; k < EM_CLUSTER_WORKERS; k++) {
+		if (!c->lost[k].name[0] || (now - c->lost[k].since < EM_CLUSTER_GRACE))
+			continue;
+		log_line(LOG_INFO, "Worker %s did not come back, its running jobs are handed out again", c->lost[k].name);
+		for (unsigned int j = 0; j < c->njobs; j++) {
+			if (c->jobs[j].worker != EM_CLUSTER_WORKERS + k)
+				continue;
+			em_cluster_log(c, j, "lost", NULL);
+			em_cluster_pend(c, j);
+		}
+		c->lost[k].name[0] = 0;
+	}
+}
+
+int em_cluster_listen(const char *addr) {
+	struct addrinfo hints = { .ai_flags = AI_PASSIVE, .ai_socktype = SOCK_STREAM }, *ai;
+	char host[256], service[16];
+	const char *colon = strrchr(addr, ':');
+	int fd = -1, on = 1;
+
+	/* [address:]port, loopback only unless an address (0.0.0.0 for all interfaces) is given */
+	snprintf(host, sizeof(host), "%.*s", colon ? (int) (colon - addr) : 0, addr);
+	snprintf(service, sizeof(service), "%s", colon ? colon + 1 : addr);
+	if (getaddrinfo(host[0] ? host : "127.0.0.1", service, &hints, &ai)) {
+		log_line(LOG_ERR, "Invalid listen address '%s'", addr);
+		return -1;
+	}
+	fd = socket(ai->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if ((fd < 0) || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) ||
+	    bind(fd, ai->ai_addr, ai->ai_addrlen) || listen(fd, EM_CLUSTER_WORKERS)) {
+		log_line(LOG_ERR, "Failed to listen on '%s': %s", addr, strerror(errno));
+		if (fd >= 0) close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(ai);
+	return fd;
+}
+
+int em_cluster(const char *manifest, const char *addr) {
+	struct em_cluster c = { .journal = -1 };
+	char journal[PATH_MAX];
+	int listen_fd = -1, ret = 1;
+	const double t0 = em_now();
+
+	for (unsigned int i = 0; i < EM_CLUSTER_WORKERS; i++)
+		c.w[i].fd = -1;
+	snprintf(journal, sizeof(journal), "%s.journal", manifest);
+	if (em_cluster_load(&c, manifest) || em_cluster_replay(&c, journal) || ((listen_fd = em_cluster_listen(addr)) < 0))
+		goto out;
+
+	signal(SIGINT, em_probe_sigint);
+	signal(SIGTERM, em_probe_sigint);
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	log_line(LOG_INFO, "Coordinating %u jobs of '%s' on '%s', %u done before, journal '%s'",
+		 c.njobs, manifest, addr, c.ndone, journal);
+
+	while (!em_probe_stop && (c.ndone + c.nfailed < c.njobs)) {
+		struct pollfd pfd[1 + EM_CLUSTER_WORKERS] = { { .fd = listen_fd, .events = POLLIN } };
+
+		for (unsigned int i = 0; i < EM_CLUSTER_WORKERS; i++)
+			pfd[1 + i] = (struct pollfd) { .fd = c.w[i].fd, .events = POLLIN };
+		em_cluster_expire(&c);
+		if (poll(pfd, 1 + EM_CLUSTER_WORKERS, 1000) <= 0)
+			continue;
+
+		if (pfd[0].revents & POLLIN) {
+			int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+			unsigned int i;
+			for (i = 0; (i < EM_CLUSTER_WORKERS) && (c.w[i].fd >= 0); i++);
+			if ((fd >= 0) && (i == EM_CLUSTER_WORKERS)) {
+				log_line(LOG_ERR, "Too many workers, refusing connection");
+				close(fd);
+			} else if (fd >= 0) {
+				c.w[i].fd = fd;
+				strcpy(c.w[i].name, "?");
+			}
+		}
+
+		for (unsigned int i = 0; i < EM_CLUSTER_WORKERS; i++) {
+			struct em_cluster_worker *w = &c.w[i];
+			char *line, *nl;
+			ssize_t n;
+
+			if (!pfd[1 + i].revents || (w->fd < 0))
+				continue;
+			n = read(w->fd, w->in + w->len, sizeof(w->in) - 1 - w->len);
+			if (n <= 0) {
+				em_cluster_lose(&c, i);
+				continue;
+			}
+			w->len += n;
+			w->in[w->len] = 0;
+			for (line = w->in; (nl = strchr(line, '\n')); line = nl + 1) {
+				*nl = 0;
+				em_cluster_line(&c, i, line);
+			}
+			w->len -= line - w->in;
+			memmove(w->in, line, w->len);
+			if (w->len == sizeof(w->in) - 1) {
+				log_line(LOG_ERR, "Line too long from worker %s", w->name);
+				em_cluster_lose(&c, i);
+			}
+		}
+		em_cluster_dispatch(&c);
+	}
+
+	for (unsigned int i = 0; i < EM_CLUSTER_WORKERS; i++) {
+		if (c.w[i].fd < 0)
+			continue;
+		em_cluster_send(c.w[i].fd, "END\n");
+		log_line(LOG_INFO, "Worker %s: %u jobs done", c.w[i].name, c.w[i].done);
+		close(c.w[i].fd);
+	}
+	printf("%s: %u of %u jobs done, %u failed, %.0f s\n", manifest, c.ndone, c.njobs, c.nfailed, em_now() - t0);
+	for (unsigned int j = 0; j < c.njobs; j++)
+		if (c.jobs[j].state == EM_JOB_FAILED)
+			printf("FAILED job %u (%s) on 0x%08x: %s\n", j + 1, c.jobs[j].cmds, c.jobs[j].secadr, strerror(c.jobs[j].ret));
+	ret = (c.ndone != c.njobs);
+
+ out:
+	if (listen_fd >= 0) close(listen_fd);
+	if (c.journal >= 0) close(c.journal);
+	free(c.jobs);
+	free(c.pending);
+	free(c.text);
+	return ret;
+}
+
+struct em_port {
+	char name[NAME_MAX + 1];	/* device node, empty if slot is unused */
+	pid_t pid;			/* session in progress */
+	int done;			/* session finished, wait for head to be unplugged */
+	unsigned int job;		/* cluster job of the session, 0 if none */
+	int result_fd;			/* session result of a cluster job */
+};
+
+struct em_port em_ports[EM_MAX_PORTS];
+
+/* Worker side of cluster mode, jobs are queued until a head is free */
+struct em_work_job {
+	unsigned int id;
+	char cmds[EM_CLUSTER_LINE];
+};
+
+struct em_work {
+	const char *addr;		/* coordinator, NULL in plain supervisor mode */
+	int fd;				/* -1 while not connected */
+	double lost;			/* connection lost at, reconnecting */
+	double retry;			/* next reconnection attempt */
+	char reports[EM_MAX_PORTS][48];	/* results of sessions finished while not connected */
+	unsigned int nreports;
+	const char *dir;
+	const sigset_t *sigmask;
+	char in[EM_CLUSTER_LINE + 32];
+	size_t len;
+	struct em_work_job queue[EM_CLUSTER_QUEUE];
+	unsigned int first;
+	unsigned int count;
+	unsigned int asked;		/* jobs pulled but not received yet */
+	unsigned int idle;		/* heads waiting for a job, as last told to the coordinator */
+	int end;			/* manifest complete */
+} em_work = { .fd = -1 };
+
+/*
+   Scheduler mode: heads stay on their meters and each line of a schedule
+   file ("<interval> <command> ...") is run again and again. Every head has
+   one timer in a hashed timing wheel of one second slots, timers more than a
+   lap ahead stay in their slot until due. Jobs of a head due within
+   EM_SCHED_BATCH of their interval share the session, so the meter is woken
+   up once, and every due time is delayed by up to EM_SCHED_JITTER of the
+   interval to keep ports from running in step. Sessions are only started
+   while the meter has requests left in its token bucket.
+*/
+struct em_sched_entry {
+	unsigned int interval;			/* s */
+	char *cmds[EM_SCHED_CMDS];
+	int ncmds;
+};
+
+struct em_sched_meter {
+	unsigned int secadr;
+	struct em_bucket bucket;		/* refilled by the budget of the schedule */
+};
+
+struct em_sched {
+	char *text;
+	struct em_sched_entry entries[EM_SCHED_ENTRIES];
+	unsigned int count;			/* 0 if not in scheduler mode */
+	double budget;				/* requests per meter and day */
+	int wheel[EM_SCHED_SLOTS];		/* first timer of each slot, -1 if none */
+	int link[EM_MAX_PORTS];			/* next timer in the slot, -2 if not armed */
+	time_t wake[EM_MAX_PORTS];		/* timer of each head */
+	time_t tick;				/* last second handled, all times are em_sched_now() */
+	time_t nominal[EM_MAX_PORTS][EM_SCHED_ENTRIES];	/* due time without jitter */
+	time_t due[EM_MAX_PORTS][EM_SCHED_ENTRIES];
+	unsigned int ran[EM_MAX_PORTS];		/* entries of the running session, bit mask */
+	long secadr[EM_MAX_PORTS];		/* of the meter under the head, -1 if unknown */
+	struct em_sched_meter meters[EM_MAX_PORTS];
+} em_sched;
+
+struct em_port *em_port_find(const char *name) {
+	for (unsigned int i = 0; i < EM_MAX_PORTS; i++)
+		if (em_ports[i].name[0] && !strcmp(em_ports[i].name, name)) return &em_ports[i];
+	return NULL;
+}
+
+void em_sched_disarm(const unsigned int i) {
+	if (em_sched.link[i] == -2)
+		return;
+	for (int *p = &em_sched.wheel[em_sched.wake[i] % EM_SCHED_SLOTS]; *p >= 0; p = &em_sched.link[*p]) {
+		if (*p == (int) i) {
+			*p = em_sched.link[i];
+			break;
+		}
+	}
+	em_sched.link[i] = -2;
+}
+
+void em_sched_arm(const unsigned int i, const time_t wake) {
+	/* the slot of the current second has been handled already */
+	const time_t t = (wake > em_sched.tick) ? wake : em_sched.tick + 1;
+	int *slot = &em_sched.wheel[t % EM_SCHED_SLOTS];
+
+	em_sched_disarm(i);
+	em_sched.wake[i] = t;
+	em_sched.link[i] = *slot;
+	*slot = i;
+}
+
+/* Seconds on the clock of the wheel, steps of the wall clock must not stall it */
+time_t em_sched_now(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+time_t em_sched_jitter(const unsigned int interval) {
+	return random() % ((unsigned long) interval * EM_SCHED_JITTER / 100 + 1);
+}
+
+/* Wake up for the job due first */
+void em_sched_next(const unsigned int i, const time_t now) {
+	time_t wake = em_sched.due[i][0];
+
+	for (unsigned int e = 1; e < em_sched.count; e++)
+		if (em_sched.due[i][e] < wake) wake = em_sched.due[i][e];
+	em_sched_arm(i, (wake > now) ? wake : now);
+}
+
+/* A new head runs all jobs, spread over the jitter */
+void em_sched_attach(const unsigned int i) {
+	const time_t now = em_sched_now();
+
+	for (unsigned int e = 0; e < em_sched.count; e++) {
+		em_sched.nominal[i][e] = now;
+		em_sched.due[i][e] = now + em_sched_jitter(em_sched.entries[e].interval);
+	}
+	em_sched.secadr[i] = -1;
+	em_sched_next(i, now);
+}
+
+void em_port_start(struct em_port *port, const char *dir, const sigset_t *sigmask, char *cmds[], const int ncmds) {
+	char path[PATH_MAX];
+	int pfd[2] = { -1, -1 };
+
+	snprintf(path, sizeof(path), "%s/%s", dir, port->name);
+	fflush(stdout);
+	if ((port->job || em_sched.count) && pipe2(pfd, O_CLOEXEC))
+		port->pid = -1;
+	else
+		port->pid = fork();
+	if (port->pid < 0) {
+		log_line(LOG_ERR, "Failed to start session on '%s': %s", path, strerror(errno));
+		port->pid = 0;
+		/* a scheduled head keeps its timer and retries */
+		if (!em_sched.count)
+			port->name[0] = 0;
+		if (pfd[0] >= 0) {
+			close(pfd[0]);
+			close(pfd[1]);
+		}
+		return;
+	}
+	if (!port->pid) {
+		struct em_export_result res;
+
+		sigprocmask(SIG_SETMASK, sigmask, NULL);
+		log_tag = port->name;
+		em_rt_head = port - em_ports;
+		if (!port->job && !em_sched.count)
+			exit(em_session(path, cmds, ncmds));
+		res.ret = em_session(path, cmds, ncmds);
+		res.meter = em_meter;
+		res.stats = mbus_stats;
+		exit((write(pfd[1], &res, sizeof(res)) != sizeof(res)) || res.ret);
+	}
+	if (!port->job && !em_sched.count) {
+		log_line(LOG_INFO, "Opto head attached to '%s', session started (pid %d)", path, port->pid);
+		return;
+	}
+	close(pfd[1]);
+	port->result_fd = pfd[0];
+	if (port->job)
+		log_line(LOG_INFO, "Job %u started on '%s' (pid %d)", port->job, path, port->pid);
+}
+
+void em_port_attach(const char *dir, const char *prefix, const char *name,
+		    const sigset_t *sigmask, char *cmds[], const int ncmds) {
+	char path[PATH_MAX];
+	struct em_port *port;
+
+	if ((name[0] == '.') || strncmp(name, prefix, strlen(prefix)))
+		return;
+
+	port = em_port_find(name);
+	if (port && (port->pid || port->done))
+		return;
+
+	/* udev may still be fixing permissions, we will retry on IN_ATTRIB */
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if (access(path, R_OK | W_OK))
+		return;
+
+	for (unsigned int i = 0; !port && (i < EM_MAX_PORTS); i++)
+		if (!em_ports[i].name[0] && !em_ports[i].pid) port = &em_ports[i];
+	if (!port) {
+		log_line(LOG_ERR, "Too many opto heads, ignoring '%s'", path);
+		return;
+	}
+
+	if (em_sched.count) {
+		/* scheduler mode, the timer of the head starts the sessions */
+		if (!port->name[0]) {
+			log_line(LOG_INFO, "Opto head attached to '%s', %u jobs scheduled", path, em_sched.count);
+			snprintf(port->name, sizeof(port->name), "%s", name);
+			em_sched_attach(port - em_ports);
+		}
+		return;
+	}
+	if (em_work.addr) {
+		/* cluster mode, the session starts as soon as there is a job */
+		if (!port->name[0])
+			log_line(LOG_INFO, "Opto head attached to '%s', waiting for a job", path);
+		snprintf(port->name, sizeof(port->name), "%s", name);
+		return;
+	}
+	snprintf(port->name, sizeof(port->name), "%s", name);
+	em_port_start(port, dir, sigmask, cmds, ncmds);
+}
+
+void em_port_detach(const char *name) {
+	struct em_port *port = em_port_find(name);
+
+	if (!port)
+		return;
+
+	if (port->pid) {
+		log_line(LOG_INFO, "Opto head detached from '%s', aborting session", name);
+		kill(port->pid, SIGTERM);
+	} else {
+		log_line(LOG_INFO, "Opto head detached from '%s'", name);
+	}
+	if (em_sched.count)
+		em_sched_disarm(port - em_ports);
+	port->name[0] = 0;
+	port->done = 0;
+}
+
+/* Start queued jobs on the heads waiting for one */
+void em_work_assign(void) {
+	for (unsigned int i = 0; (i < EM_MAX_PORTS) && em_work.count; i++) {
+		struct em_port *port = &em_ports[i];
+		struct em_work_job *job = &em_work.queue[em_work.first];
+		char *cmds[EM_CLUSTER_LINE / 2];
+		int ncmds = 0, known = 1;
+
+		if (!port->name[0] || port->pid || port->done)
+			continue;
+		em_work.first = (em_work.first + 1) % EM_CLUSTER_QUEUE;
+		em_work.count--;
+		for (char *p = strtok(job->cmds, " \t"); p; p = strtok(NULL, " \t")) {
+			known &= !!em_find_cmd(p);
+			cmds[ncmds++] = p;
+		}
+		em_cluster_send(em_work.fd, "START %u\n", job->id);
+		if (!known) {
+			/* coordinator of another version */
+			log_line(LOG_ERR, "Job %u has unknown commands", job->id);
+			em_cluster_send(em_work.fd, "DONE %u %d 0\n", job->id, EINVAL);
+			continue;
+		}
+		port->job = job->id;
+		em_port_start(port, em_work.dir, em_work.sigmask, cmds, ncmds);
+		if (!port->pid) {
+			em_cluster_send(em_work.fd, "DONE %u %d 0\n", job->id, EAGAIN);
+			port->job = 0;
+		}
+	}
+}
+
+/* Keep a job queued for every idle head plus a few for heads to come */
+void em_work_pull(void) {
+	unsigned int idle = 0, n = 0;
+
+	for (unsigned int i = 0; i < EM_MAX_PORTS; i++)
+		idle += em_ports[i].name[0] && !em_ports[i].pid && !em_ports[i].done;
+	if (em_work.count + em_work.asked < idle + EM_CLUSTER_PREFETCH)
+		n = idle + EM_CLUSTER_PREFETCH - em_work.count - em_work.asked;
+	if (n || (idle != em_work.idle))
+		em_cluster_send(em_work.fd, "PULL %u %u\n", n, idle);
+	em_work.asked += n;
+	em_work.idle = idle;
+}
+
+void em_work_line(char *line) {
+	unsigned int id, n, len;
+
+	if (sscanf(line, "JOB %u %n", &id, &len) == 1) {
+		if (em_work.asked)
+			em_work.asked--;
+		if (em_work.count == EM_CLUSTER_QUEUE) {
+			em_cluster_send(em_work.fd, "RETURN %u\n", id);
+			return;
+		}
+		struct em_work_job *job = &em_work.queue[(em_work.first + em_work.count++) % EM_CLUSTER_QUEUE];
+		job->id = id;
+		snprintf(job->cmds, sizeof(job->cmds), "%s", line + len);
+	} else if (sscanf(line, "STEAL %u", &n) == 1) {
+		/* the jobs received last would have been started last */
+		char ret[EM_CLUSTER_LINE] = "RETURN";
+		size_t p = strlen(ret);
+		while (n-- && em_work.count && (p < sizeof(ret) - 16)) {
+			em_work.count--;
+			p += sprintf(ret + p, " %u", em_work.queue[(em_work.first + em_work.count) % EM_CLUSTER_QUEUE].id);
+		}
+		log_line(LOG_INFO, "Handing over jobs%s", ret + 6);
+		em_cluster_send(em_work.fd, "HANDOVER%s\n", ret + 6);
+	} else if (!strcmp(line, "END")) {
+		log_line(LOG_INFO, "Manifest complete");
+		em_work.end = 1;
+	}
+}
+
+/* Read from the coordinator, -1 if it is gone */
+int em_work_read(void) {
+	char *line, *nl;
+	ssize_t n = read(em_work.fd, em_work.in + em_work.len, sizeof(em_work.in) - 1 - em_work.len);
+
+	if (n <= 0)
+		return -1;
+	em_work.len += n;
+	em_work.in[em_work.len] = 0;
+	for (line = em_work.in; (nl = strchr(line, '\n')); line = nl + 1) {
+		*nl = 0;
+		em_work_line(line);
+	}
+	em_work.len -= line - em_work.in;
+	memmove(em_work.in, line, em_work.len);
+	return (em_work.len == sizeof(em_work.in) - 1) ? -1 : 0;
+}
+
+/* Report the session of a job, jobs aborted by unplugging the head go back; kept until reconnected */
+void em_work_result(struct em_port *port) {
+	struct em_export_result res;
+	char *r = em_work.reports[em_work.nreports];
+
+	if (read(port->result_fd, &res, sizeof(res)) == sizeof(res))
+		sprintf(r, "DONE %u %d %x\n", port->job, res.ret, res.meter.valid ? res.meter.secadr : 0);
+	else if (!port->name[0])
+		sprintf(r, "RETURN %u\n", port->job);
+	else
+		sprintf(r, "DONE %u %d 0\n", port->job, EIO);
+	close(port->result_fd);
+	port->job = 0;
+	if (em_work.fd >= 0)
+		em_cluster_send(em_work.fd, "%s", r);
+	else
+		em_work.nreports++;
+}
+
+/* Connection to the coordinator lost: queued jobs are handed out again by it, running sessions go on */
+void em_work_disconnect(void) {
+	log_line(LOG_ERR, "Lost coordinator, reconnecting, running sessions go on");
+	close(em_work.fd);
+	em_work.fd = -1;
+	em_work.lost = em_work.retry = em_now();
+	em_work.len = em_work.count = em_work.asked = em_work.idle = 0;
+}
+
+int em_work_connect(const char *addr) {
+	struct addrinfo hints = { .ai_socktype = SOCK_STREAM }, *ai, *a;
+	char host[256], service[16];
+	const char *colon = strrchr(addr, ':');
+
+	/* host[:port] */
+	snprintf(host, sizeof(host), "%.*s", colon ? (int) (colon - addr) : (int) strlen(addr), addr);
+	snprintf(service, sizeof(service), "%s", colon ? colon + 1 : "");
+	if (!colon)
+		snprintf(service, sizeof(service), "%d", EM_CLUSTER_PORT);
+	if (getaddrinfo(host, service, &hints, &ai)) {
+		log_line(LOG_ERR, "Invalid coordinator address '%s'", addr);
+		return -1;
+	}
+	for (a = ai; a; a = a->ai_next) {
+		if ((em_work.fd = socket(a->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+			continue;
+		if (!connect(em_work.fd, a->ai_addr, a->ai_addrlen))
+			break;
+		close(em_work.fd);
+		em_work.fd = -1;
+	}
+	freeaddrinfo(ai);
+	if (em_work.fd < 0) {
+		log_line(LOG_ERR, "Failed to connect to coordinator '%s': %s", addr, strerror(errno));
+		return -1;
+	}
+	em_work.addr = addr;
+	gethostname(host, sizeof(host) - 16);
+	host[sizeof(host) - 16] = 0;
+	em_cluster_send(em_work.fd, "HELLO %s/%d\n", host, getpid());
+	log_line(LOG_INFO, "Connected to coordinator '%s'", addr);
+	/* the same name, the coordinator gives back the jobs still running */
+	for (unsigned int i = 0; i < em_work.nreports; i++)
+		em_cluster_send(em_work.fd, "%s", em_work.reports[i]);
+	em_work.nreports = 0;
+	return 0;
+}
+
+int em_sched_load(const char *path) {
+	const char units[] = "smhdw";
+	const unsigned int scale[] = { 1, 60, 60 * 60, 24 * 60 * 60, 7 * 24 * 60 * 60 };
+	struct stat st;
+	char *line, *next;
+	unsigned int lineno = 0;
+	double needed = 0;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if ((fd < 0) || fstat(fd, &st)) {
+		log_line(LOG_ERR, "Failed to open schedule '%s': %s", path, strerror(errno));
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+	em_sched.text = malloc(st.st_size + 1);
+	if (!em_sched.text || (read(fd, em_sched.text, st.st_size) != st.st_size)) {
+		log_line(LOG_ERR, "Failed to read schedule '%s'", path);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	em_sched.text[st.st_size] = 0;
+	em_sched.budget = EM_SCHED_BUDGET;
+
+	for (line = em_sched.text; line; line = next) {
+		struct em_sched_entry *entry = &em_sched.entries[em_sched.count];
+		char *p = line, *end, *save;
+
+		lineno++;
+		if ((next = strchr(line, '\n')))
+			*next++ = 0;
+		line[strcspn(line, "#\r")] = 0;
+		while (isspace((unsigned char) *p)) p++;
+		if (!*p)
+			continue;
+		if (!strncmp(p, "budget", 6) && isspace((unsigned char) p[6])) {
+			em_sched.budget = strtod(p + 6, &end);
+			while (isspace((unsigned char) *end)) end++;
+			if ((em_sched.budget <= 0) || *end) {
+				log_line(LOG_ERR, "Invalid budget in line %u of '%s'", lineno, path);
+				return -1;
+			}
+			continue;
+		}
+		/* <interval>[s|m|h|d|w] <command> ... */
+		unsigned long interval = strtoul(p, &end, 10);
+		const char *unit = *end ? strchr(units, *end) : NULL;
+		if (unit) {
+			interval *= scale[unit - units];
+			end++;
+		}
+		if ((end == p) || !interval || (interval > 366 * 24 * 60 * 60) || !isspace((unsigned char) *end)) {
+			log_line(LOG_ERR, "Invalid interval in line %u of '%s'", lineno, path);
+			return -1;
+		}
+		if (em_sched.count == EM_SCHED_ENTRIES) {
+			log_line(LOG_ERR, "Too many jobs in '%s'", path);
+			return -1;
+		}
+		entry->interval = interval;
+		for (char *cmd = strtok_r(end, " \t", &save); cmd; cmd = strtok_r(NULL, " \t", &save)) {
+			if (!em_find_cmd(cmd) || (entry->ncmds == EM_SCHED_CMDS)) {
+				log_line(LOG_ERR, "%s '%s' in line %u of '%s'", em_find_cmd(cmd) ? "Too many commands at" :
+					 "Unknown command", cmd, lineno, path);
+				return -1;
+			}
+			entry->cmds[entry->ncmds++] = cmd;
+		}
+		if (!entry->ncmds) {
+			log_line(LOG_ERR, "No commands in line %u of '%s'", lineno, path);
+			return -1;
+		}
+		/* at least one request per command, more with retries */
+		needed += entry->ncmds * 24.0 * 60 * 60 / interval;
+		em_sched.count++;
+	}
+	if (!em_sched.count) {
+		log_line(LOG_ERR, "Schedule '%s' has no jobs", path);
+		return -1;
+	}
+
+	for (unsigned int k = 0; k < EM_SCHED_SLOTS; k++)
+		em_sched.wheel[k] = -1;
+	for (unsigned int i = 0; i < EM_MAX_PORTS; i++)
+		em_sched.link[i] = -2;
+	em_sched.tick = em_sched_now();
+	srandom(time(NULL) ^ getpid());
+	log_line(LOG_INFO, "Schedule '%s': %u jobs, budget %.0f requests per meter and day", path, em_sched.count,
+		 em_sched.budget);
+	if (needed > em_sched.budget)
+		log_line(LOG_WARNING, "Schedule needs at least %.0f requests per meter and day, jobs will be delayed", needed);
+	return 0;
+}
+
+/* Token bucket of a meter, refilled by the daily budget */
+struct em_sched_meter *em_sched_meter(const unsigned int secadr, const time_t now) {
+	struct em_sched_meter *m = NULL, *oldest = &em_sched.meters[0];
+
+	for (unsigned int k = 0; !m && (k < EM_MAX_PORTS); k++) {
+		if (em_sched.meters[k].bucket.time && (em_sched.meters[k].secadr == secadr))
+			m = &em_sched.meters[k];
+		else if (em_sched.meters[k].bucket.time < oldest->bucket.time)
+			oldest = &em_sched.meters[k];
+	}
+	if (!m) {
+		/* a meter not seen before takes the place of the one not seen the longest */
+		m = oldest;
+		*m = (struct em_sched_meter) { .secadr = secadr, .bucket = { .tokens = EM_SCHED_BURST, .time = now } };
+	}
+	em_bucket_refill(&m->bucket, now, em_sched.budget, EM_SCHED_BURST);
+	return m;
+}
+
+/* Run the jobs due on a head in one session */
+void em_sched_fire(const unsigned int i, const time_t now, const char *dir, const sigset_t *sigmask) {
+	struct em_port *port = &em_ports[i];
+	char *cmds[EM_SCHED_ENTRIES * EM_SCHED_CMDS];
+	char list[EM_CLUSTER_LINE];
+	unsigned int ran = 0;
+	size_t len = 0;
+	int ncmds = 0;
+
+	if (!port->name[0] || port->pid)
+		return;
+
+	for (unsigned int e = 0; e < em_sched.count; e++) {
+		const struct em_sched_entry *entry = &em_sched.entries[e];
+		if (em_sched.due[i][e] > now + (time_t) entry->interval * EM_SCHED_BATCH / 100)
+			continue;
+		ran |= 1 << e;
+		for (int c = 0; c < entry->ncmds; c++) {
+			int dup = 0;
+			for (int k = 0; k < ncmds; k++)
+				dup |= !strcmp(cmds[k], entry->cmds[c]);
+			if (dup)
+				continue;
+			cmds[ncmds++] = entry->cmds[c];
+			len += snprintf(list + len, (len < sizeof(list)) ? sizeof(list) - len : 0, " %s", entry->cmds[c]);
+		}
+	}
+	if (!ran) {
+		/* nothing due yet */
+		em_sched_next(i, now);
+		return;
+	}
+	if (em_sched.secadr[i] >= 0) {
+		/* a request per command and one for a retry */
+		const struct em_sched_meter *m = em_sched_meter(em_sched.secadr[i], now);
+		const double wait = em_bucket_wait(&m->bucket, ncmds + 1, em_sched.budget, EM_SCHED_BURST);
+		if (wait) {
+			log_line(LOG_WARNING, "Request budget of meter 0x%08x on '%s' too low for%s, waiting %.0f s",
+				 m->secadr, port->name, list, wait + 1);
+			em_sched_arm(i, now + (time_t) wait + 1);
+			return;
+		}
+	}
+	em_sched.ran[i] = ran;
+	log_line(LOG_INFO, "Running%s on '%s'", list, port->name);
+	em_port_start(port, dir, sigmask, cmds, ncmds);
+	if (!port->pid)
+		em_sched_arm(i, now + EM_SCHED_RETRY);
+}
+
+/* Charge the meter and move the jobs of the session on, failed ones stay due */
+void em_sched_result(struct em_port *port) {
+	const unsigned int i = port - em_ports;
+	const time_t now = em_sched_now();
+	struct em_export_result res;
+	int ok = (read(port->result_fd, &res, sizeof(res)) == sizeof(res));
+
+	close(port->result_fd);
+	if (ok && res.meter.valid) {
+		if ((em_sched.secadr[i] >= 0) && (em_sched.secadr[i] != res.meter.secadr))
+			log_line(LOG_INFO, "Meter under '%s' changed from 0x%08lx to 0x%08x", port->name,
+				 em_sched.secadr[i], res.meter.secadr);
+		em_sched.secadr[i] = res.meter.secadr;
+	}
+	if (ok && (em_sched.secadr[i] >= 0))
+		em_sched_meter(em_sched.secadr[i], now)->bucket.tokens -= res.stats.requests;
+	if (!port->name[0])
+		return;
+	if (!ok || res.ret) {
+		em_sched_arm(i, now + EM_SCHED_RETRY + em_sched_jitter(EM_SCHED_RETRY));
+		return;
+	}
+
+	for (unsigned int e = 0; e < em_sched.count; e++) {
+		const unsigned int interval = em_sched.entries[e].interval;
+		if (!(em_sched.ran[i] & (1 << e)))
+			continue;
+		em_sched.nominal[i][e] += interval;
+		if (em_sched.nominal[i][e] <= now) {
+			const time_t missed = (now - em_sched.nominal[i][e]) / interval + 1;
+			log_line(LOG_WARNING, "Running late on '%s', skipped %ld run(s) of %s", port->name, (long) missed,
+				 em_sched.entries[e].cmds[0]);
+			em_sched.nominal[i][e] += missed * interval;
+		}
+		em_sched.due[i][e] = em_sched.nominal[i][e] + em_sched_jitter(interval);
+	}
+	em_sched.ran[i] = 0;
+	em_sched_next(i, now);
+}
+
+/* Fire the timers of the slots passed since the last call */
+void em_sched_run(const char *dir, const sigset_t *sigmask) {
+	const time_t now = em_sched_now();
+	time_t t = (now - em_sched.tick > EM_SCHED_SLOTS) ? now - EM_SCHED_SLOTS : em_sched.tick;
+	int fire = -1;
+
+	for (t++; t <= now; t++) {
+		int *p = &em_sched.wheel[t % EM_SCHED_SLOTS];
+		while (*p >= 0) {
+			const int i = *p;
+			if (em_sched.wake[i] > now) {
+				/* a later lap */
+				p = &em_sched.link[i];
+				continue;
+			}
+			*p = em_sched.link[i];
+			em_sched.link[i] = fire;
+			fire = i;
+		}
+	}
+	em_sched.tick = now;
+	while (fire >= 0) {
+		const int i = fire;
+		fire = em_sched.link[i];
+		em_sched.link[i] = -2;
+		em_sched_fire(i, now, dir, sigmask);
+	}
+}
+
+/* ms until the next occupied slot, -1 if not in scheduler mode */
+int em_sched_timeout(void) {
+	struct timespec now;
+	unsigned int k = 1;
+
+	if (!em_sched.count)
+		return -1;
+	while ((k < EM_SCHED_SLOTS) && (em_sched.wheel[(em_sched.tick + k) % EM_SCHED_SLOTS] < 0))
+		k++;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	const long ms = (em_sched.tick + k - now.tv_sec) * 1000 - now.tv_nsec / 1000000;
+	return (ms > 0) ? ms : 0;
+}
+
+void em_port_reap(void) {
+	pid_t pid;
+	int status;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for (unsigned int i = 0; i < EM_MAX_PORTS; i++) {
+			struct em_port *port = &em_ports[i];
+			if (port->pid != pid) continue;
+			port->pid = 0;
+			if (port->job)
+				em_work_result(port);
+			else if (em_sched.count)
+				em_sched_result(port);
+			if (!port->name[0]) break;
+			/* scheduled heads stay on their meters */
+			port->done = !em_sched.count;
+			if (WIFEXITED(status) && !WEXITSTATUS(status))
+				log_line(LOG_INFO, "Session on '%s' completed successfully", port->name);
+			else
+				log_line(LOG_ERR, "Session on '%s' failed (status %d)", port->name,
+					 WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+		}
+	}
+}
+
+/*
+   Watch a directory for serial devices appearing and disappearing and run
+   a session on every opto head as soon as it shows up, e.g. "/dev/ttyUSB"
+   watches /dev for ttyUSB*, a plain directory matches all entries (symlinks
+   to ptys can be used for testing).
+*/
+int em_supervise(const char *watch, char *cmds[], const int ncmds) {
+	char dir[PATH_MAX];
+	const char *prefix = "";
+	char evbuf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct stat st;
+	sigset_t sigmask, oldmask;
+	int ret = 1;
+
+	snprintf(dir, sizeof(dir), "%s", watch);
+	if (stat(dir, &st) || !S_ISDIR(st.st_mode)) {
+		char *slash = strrchr(dir, '/');
+		if (!slash) {
+			log_line(LOG_ERR, "Invalid watch path '%s'", watch);
+			return ret;
+		}
+		*slash = 0;
+		prefix = watch + (slash - dir) + 1;
+		if (!dir[0]) strcpy(dir, "/");
+	}
+
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGCHLD);
+	sigaddset(&sigmask, SIGINT);
+	sigaddset(&sigmask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &sigmask, &oldmask);
+
+	int sig_fd = signalfd(-1, &sigmask, SFD_CLOEXEC);
+	int ino_fd = inotify_init1(IN_CLOEXEC);
+	if ((sig_fd < 0) || (ino_fd < 0) ||
+	    (inotify_add_watch(ino_fd, dir, IN_CREATE | IN_ATTRIB | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM) < 0)) {
+		log_line(LOG_ERR, "Failed to watch '%s': %s", dir, strerror(errno));
+		goto fail;
+	}
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	log_line(LOG_INFO, "Watching '%s' for opto heads '%s*'", dir, prefix);
+
+	em_work.dir = dir;
+	em_work.sigmask = &oldmask;
+	DIR *d = opendir(dir);
+	if (d) {
+		struct dirent *de;
+		while ((de = readdir(d)))
+			em_port_attach(dir, prefix, de->d_name, &oldmask, cmds, ncmds);
+		closedir(d);
+	}
+	if (em_work.fd >= 0)
+		em_work_pull();
+
+	struct pollfd pfd[3] = { { .fd = ino_fd, .events = POLLIN }, { .fd = sig_fd, .events = POLLIN },
+				 { .events = POLLIN } };
+	for (;;) {
+		/* the coordinator socket comes and goes, -1 is skipped by poll */
+		pfd[2].fd = em_work.fd;
+		if (poll(pfd, 3, (em_work.addr && (em_work.fd < 0)) ? EM_CLUSTER_RETRY * 1000 : em_sched_timeout()) < 0)
+			break;
+		if (pfd[0].revents & POLLIN) {
+			ssize_t len = read(ino_fd, evbuf, sizeof(evbuf));
+			for (ssize_t p = 0; p < len; ) {
+				const struct inotify_event *ev = (const struct inotify_event *) (evbuf + p);
+				if (ev->len && (ev->mask & (IN_CREATE | IN_ATTRIB | IN_MOVED_TO)))
+					em_port_attach(dir, prefix, ev->name, &oldmask, cmds, ncmds);
+				if (ev->len && (ev->mask & (IN_DELETE | IN_MOVED_FROM)))
+					em_port_detach(ev->name);
+				p += sizeof(struct inotify_event) + ev->len;
+			}
+		}
+		if (pfd[1].revents & POLLIN) {
+			struct signalfd_siginfo si;
+			if (read(sig_fd, &si, sizeof(si)) != sizeof(si)) continue;
+			if (si.ssi_signo != SIGCHLD) {
+				log_line(LOG_INFO, "Terminating, aborting running sessions");
+				ret = 0;
+				break;
+			}
+			em_port_reap();
+		}
+		if (em_sched.count)
+			em_sched_run(dir, &oldmask);
+		if (!em_work.addr)
+			continue;
+		if ((em_work.fd >= 0) && pfd[2].revents && em_work_read() && !em_work.end)
+			em_work_disconnect();
+		if (em_work.end) {
+			ret = 0;
+			break;
+		}
+		if (em_work.fd < 0) {
+			unsigned int running = 0;
+			for (unsigned int i = 0; i < EM_MAX_PORTS; i++)
+				running += !!em_ports[i].job;
+			if (!running && (em_now() - em_work.lost >= EM_CLUSTER_GRACE)) {
+				log_line(LOG_ERR, "Coordinator did not come back");
+				break;
+			}
+			if (em_now() < em_work.retry)
+				continue;
+			if (em_work_connect(em_work.addr)) {
+				em_work.retry = em_now() + EM_CLUSTER_RETRY;
+				continue;
+			}
+		}
+		em_work_assign();
+		em_work_pull();
+	}
+	for (unsigned int i = 0; i < EM_MAX_PORTS; i++)
+		if (em_ports[i].pid) kill(em_ports[i].pid, SIGTERM);
+	while (wait(NULL) > 0);
+
+ fail:
+	if (ino_fd >= 0) close(ino_fd);
+	if (sig_fd >= 0) close(sig_fd);
+	sigprocmask(SIG_SETMASK, &oldmask, NULL);
+	return ret;
+}
+
+int main(int argc, char *argv[]) {
+	char **cmds = argv + 2;
+	int ncmds = argc - 2;
+	int supervise = 0;
+
+	if ((argc == 3) && !strcmp(argv[2], "stats"))
+		return em_stats_report(argv[1]);
+
+	if ((argc == 3) && !strcmp(argv[2], "latency"))
+		return em_latency_report(argv[1]);
+
+	if ((argc == 3 || argc == 4) && !strcmp(argv[2], "readings"))
+		return em_readings_dump(argv[1], (argc == 4) ? argv[3] : NULL);
+
+	if ((argc == 3 || argc == 4) && !strcmp(argv[2], "snapshots"))
+		return em_snapshot_dump(argv[1], (argc == 4) ? argv[3] : NULL);
+
+	if ((argc == 3 || argc == 4) && !strcmp(argv[2], "analyze"))
+		return em_analyze(argv[1], (argc == 4) ? atoi(argv[3]) : 50);
+
+	if ((argc == 3 || argc == 4) && !strcmp(argv[2], "export"))
+		return em_export(argv[1], (argc == 4) ? atoi(argv[3]) : EM_EXPORT_PORT);
+
+	if ((argc == 4 || argc == 5) && !strcmp(argv[2], "coverage"))
+		return em_coverage(argv[1], argv[3], (argc == 5) ? atoi(argv[4]) : EM_COVERAGE_WINDOW);
+
+	if ((argc == 4 || argc == 5) && !strcmp(argv[2], "arrow"))
+		return em_arrow_export(argv[1], argv[3], (argc == 5) ? argv[4] : NULL);
+
+	if ((argc >= 4) && !strcmp(argv[2], "import"))
+		return em_import(argv[1], argv + 3, argc - 3);
+
+	if ((argc == 4 || argc == 5) && !strcmp(argv[2], "sniff"))
+		return em_sniff(argv[1], argv[3], (argc == 5) ? argv[4] : NULL);
+
+	if ((argc == 3 || argc == 4) && !strcmp(argv[2], "probe"))
+		return em_probe(argv[1], (argc == 4) ? strtoul(argv[3], NULL, 0) : 0);
+
+	if ((argc == 3 || argc == 4) && !strcmp(argv[2], "coordinate")) {
+		char port[16];
+		snprintf(port, sizeof(port), "%d", EM_CLUSTER_PORT);
+		return em_cluster(argv[1], (argc == 4) ? argv[3] : port);
+	}
+
+	if ((argc == 4) && !strcmp(argv[2], "work"))
+		return em_work_connect(argv[3]) ? 1 : em_supervise(argv[1], NULL, 0);
+
+	if ((argc == 4) && !strcmp(argv[2], "schedule"))
+		return em_sched_load(argv[3]) ? 1 : em_supervise(argv[1], NULL, 0);
+
+	if ((argc >= 4) && !strcmp(argv[2], "route")) {
+		for (int i = 4; i < argc; i++)
+			if (!em_find_cmd(argv[i]))
+				argc = 0;
+		if (argc)
+			return em_route(argv[1], argv[3], argv + 4, argc - 4);
+	}
+
+	if ((argc >= 3) && !strcmp(argv[2], "supervise")) {
+		supervise = 1;
+		cmds++;
+		ncmds--;
+	}
+
+	for (int i = 0; i < ncmds; i++) {
+		if (!em_find_cmd(cmds[i])) {
+			argc = 0;
+			break;
+		}
+	}
+
+	if (argc < 2) {
+		log_line(LOG_ERR, "Usage: %s <serial port> [get_params|set_params|set_time|set_aes|set_keyday|read_months|read_info|read_highres|snapshot|restore|flow ...]\n"
+			 "       %s <serial port> probe [count]\n"
+			 "       %s <serial port> export [listen port]\n"
+			 "       %s <device prefix|directory> supervise [command ...]\n"
+			 "       %s <manifest> coordinate [[address:]port]\n"
+			 "       %s <device prefix|directory> work <coordinator host[:port]>\n"
+			 "       %s <device prefix|directory> schedule <schedule file>\n"
+			 "       %s <serial port> route <route file> [command ...]\n"
+			 "       %s <TX serial port> sniff <RX serial port> [capture file]\n"
+			 "       %s <frame archive> import <log file> ...\n"
+			 "       %s <statistics file> stats\n"
+			 "       %s <latency table> latency\n"
+			 "       %s <readings table> readings [secondary address]\n"
+			 "       %s <readings table> analyze [top]\n"
+			 "       %s <snapshot archive> snapshots [secondary address]\n"
+			 "       %s <readings table|snapshot archive> arrow <Arrow file> [monthly readings Arrow file]\n"
+			 "       %s <snapshot archive> coverage <telegram stream|-|unix:socket> [window hours]\n",
+			 argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0],
+			 argv[0], argv[0], argv[0]);
+		return 1;
+	}
+
+	if (supervise)
+		return em_supervise(argv[1], cmds, ncmds);
+
+	return em_session(argv[1], cmds, ncmds);
 }
@@ -0,0 +1,547 @@
+/*
+
+   em-bench.c
+
+   Benchmarks for em-admin: microbenchmarks of the frame handling and
+   decoding code, the serial i/o backends at 1, 16 and 64 ports, and
+   end-to-end sessions against em-sim meters on pseudo terminals. Results
+   are printed one per line as key=value pairs, e.g. to compare versions:
+
+	make bench && mv bench_output.txt bench_old.txt
+	git checkout ... && make bench && diff bench_old.txt bench_output.txt
+
+   Heap allocations are counted, the steady state paths (sessions, metrics
+   scrapes, coverage monitor, flow segmentation) must not allocate after
+   warm-up, otherwise the exit status is 1.
+
+   Further arguments are passed to em-sim, e.g. to impair the link:
+
+	make bench SIM_OPTS="-b 1e-4 -B 1e-3 -w 0.1 -s 42"
+
+   (C) 2025 Hajo Noerenberg
+
+   http://www.noerenberg.de/
+   https://github.com/hn/em-admin
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3.0 as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program. If not, see <http://www.gnu.org/licenses/gpl-3.0.txt>.
+
+*/
+
+#define main em_admin_main
+#include "em-admin.c"
+#undef main
+
+#define BENCH_MIN_TIME		0.5		/* s per microbenchmark */
+#define BENCH_REPS		3		/* end-to-end sessions per scenario, override with $EM_BENCH_REPS */
+#define BENCH_PORTS		16		/* meters of the batch scenario */
+#define BENCH_IO_TIMEOUT	10		/* ms, read timeout for the precision test */
+#define BENCH_IO_TIMEOUTS	20		/* timed out reads per port */
+#define BENCH_STEADY_ITERS	16		/* runs of a steady state path counted after warm-up */
+#define BENCH_STEADY_METERS	1024		/* of the coverage monitor */
+
+FILE *bench_out;
+int bench_fd[2];				/* em-admin side, meter side */
+const unsigned char *bench_reply;		/* answer of the responder thread to every request */
+size_t bench_reply_len;
+struct mbus_stats bench_link;			/* summed up over the sessions of a scenario */
+
+/* Heap allocations, the steady state of daemons and streams must not add any after warm-up */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+unsigned long bench_allocs;
+int bench_steady_failed;
+
+void *malloc(size_t size) {
+	__atomic_fetch_add(&bench_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+	__atomic_fetch_add(&bench_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	__atomic_fetch_add(&bench_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+void *aligned_alloc(size_t align, size_t size) {
+	__atomic_fetch_add(&bench_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_memalign(align, size);
+}
+
+int posix_memalign(void **ptr, size_t align, size_t size) {
+	__atomic_fetch_add(&bench_allocs, 1, __ATOMIC_RELAXED);
+	return (*ptr = __libc_memalign(align, size)) ? 0 : ENOMEM;
+}
+
+/* RSP_UD as sent by a DWZ meter, payload after the data header */
+size_t bench_frame(unsigned char *f, const unsigned char *payload, const size_t len) {
+	const unsigned char hdr[] = { 0x08, 0x00, 0x72, 0xee, 0xff, 0xc0, 0x20, 0xfa, 0x12, 0x02, 0x07, 0x03, 0x00, 0x00, 0x00 };
+	size_t l = sizeof(hdr) + len;
+
+	f[0] = f[3] = MBUS_FRAME_LONG_START;
+	f[1] = f[2] = l;
+	memcpy(f + 4, hdr, sizeof(hdr));
+	memcpy(f + 4 + sizeof(hdr), payload, len);
+	f[4 + l + 1] = MBUS_FRAME_STOP;
+	f[4 + l] = mbus_cslong(f, 6 + l);
+	return 6 + l;
+}
+
+void *bench_responder(void *arg) {
+	unsigned char buf[256];
+	while (read(bench_fd[1], buf, sizeof(buf)) > 0)
+		if (write(bench_fd[1], bench_reply, bench_reply_len) < 0)
+			break;
+	return NULL;
+}
+
+void bench_result(const char *name, const unsigned long iters, const double secs) {
+	fprintf(bench_out, "bench=%s iters=%lu ns_per_op=%.1f ops_per_s=%.0f\n",
+		name, iters, secs * 1e9 / iters, iters / secs);
+	fflush(bench_out);
+}
+
+/* Run fn until BENCH_MIN_TIME has passed, doubling the batch size */
+void bench_run(const char *name, void (*fn)(void)) {
+	unsigned long iters = 0, batch = 1;
+	double t0 = em_now(), t;
+
+	do {
+		for (unsigned long i = 0; i < batch; i++)
+			fn();
+		iters += batch;
+		batch *= 2;
+		t = em_now() - t0;
+	} while (t < BENCH_MIN_TIME);
+	bench_result(name, iters, t);
+}
+
+unsigned char bench_info[MBUS_FRAME_MAX_LEN], bench_months[MBUS_FRAME_MAX_LEN], bench_raw[MBUS_FRAME_MAX_LEN];
+size_t bench_info_len, bench_months_len, bench_raw_len;
+volatile unsigned int bench_sink;
+
+void bench_cslong(void) {
+	bench_sink += mbus_cslong(bench_info, bench_info_len);
+}
+
+void bench_checklong(void) {
+	bench_sink += mbus_checklong(bench_info, bench_info_len);
+}
+
+void bench_parse_record(const struct mbus_record *r, void *ctx) {
+	bench_sink += r->len;
+}
+
+/* The push parser fed one byte at a time, as a slow line delivers them */
+void bench_parse_bytewise(void) {
+	struct mbus_parser ps = { .record = bench_parse_record };
+	for (size_t i = 1; i <= bench_info_len; i++)
+		if (mbus_parse(&ps, bench_info, i))
+			break;
+	bench_sink += ps.nrec;
+}
+
+void bench_dump_settings(void) {
+	em_dump_settings(bench_info + MBUS_FRAME_LONG_HDR_LEN + MBUS_RSPUD12_HDR_LEN);
+}
+
+void bench_serial_read(void) {
+	unsigned char buf[MBUS_FRAME_MAX_LEN];
+	if (write(bench_fd[1], bench_raw, bench_raw_len) == bench_raw_len)
+		bench_sink += serial_read(bench_fd[0], buf, sizeof(buf));
+}
+
+void bench_read_info(void) {
+	bench_sink += em_read_info(bench_fd[0]);
+}
+
+void bench_read_months(void) {
+	bench_sink += em_read_months(bench_fd[0]);
+}
+
+void bench_io_roundtrip(void) {
+	unsigned char frame_in[MBUS_FRAME_MAX_LEN];
+	unsigned char frame_out[] = { MBUS_FRAME_SHORT_START, MBUS_C_REQ_UD2, 254, 0x00, MBUS_FRAME_STOP };
+	bench_sink += mbus_io(bench_fd[0], frame_out, sizeof(frame_out), frame_in, sizeof(frame_in));
+}
+
+void bench_micro(void) {
+	unsigned char p[128];
+	pthread_t responder;
+
+	/* REQ_UD2 response with volume, time, key date and a parameter sized block */
+	const unsigned char info[] = {
+		0x04, 0x13, 0x00, 0x07, 0x00, 0x00, 0x04, 0x6d, 0x1e, 0x0e, 0x21, 0x35, 0x42, 0x6c, 0xe5, 0xf6,
+		0x0f, 0x03, 0x12, 0xb4, 0x00, 0xff, 0x0f, 0xff, 0xff, 0xff, 0x7f, 0x7f, 0xff, 0xff, 0xff, 0x21,
+		0x30, 0xe8, 0x03, 0x0a, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	};
+	bench_info_len = bench_frame(bench_info, info, sizeof(info));
+	for (unsigned int k = 0; k < 15; k++) {
+		uint16_t d = (25 - k / 12) << 9 | (12 - k % 12) << 5 | 28;
+		uint32_t v = 1000 - k * 50;
+		memcpy(p + k * 6, &d, 2);
+		memcpy(p + k * 6 + 2, &v, 4);
+	}
+	bench_months_len = bench_frame(bench_months, p, 15 * 6);
+	memcpy(bench_raw, bench_info, bench_info_len);
+	bench_raw_len = bench_info_len;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, bench_fd)) {
+		fprintf(stderr, "socketpair: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	log_prio = LOG_CRIT;
+	bench_run("mbus_cslong", bench_cslong);
+	bench_run("mbus_checklong", bench_checklong);
+	bench_run("mbus_parse_bytewise", bench_parse_bytewise);
+	bench_run("serial_read", bench_serial_read);
+	log_prio = LOG_DEBUG;
+	bench_run("mbus_checklong_logged", bench_checklong);
+	bench_run("serial_read_hexdump", bench_serial_read);
+	bench_run("em_dump_settings", bench_dump_settings);
+
+	/* request/response over a socket pair, compare with io_roundtrip for the decoding share */
+	pthread_create(&responder, NULL, bench_responder, NULL);
+	log_prio = LOG_CRIT;
+	bench_reply = bench_info;
+	bench_reply_len = bench_info_len;
+	bench_run("io_roundtrip", bench_io_roundtrip);
+	bench_run("em_read_info", bench_read_info);
+	bench_reply = bench_months;
+	bench_reply_len = bench_months_len;
+	bench_run("em_read_months", bench_read_months);
+	log_prio = LOG_DEBUG;
+	shutdown(bench_fd[0], SHUT_RDWR);
+	pthread_join(responder, NULL);
+	close(bench_fd[0]);
+	close(bench_fd[1]);
+}
+
+struct bench_io_port {
+	unsigned long exchanges;
+	unsigned long syscalls;
+	double rate;				/* exchanges/s */
+	double cpu;				/* s, exchange loop only */
+	double overshoot_sum;			/* s beyond the deadline */
+	double overshoot_max;
+	int failed;
+};
+
+double bench_thread_cpu(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* One port: request/response exchanges for BENCH_MIN_TIME, then reads that time out */
+void bench_io_port(const char *backend, struct bench_io_port *r) {
+	unsigned char frame_in[MBUS_FRAME_MAX_LEN];
+	unsigned char frame_out[] = { MBUS_FRAME_SHORT_START, MBUS_C_REQ_UD2, 254, 0x5d, MBUS_FRAME_STOP };
+	pthread_t responder;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, bench_fd) || serial_backend_select(backend)) {
+		r->failed = 1;
+		return;
+	}
+	pthread_create(&responder, NULL, bench_responder, NULL);
+
+	unsigned long sys0 = serial_syscalls;
+	double t0 = em_now(), c0 = bench_thread_cpu();
+	while (em_now() - t0 < BENCH_MIN_TIME) {
+		serial_write(bench_fd[0], frame_out, sizeof(frame_out));
+		if (serial_read(bench_fd[0], frame_in, sizeof(frame_in)) != bench_reply_len)
+			r->failed = 1;
+		r->exchanges++;
+	}
+	r->rate = r->exchanges / (em_now() - t0);
+	r->cpu = bench_thread_cpu() - c0;
+	r->syscalls = serial_syscalls - sys0;
+
+	serial_timeout = BENCH_IO_TIMEOUT;
+	for (int i = 0; i < BENCH_IO_TIMEOUTS; i++) {
+		double t1 = em_now();
+		serial_read(bench_fd[0], frame_in, sizeof(frame_in));
+		double o = em_now() - t1 - BENCH_IO_TIMEOUT / 1e3;
+		r->overshoot_sum += o;
+		if (o > r->overshoot_max)
+			r->overshoot_max = o;
+	}
+
+	serial_close(bench_fd[0]);
+	pthread_join(responder, NULL);
+	close(bench_fd[1]);
+}
+
+/* All ports at once, one process each as in supervise mode */
+void bench_io(const char *backend, const int ports) {
+	struct bench_io_port *r = mmap(NULL, ports * sizeof(*r), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	struct bench_io_port sum = { 0 };
+	pid_t pid[EM_MAX_PORTS];
+
+	if (r == MAP_FAILED)
+		return;
+	memset(r, 0, ports * sizeof(*r));
+	for (int i = 0; i < ports; i++)
+		if (!(pid[i] = fork())) {
+			bench_io_port(backend, &r[i]);
+			_exit(0);
+		}
+	for (int i = 0; i < ports; i++) {
+		if ((pid[i] < 0) || (waitpid(pid[i], NULL, 0) < 0))
+			sum.failed = 1;
+		sum.exchanges += r[i].exchanges;
+		sum.rate += r[i].rate;
+		sum.syscalls += r[i].syscalls;
+		sum.cpu += r[i].cpu;
+		sum.overshoot_sum += r[i].overshoot_sum;
+		sum.failed |= r[i].failed;
+		if (r[i].overshoot_max > sum.overshoot_max)
+			sum.overshoot_max = r[i].overshoot_max;
+	}
+	fprintf(bench_out, "bench=backend_%s ports=%d failed=%d exchanges_per_s=%.0f syscalls_per_exchange=%.2f "
+		"cpu_us_per_exchange=%.2f cpu_pct_per_port=%.2f timeout_overshoot_mean_us=%.0f timeout_overshoot_max_us=%.0f\n",
+		backend, ports, sum.failed, sum.rate,
+		sum.exchanges ? (double) sum.syscalls / sum.exchanges : 0, sum.exchanges ? sum.cpu * 1e6 / sum.exchanges : 0,
+		sum.cpu * 100 / BENCH_MIN_TIME / ports, sum.overshoot_sum * 1e6 / (ports * BENCH_IO_TIMEOUTS), sum.overshoot_max * 1e6);
+	fflush(bench_out);
+	munmap(r, ports * sizeof(*r));
+}
+
+void bench_io_backends(void) {
+	const int ports[] = { 1, 16, 64 };
+
+	log_prio = LOG_CRIT;
+	bench_reply = bench_info;
+	bench_reply_len = bench_info_len;
+	for (unsigned int b = 0; b < sizeof(serial_backends) / sizeof(serial_backends[0]); b++)
+		for (unsigned int i = 0; i < sizeof(ports) / sizeof(ports[0]); i++)
+			bench_io(serial_backends[b].name, ports[i]);
+	log_prio = LOG_DEBUG;
+}
+
+/* Run fn once to warm up, then count the allocations of further runs */
+void bench_steady(const char *name, void (*fn)(void)) {
+	unsigned long warmup = bench_allocs, allocs;
+
+	fn();
+	warmup = bench_allocs - warmup;
+	allocs = bench_allocs;
+	for (unsigned int i = 0; i < BENCH_STEADY_ITERS; i++)
+		fn();
+	allocs = bench_allocs - allocs;
+	fprintf(bench_out, "bench=steady_%s iters=%d warmup_allocs=%lu allocs=%lu\n", name, BENCH_STEADY_ITERS, warmup, allocs);
+	fflush(bench_out);
+	bench_steady_failed |= !!allocs;
+}
+
+struct em_export bench_export;
+struct em_coverage bench_cv;
+struct em_flow bench_flow;
+uint64_t bench_ts;
+double bench_flow_t;
+uint32_t bench_flow_ml;
+
+/* Scrape of the exporter */
+void bench_steady_metrics(void) {
+	char body[8192];
+	bench_sink += em_export_metrics(&bench_export, body, sizeof(body));
+}
+
+/* Telegram stream of the coverage monitor, summaries at bucket changes, a full report at the end */
+void bench_steady_coverage(void) {
+	uint8_t f[16] = { 0x0e, 0x44, 0xc5, 0x14 };
+
+	for (unsigned int i = 0; i < 4096; i++) {
+		const struct em_frame_rec rec = { .ts_us = bench_ts += 100000, .dir = EM_FRAME_RADIO, .len = sizeof(f) };
+		memcpy(f + 4, &bench_cv.sn->rec[i % BENCH_STEADY_METERS].secadr, 4);
+		memcpy(f + 10, &bench_ts, sizeof(bench_ts) - 2);
+		if (bench_cv.now_us && (rec.ts_us / bench_cv.bucket_us > bench_cv.now_us / bench_cv.bucket_us))
+			em_coverage_report(&bench_cv, 0);
+		em_coverage_add(&bench_cv, &rec, f);
+	}
+	em_coverage_report(&bench_cv, EM_COVERAGE_TOP);
+}
+
+/* Draws and a leak in the flow segmentation */
+void bench_steady_flow(void) {
+	for (unsigned int i = 0; i < 600; i++) {
+		bench_flow_t += 1;
+		bench_flow_ml += 1 + (((unsigned int) bench_flow_t % 90) < 10) * 120;
+		em_flow_sample(&bench_flow, bench_flow_t, bench_flow_ml);
+	}
+}
+
+void bench_steady_paths(void) {
+	struct em_snapshot *sn = calloc(1, sizeof(*sn) + BENCH_STEADY_METERS * sizeof(sn->rec[0]));
+
+	bench_export.meter.valid = bench_export.meter.highres_valid = bench_export.meter.months_valid = 1;
+	bench_export.meter.secadr = 0x20c0ffee;
+	bench_export.highres_time = bench_export.months_time = time(NULL);
+	bench_steady("metrics", bench_steady_metrics);
+
+	sn->magic = EM_SNAPSHOT_MAGIC;
+	sn->count = BENCH_STEADY_METERS;
+	for (unsigned int i = 0; i < BENCH_STEADY_METERS; i++) {
+		sn->rec[i].secadr = 0x20000000 + i;
+		memcpy(sn->rec[i].params, em_default_params, EM_PARAMS_LEN);
+	}
+	bench_cv = (struct em_coverage) { .sn = sn, .bucket_us = 3600000000ULL / EM_COVERAGE_BUCKETS };
+	bench_ts = (uint64_t) time(NULL) * 1000000;
+	if (!em_coverage_init(&bench_cv))
+		bench_steady("coverage", bench_steady_coverage);
+	em_coverage_free(&bench_cv);
+	free(sn);
+
+	bench_steady("flow", bench_steady_flow);
+}
+
+void bench_e2e_result(const char *name, const int sessions, const double *t, const int failed) {
+	double sum = 0, min = t[0], max = t[0];
+	for (int i = 0; i < sessions; i++) {
+		sum += t[i];
+		if (t[i] < min) min = t[i];
+		if (t[i] > max) max = t[i];
+	}
+	fprintf(bench_out, "bench=%s sessions=%d failed=%d mean_s=%.3f min_s=%.3f max_s=%.3f "
+		"requests=%lu retries=%lu timeouts=%lu bytes_out=%lu bytes_in=%lu\n",
+		name, sessions, failed, sum / sessions, min, max, bench_link.requests, bench_link.retries,
+		bench_link.timeouts, bench_link.bytes_out, bench_link.bytes_in);
+	fflush(bench_out);
+}
+
+void bench_session(const char *name, const char *port, char *cmds[], const int ncmds, const int reps) {
+	double t[64];
+	int failed = 0;
+
+	memset(&bench_link, 0, sizeof(bench_link));
+	for (int i = 0; i < reps; i++) {
+		double t0 = em_now();
+		failed += !!em_session(port, cmds, ncmds);
+		t[i] = em_now() - t0;
+		bench_link.requests += mbus_stats.requests;
+		bench_link.retries += mbus_stats.retries;
+		bench_link.timeouts += mbus_stats.timeouts;
+		bench_link.bytes_out += mbus_stats.bytes_out;
+		bench_link.bytes_in += mbus_stats.bytes_in;
+	}
+	bench_e2e_result(name, reps, t, failed);
+}
+
+/* All meters at once, one process per opto head as in supervise mode */
+void bench_batch(const char *name, char ports[][PATH_MAX], const int n, char *cmds[], const int ncmds) {
+	double t0 = em_now(), t;
+	int failed = 0, status;
+	pid_t pid[BENCH_PORTS];
+
+	for (int i = 0; i < n; i++)
+		if (!(pid[i] = fork()))
+			_exit(em_session(ports[i], cmds, ncmds));
+	for (int i = 0; i < n; i++)
+		if ((pid[i] < 0) || (waitpid(pid[i], &status, 0) < 0) || !WIFEXITED(status) || WEXITSTATUS(status))
+			failed++;
+	t = em_now() - t0;
+	fprintf(bench_out, "bench=%s ports=%d failed=%d wall_s=%.3f meters_per_s=%.2f\n", name, n, failed, t, n / t);
+	fflush(bench_out);
+}
+
+const char *bench_steady_port;
+
+/* Sessions one after the other in the same process, as in route mode */
+void bench_steady_session(void) {
+	char *cmds[] = { "read_info", "get_params", "read_highres", "read_months" };
+	bench_sink += em_session(bench_steady_port, cmds, 4);
+}
+
+int bench_e2e(char *sim[]) {
+	char dir[] = "/tmp/em-bench.XXXXXX";
+	char ports[BENCH_PORTS][PATH_MAX];
+	char path[PATH_MAX + 32];
+	char *single[] = { "read_highres" };
+	char *multi[] = { "read_info", "get_params", "read_highres", "read_months" };
+	int reps = getenv("EM_BENCH_REPS") ? atoi(getenv("EM_BENCH_REPS")) : BENCH_REPS;
+	int pfd[2];
+	pid_t pid;
+
+	if ((reps < 1) || (reps > 64))
+		reps = BENCH_REPS;
+	if (!mkdtemp(dir) || pipe(pfd)) {
+		fprintf(stderr, "Failed to set up: %s\n", strerror(errno));
+		return 1;
+	}
+	if (!(pid = fork())) {
+		char n[16];
+		char *args[64] = { sim[0], "-n", n, "-d", dir };
+		snprintf(n, sizeof(n), "%d", BENCH_PORTS);
+		for (int i = 1; sim[i] && (i < 58); i++)
+			args[4 + i] = sim[i];
+		dup2(pfd[1], STDOUT_FILENO);
+		close(pfd[0]);
+		execv(sim[0], args);
+		_exit(127);
+	}
+	close(pfd[1]);
+
+	FILE *f = fdopen(pfd[0], "r");
+	for (int i = 0; i < BENCH_PORTS; i++) {
+		if (!fgets(ports[i], sizeof(ports[i]), f)) {
+			fprintf(stderr, "Failed to start '%s'\n", sim[0]);
+			return 1;
+		}
+		ports[i][strcspn(ports[i], "\n")] = 0;
+	}
+
+	/* keep the stores of the benchmark apart from real ones */
+	snprintf(path, sizeof(path), "%s/stats", dir);
+	setenv("EM_STATS_FILE", path, 1);
+	snprintf(path, sizeof(path), "%s/readings", dir);
+	setenv("EM_READINGS_FILE", path, 1);
+
+	bench_session("session_single", ports[0], single, 1, reps);
+	bench_session("session_multi", ports[1], multi, 4, reps);
+	bench_batch("session_batch", ports, BENCH_PORTS, single, 1);
+	bench_steady_port = ports[2];
+	bench_steady("session", bench_steady_session);
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	fclose(f);
+	unlink(getenv("EM_STATS_FILE"));
+	unlink(getenv("EM_READINGS_FILE"));
+	rmdir(dir);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	int out = dup(STDOUT_FILENO);
+	int null = open("/dev/null", O_WRONLY);
+
+	/* em-admin logs to stdout, results go to the original one */
+	bench_out = fdopen(out, "w");
+	dup2(null, STDOUT_FILENO);
+	close(null);
+
+	/* fixed timeouts, results must not depend on earlier runs */
+	setenv("EM_LATENCY_FILE", "", 1);
+	bench_micro();
+	bench_io_backends();
+	bench_steady_paths();
+	char *sim[] = { "./em-sim", NULL };
+	return bench_e2e((argc > 1) ? argv + 1 : sim) || bench_steady_failed;
+}
@@ -0,0 +1,62 @@
+/*
+
+   em-frames.h
+
+   Frame stream format shared by the em-admin tools: a file header followed
+   by records, each a fixed header and the raw frame bytes (or a reading).
+   All integers are little endian, records are not aligned.
+
+	struct em_frames_hdr hdr;
+	fread(&hdr, sizeof(hdr), 1, f);
+	while (fread(&rec, sizeof(rec), 1, f) == 1 && fread(buf, rec.len, 1, f) == 1) ...
+
+   (C) 2025 Hajo Noerenberg
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3.0 as
+   published by the Free Software Foundation.
+
+*/
+
+#ifndef EM_FRAMES_H
+#define EM_FRAMES_H
+
+#include <stdint.h>
+
+#define EM_FRAMES_MAGIC		0x31464d45	/* "EMF1" */
+
+#define EM_FRAME_TO_METER	0		/* dir: sent by the head */
+#define EM_FRAME_FROM_METER	1		/* dir: received from the meter */
+#define EM_FRAME_RADIO		2		/* dir: wireless M-Bus telegram, link layer CRCs removed */
+#define EM_FRAME_SESSION	3		/* dir: wakeup, start of a session; data is the port (log tag) if known */
+#define EM_FRAME_READING	4		/* dir: data is a struct em_frame_reading */
+
+#define EM_FRAME_CORRUPT	(1 << 0)	/* deliberately corrupted (generator) */
+#define EM_FRAME_DUPLICATE	(1 << 1)	/* repetition of the previous telegram of the meter */
+#define EM_FRAME_TRUNCATED	(1 << 2)	/* shorter than its length field says, e.g. cut off in a log */
+#define EM_FRAME_PARITY		(1 << 3)	/* contains bytes with parity errors */
+
+struct em_frames_hdr {
+	uint32_t magic;
+	uint32_t reserved;
+} __attribute__ ((packed));
+
+struct em_frame_rec {
+	uint64_t ts_us;				/* microseconds since epoch */
+	uint8_t dir;
+	uint8_t flags;
+	uint16_t len;				/* frame bytes following */
+} __attribute__ ((packed));
+
+#define EM_FRAME_READING_MONTH	0		/* l at the end of date */
+#define EM_FRAME_READING_HIGHRES 1		/* ml */
+
+struct em_frame_reading {
+	uint32_t secadr;			/* 0 if unknown */
+	uint32_t value;
+	uint16_t date;				/* (year - 2000) << 9 | month << 5 | day, 0 for highres */
+	uint8_t kind;
+	uint8_t reserved;
+} __attribute__ ((packed));
+
+#endif
@@ -0,0 +1,102 @@
+/*
+
+   em-readings.h
+
+   Shared-memory table of the latest readings per meter, as published
+   by em-admin after every session. Local consumers map the table read-only
+   and get a consistent snapshot of a meter without syscalls or locks:
+
+	int fd = open(EM_READINGS_FILE, O_RDONLY);
+	const struct em_readings *t = mmap(NULL, sizeof(*t), PROT_READ, MAP_SHARED, fd, 0);
+	struct em_reading r;
+	if (em_readings_get(t, 0x20c0ffee, &r)) printf("%u ml\n", r.highres);
+
+   Each slot is protected by a sequence lock: the writer makes the sequence
+   odd while updating, readers retry if it was odd or changed meanwhile.
+
+   (C) 2025 Hajo Noerenberg
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3.0 as
+   published by the Free Software Foundation.
+
+*/
+
+#ifndef EM_READINGS_H
+#define EM_READINGS_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define EM_READINGS_FILE	"/dev/shm/em-admin.readings"	/* usual location, em-admin only publishes to $EM_READINGS_FILE */
+#define EM_READINGS_MAGIC	0x31524d45	/* "EMR1" */
+#define EM_READINGS_SLOTS	(1 << 18)	/* power of two */
+
+#define EM_READING_HIGHRES	(1 << 0)	/* highres is valid */
+#define EM_READING_MONTHS	(1 << 1)	/* month_* are valid */
+
+struct em_reading {
+	uint32_t seq;			/* odd while being written */
+	uint32_t used;			/* 2 in use, 0 free, 1 being claimed, 3 abandoned */
+	uint32_t secadr;
+	uint16_t manufacturer;
+	uint8_t version;
+	uint8_t medium;
+	uint8_t accesscount;
+	uint8_t state;
+	uint8_t flags;
+	uint8_t reserved;
+	int64_t time;			/* last session, seconds since epoch */
+	int64_t highres_time;
+	int64_t months_time;
+	uint32_t highres;		/* ml */
+	uint16_t month_date[30];	/* end of months, then middle of months, (year - 2000) << 9 | month << 5 | day */
+	uint32_t month_value[30];	/* l */
+} __attribute__ ((aligned(64)));
+
+struct em_readings {
+	uint32_t magic;
+	uint32_t size;
+	uint32_t slots;
+	uint32_t reserved;
+	struct em_reading slot[EM_READINGS_SLOTS] __attribute__ ((aligned(64)));
+};
+
+static inline uint32_t em_readings_hash(const uint32_t secadr) {
+	return secadr * 2654435761u;
+}
+
+/* Slot of a meter, NULL if it never published a reading */
+static inline const struct em_reading *em_readings_find(const struct em_readings *t, const uint32_t secadr) {
+	uint32_t h = em_readings_hash(secadr);
+	for (uint32_t i = 0; i < EM_READINGS_SLOTS; i++, h++) {
+		const struct em_reading *r = &t->slot[h & (EM_READINGS_SLOTS - 1)];
+		uint32_t used = __atomic_load_n(&r->used, __ATOMIC_ACQUIRE);
+		if (!used)
+			return NULL;
+		if ((used == 2) && (r->secadr == secadr))
+			return r;
+	}
+	return NULL;
+}
+
+/* Consistent copy of a slot, fails only if a writer died while updating it */
+static inline int em_readings_copy(const struct em_reading *r, struct em_reading *out) {
+	uint32_t s1, s2;
+	unsigned long spins = 0;
+	do {
+		while ((s1 = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE)) & 1)
+			if (++spins > (1UL << 24)) return 0;
+		memcpy(out, (const void *) r, sizeof(*out));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		s2 = __atomic_load_n(&r->seq, __ATOMIC_RELAXED);
+	} while (s1 != s2);
+	return 1;
+}
+
+static inline int em_readings_get(const struct em_readings *t, const uint32_t secadr, struct em_reading *out) {
+	const struct em_reading *r = em_readings_find(t, secadr);
+	return r && em_readings_copy(r, out);
+}
+
+#endif
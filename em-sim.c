@@ -0,0 +1,586 @@
+/*
+
+   em-sim.c
+
+   Stand-in for one or more infrared M-Bus water meters on pseudo terminals,
+   for testing and benchmarking em-admin without hardware. Each meter answers
+   like a DWZ WaterStar M after a wakeup sequence: REQ_UD2, device parameters,
+   high resolution and monthly readings, set parameters, time and key date.
+
+	./em-sim -n 16 -d /tmp/meters &
+	./em-admin /tmp/meters/meter0 read_highres
+
+   The link can be impaired to test retries and timeouts under realistic
+   conditions: bit errors (a pty has no parity, so parity errors on the IR
+   link show up as checksum errors), loss bursts, extra latency, responses
+   stalling mid-frame, echo of the transmitted bytes and failing wakeups.
+   All random decisions are drawn per meter from a seeded generator, so a
+   run with the same options and the same requests is reproducible.
+
+   Water can flow through the meters, in draws at random intervals and as a
+   constant leak, to test the segmentation of high resolution readings.
+
+   (C) 2025 Hajo Noerenberg
+
+   http://www.noerenberg.de/
+   https://github.com/hn/em-admin
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3.0 as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program. If not, see <http://www.gnu.org/licenses/gpl-3.0.txt>.
+
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <math.h>
+#include <limits.h>
+#include <signal.h>
+#include <termios.h>
+
+#define MBUS_FRAME_ACK		0xE5
+#define MBUS_FRAME_SHORT_START	0x10
+#define MBUS_FRAME_LONG_START	0x68
+#define MBUS_FRAME_STOP		0x16
+#define MBUS_C_SND_UD		0x53
+#define MBUS_C_RSP_UD		0x08
+#define MBUS_CI_DATA_SEND	0x51
+#define MBUS_CI_RSPUD12		0x72
+#define MBUS_WAKEUP_CHAR	0x55
+
+#define SIM_MAX_METERS		256
+#define SIM_WAKEUP_BYTES	100		/* wakeup characters needed before the meter listens */
+#define SIM_AWAKE_TIME		10		/* seconds the meter stays awake after the last frame */
+#define SIM_SECADR		0x20c0ffee	/* secondary address of the first meter */
+
+struct sim_meter {
+	int master;
+	int slave;				/* kept open, the master fails with EIO otherwise */
+	char path[PATH_MAX];
+	uint32_t secadr;
+	uint8_t accesscount;
+	uint8_t params[20];
+	uint8_t clock[4];			/* CP32 as last set */
+	uint8_t keyday[2];
+	uint32_t highres;			/* ml */
+	unsigned int wakeup;			/* wakeup characters seen */
+	double awake_until;
+	unsigned char rx[512];
+	size_t rxlen;
+	unsigned char tx[512];
+	size_t txlen;
+	size_t txoff;				/* sent so far */
+	size_t txstall;				/* stall the response after this many bytes */
+	double tx_due;
+	uint64_t rng;
+	int burst;				/* in a loss burst */
+	int wakeup_ok;				/* this wakeup sequence will wake the meter */
+	double flow_t;				/* volume advanced up to here */
+	double flow_ml;
+	double draw_start;
+	double draw_end;
+	double draw_rate;			/* ml/s */
+	uint64_t flow_rng;
+};
+
+/* Impairments, applied to both directions */
+struct sim_channel {
+	double ber;				/* bit error rate */
+	double burst_start;			/* per byte probability to enter a loss burst */
+	double burst_len;			/* mean burst length in bytes */
+	double jitter;				/* s, mean of the exponentially distributed extra latency */
+	double stall;				/* probability of a response stalling mid-frame */
+	double stall_time;			/* s */
+	double wakeup_fail;			/* probability of a wakeup sequence being ignored */
+	int echo;				/* transmitted bytes are echoed back */
+	uint64_t seed;
+};
+
+struct sim_stats {
+	unsigned long frames;
+	unsigned long responses;
+	unsigned long checksum_errors;
+	unsigned long asleep;			/* frames ignored because the meter was not woken up */
+	unsigned long bit_errors;
+	unsigned long lost;			/* bytes */
+	unsigned long stalls;
+	unsigned long wakeup_failures;
+	unsigned long draws;			/* completed */
+	double drawn_ml;
+	double leaked_ml;
+};
+
+const uint8_t sim_params[20] = {
+	0x07, 0x03, 0x12, 0xb4, 0x00, 0xff, 0x0f, 0xff, 0xff, 0xff,
+	0x7f, 0x7f, 0xff, 0xff, 0xff, 0x21, 0x30, 0xe8, 0x03, 0x0a
+};
+
+struct sim_meter sim_meters[SIM_MAX_METERS];
+struct sim_stats sim_stats;
+double sim_latency = 0.05;			/* s between request and response */
+struct sim_channel sim_channel = { .stall_time = 0.5, .burst_len = 8, .seed = 1 };
+double sim_draw_interval = 0;			/* s, mean time between draws, 0 for none */
+double sim_leak = 0;				/* ml/s */
+volatile sig_atomic_t sim_stop = 0;
+
+void sim_sigterm(int sig) {
+	sim_stop = 1;
+}
+
+double sim_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* xorshift64*, uniform in [0, 1) */
+double sim_random(struct sim_meter *m) {
+	m->rng ^= m->rng >> 12;
+	m->rng ^= m->rng << 25;
+	m->rng ^= m->rng >> 27;
+	return ((m->rng * 0x2545f4914f6cdd1dULL) >> 11) * 0x1.0p-53;
+}
+
+/* Advance the volume: draws of 2 - 30 s at 50 - 250 ml/s at exponentially distributed intervals, plus the leak */
+void sim_flow(struct sim_meter *m, const double now) {
+	double t = m->flow_t ? m->flow_t : now;
+	uint64_t rng = m->rng;
+
+	m->rng = m->flow_rng;
+	while (sim_draw_interval && (t < now)) {
+		if (t >= m->draw_end) {
+			if (m->draw_end) {
+				sim_stats.draws++;
+				sim_stats.drawn_ml += (m->draw_end - m->draw_start) * m->draw_rate;
+			}
+			m->draw_start = t - log(1 - sim_random(m)) * sim_draw_interval;
+			m->draw_end = m->draw_start + 2 + 28 * sim_random(m);
+			m->draw_rate = 50 + 200 * sim_random(m);
+		}
+		const double end = (t < m->draw_start) ? m->draw_start : m->draw_end;
+		if (t >= m->draw_start)
+			m->flow_ml += (((end < now) ? end : now) - t) * m->draw_rate;
+		t = (end < now) ? end : now;
+	}
+	m->flow_rng = m->rng;
+	m->rng = rng;
+	if (m->flow_t) {
+		m->flow_ml += (now - m->flow_t) * sim_leak;
+		sim_stats.leaked_ml += (now - m->flow_t) * sim_leak;
+	}
+	m->flow_t = now;
+	m->highres += (uint32_t) m->flow_ml;
+	m->flow_ml -= (uint32_t) m->flow_ml;
+}
+
+/* Flip bits and drop bytes in place, returns the remaining length */
+size_t sim_impair(struct sim_meter *m, unsigned char *buf, const size_t n) {
+	const struct sim_channel *c = &sim_channel;
+	size_t len = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		if (c->burst_start > 0) {
+			if (m->burst ? (sim_random(m) < 1 / c->burst_len) : (sim_random(m) < c->burst_start))
+				m->burst = !m->burst;
+			if (m->burst) {
+				sim_stats.lost++;
+				continue;
+			}
+		}
+		if (c->ber > 0) {
+			for (unsigned int b = 0; b < 8; b++) {
+				if (sim_random(m) < c->ber) {
+					buf[i] ^= 1 << b;
+					sim_stats.bit_errors++;
+				}
+			}
+		}
+		buf[len++] = buf[i];
+	}
+	return len;
+}
+
+/* Schedule the response, possibly stalling in the middle of it */
+void sim_schedule(struct sim_meter *m, const double now) {
+	const struct sim_channel *c = &sim_channel;
+
+	m->tx_due = now + sim_latency;
+	if (c->jitter > 0)
+		m->tx_due += -log(1 - sim_random(m)) * c->jitter;
+	m->txoff = 0;
+	m->txstall = m->txlen;
+	if ((m->txlen > 1) && (sim_random(m) < c->stall))
+		m->txstall = 1 + sim_random(m) * (m->txlen - 1);
+}
+
+void sim_transmit(struct sim_meter *m, const double now) {
+	unsigned char buf[sizeof(m->tx)];
+	size_t len = m->txstall - m->txoff;
+
+	memcpy(buf, m->tx + m->txoff, len);
+	len = sim_impair(m, buf, len);
+	if (len && (write(m->master, buf, len) != len))
+		m->txstall = m->txlen;
+	m->txoff = m->txstall;
+	if (m->txoff < m->txlen) {
+		sim_stats.stalls++;
+		m->txstall = m->txlen;
+		m->tx_due = now + sim_channel.stall_time;
+		return;
+	}
+	sim_stats.responses++;
+	m->txlen = 0;
+}
+
+/* RSP_UD with the fixed data header followed by payload */
+void sim_respond(struct sim_meter *m, const unsigned char *payload, const size_t len) {
+	unsigned char *f = m->tx;
+	size_t l = 3 + 12 + len;
+	uint8_t cs = 0;
+
+	f[0] = MBUS_FRAME_LONG_START;
+	f[1] = f[2] = l;
+	f[3] = MBUS_FRAME_LONG_START;
+	f[4] = MBUS_C_RSP_UD;
+	f[5] = 0;				/* Address */
+	f[6] = MBUS_CI_RSPUD12;
+	f[7] = m->secadr;
+	f[8] = m->secadr >> 8;
+	f[9] = m->secadr >> 16;
+	f[10] = m->secadr >> 24;
+	f[11] = 0xfa;				/* DWZ */
+	f[12] = 0x12;
+	f[13] = 0x02;				/* Version */
+	f[14] = 0x07;				/* Water */
+	f[15] = ++m->accesscount;
+	f[16] = 0x00;				/* State */
+	f[17] = f[18] = 0x00;			/* Signature */
+	memcpy(f + 19, payload, len);
+	for (size_t i = 4; i < 4 + l; i++)
+		cs += f[i];
+	f[4 + l] = cs;
+	f[5 + l] = MBUS_FRAME_STOP;
+	m->txlen = 6 + l;
+}
+
+void sim_ack(struct sim_meter *m) {
+	m->tx[0] = MBUS_FRAME_ACK;
+	m->txlen = 1;
+}
+
+void sim_months(struct sim_meter *m, const int middle) {
+	unsigned char p[15 * 6];
+	time_t now = time(NULL);
+	struct tm tm;
+
+	localtime_r(&now, &tm);
+	for (int k = 0; k < 15; k++) {
+		int y = tm.tm_year - 100, mo = tm.tm_mon - k;	/* the current month is not finished yet */
+		while (mo < 1) {
+			mo += 12;
+			y--;
+		}
+		uint16_t d = y << 9 | mo << 5 | (middle ? 15 : 28);
+		uint32_t v = m->highres / 1000 - (k * 2 + !middle) * 25;
+		p[k * 6] = d;
+		p[k * 6 + 1] = d >> 8;
+		memcpy(p + k * 6 + 2, &v, 4);
+	}
+	sim_respond(m, p, sizeof(p));
+}
+
+void sim_frame(struct sim_meter *m, const unsigned char *f, const size_t len) {
+	if (f[0] == MBUS_FRAME_SHORT_START) {
+		if ((f[1] & 0x4f) != 0x4b) {		/* SND_NKE and others */
+			sim_ack(m);
+			return;
+		}
+		unsigned char p[] = {
+			0x04, 0x13, m->highres / 1000, m->highres / 1000 >> 8, m->highres / 1000 >> 16, m->highres / 1000 >> 24,
+			0x04, 0x6d, m->clock[0], m->clock[1], m->clock[2], m->clock[3],
+			0x42, 0x6c, m->keyday[0] | 0xe0, m->keyday[1] | 0xf0,
+			0x0f,				/* manufacturer specific data follows */
+			0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
+			0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
+			0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
+		};
+		sim_respond(m, p, sizeof(p));
+		return;
+	}
+
+	const unsigned char *d = f + 7;
+	size_t dl = len - 9;
+	if ((f[4] != MBUS_C_SND_UD) || (f[6] != MBUS_CI_DATA_SEND) || (dl < 2)) {
+		sim_ack(m);
+		return;
+	}
+	if (d[0] == 0x0f) {
+		unsigned char p[24] = { 0 };
+		switch (d[1]) {
+		case 0x01:
+			sim_flow(m, sim_now());
+			memcpy(p, &m->highres, 4);
+			sim_respond(m, p, 4);
+			return;
+		case 0x02:
+		case 0x03:
+			sim_months(m, d[1] == 0x03);
+			return;
+		case 0x04:
+			memcpy(p, m->params, sizeof(m->params));
+			sim_respond(m, p, sizeof(p));
+			return;
+		case 0x81:
+			if (dl >= 9 + sizeof(m->params))
+				memcpy(m->params, d + 9, sizeof(m->params));
+			break;
+		}
+		sim_ack(m);
+		return;
+	}
+
+	/* plain data records, several of them in one frame */
+	for (size_t i = 0; i + 5 <= dl; ) {
+		if ((d[i] == 0x04) && (d[i + 1] == 0xed) && (i + 7 <= dl)) {
+			memcpy(m->clock, d + i + 3, 4);
+			i += 7;
+		} else if ((d[i] == 0x02) && (d[i + 1] == 0xec)) {
+			m->keyday[0] = d[i + 3] & 0x1f;
+			m->keyday[1] = d[i + 4] & 0x0f;
+			i += 5;
+		} else {
+			break;
+		}
+	}
+	sim_ack(m);
+}
+
+/* Length of a complete frame at the start of the buffer, 0 if incomplete, -1 if garbage */
+ssize_t sim_framelen(const unsigned char *b, const size_t len) {
+	if (b[0] == MBUS_FRAME_SHORT_START)
+		return (len >= 5) ? 5 : 0;
+	if (b[0] == MBUS_FRAME_LONG_START) {
+		if ((len >= 3) && (b[1] != b[2]))
+			return -1;
+		return ((len >= 2) && (len >= b[1] + 6)) ? b[1] + 6 : 0;
+	}
+	return -1;
+}
+
+int sim_checksum(const unsigned char *f, const size_t len) {
+	uint8_t cs = 0;
+	if (f[len - 1] != MBUS_FRAME_STOP)
+		return 0;
+	if (f[0] == MBUS_FRAME_SHORT_START)
+		return (uint8_t) (f[1] + f[2]) == f[3];
+	for (size_t i = 4; i < len - 2; i++)
+		cs += f[i];
+	return (f[3] == MBUS_FRAME_LONG_START) && (cs == f[len - 2]);
+}
+
+void sim_receive(struct sim_meter *m, unsigned char *buf, size_t n) {
+	const double now = sim_now();
+
+	if (sim_channel.echo && (write(m->master, buf, n) != n))
+		return;
+	n = sim_impair(m, buf, n);
+
+	for (size_t i = 0; i < n; i++) {
+		if (!m->rxlen && (buf[i] == MBUS_WAKEUP_CHAR)) {
+			if (!m->wakeup) {
+				m->wakeup_ok = (now <= m->awake_until) || (sim_random(m) >= sim_channel.wakeup_fail);
+				if (!m->wakeup_ok)
+					sim_stats.wakeup_failures++;
+			}
+			if ((++m->wakeup >= SIM_WAKEUP_BYTES) && m->wakeup_ok)
+				m->awake_until = now + SIM_AWAKE_TIME;
+			continue;
+		}
+		m->wakeup = 0;
+		if (m->rxlen < sizeof(m->rx))
+			m->rx[m->rxlen++] = buf[i];
+	}
+
+	while (m->rxlen) {
+		ssize_t fl = sim_framelen(m->rx, m->rxlen);
+		if (!fl)
+			break;
+		if (fl > 0) {
+			sim_stats.frames++;
+			if (!sim_checksum(m->rx, fl)) {
+				sim_stats.checksum_errors++;
+			} else if (now > m->awake_until) {
+				sim_stats.asleep++;
+			} else {
+				m->awake_until = now + SIM_AWAKE_TIME;
+				sim_frame(m, m->rx, fl);
+				sim_schedule(m, now);
+			}
+		} else {
+			fl = 1;
+		}
+		memmove(m->rx, m->rx + fl, m->rxlen - fl);
+		m->rxlen -= fl;
+	}
+}
+
+int sim_open(struct sim_meter *m, const char *dir, const unsigned int i) {
+	struct termios tty;
+
+	if (((m->master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK)) < 0) || grantpt(m->master) ||
+	    unlockpt(m->master) || ((m->slave = open(ptsname(m->master), O_RDWR | O_NOCTTY)) < 0)) {
+		fprintf(stderr, "Failed to create pseudo terminal: %s\n", strerror(errno));
+		return -1;
+	}
+	tcgetattr(m->slave, &tty);
+	cfmakeraw(&tty);
+	tcsetattr(m->slave, TCSANOW, &tty);
+
+	if (dir) {
+		snprintf(m->path, sizeof(m->path), "%s/meter%u", dir, i);
+		unlink(m->path);
+		if (symlink(ptsname(m->master), m->path)) {
+			fprintf(stderr, "Failed to create '%s': %s\n", m->path, strerror(errno));
+			return -1;
+		}
+	} else {
+		snprintf(m->path, sizeof(m->path), "%s", ptsname(m->master));
+	}
+
+	m->secadr = SIM_SECADR + i;
+	memcpy(m->params, sim_params, sizeof(m->params));
+	m->keyday[0] = 5;
+	m->keyday[1] = 6;
+	m->highres = 1791104 + i * 1000;
+	m->rng = (sim_channel.seed + i) * 0x9e3779b97f4a7c15ULL ?: 1;
+	m->flow_rng = m->rng ^ 0x5851f42d4c957f2dULL;
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	struct pollfd pfd[SIM_MAX_METERS];
+	const char *dir = NULL;
+	unsigned int n = 1;
+	double end = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:d:t:l:b:B:L:j:S:T:w:ef:k:s:")) != -1) {
+		switch (opt) {
+		case 'n':
+			n = atoi(optarg);
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		case 't':
+			end = sim_now() + atof(optarg);
+			break;
+		case 'l':
+			sim_latency = atof(optarg) / 1000;
+			break;
+		case 'b':
+			sim_channel.ber = atof(optarg);
+			break;
+		case 'B':
+			sim_channel.burst_start = atof(optarg);
+			break;
+		case 'L':
+			sim_channel.burst_len = (atof(optarg) >= 1) ? atof(optarg) : 1;
+			break;
+		case 'j':
+			sim_channel.jitter = atof(optarg) / 1000;
+			break;
+		case 'S':
+			sim_channel.stall = atof(optarg);
+			break;
+		case 'T':
+			sim_channel.stall_time = atof(optarg) / 1000;
+			break;
+		case 'w':
+			sim_channel.wakeup_fail = atof(optarg);
+			break;
+		case 'e':
+			sim_channel.echo = 1;
+			break;
+		case 'f':
+			sim_draw_interval = atof(optarg);
+			break;
+		case 'k':
+			sim_leak = atof(optarg) / 60;
+			break;
+		case 's':
+			sim_channel.seed = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			n = 0;
+		}
+	}
+	if (!n || (n > SIM_MAX_METERS)) {
+		fprintf(stderr, "Usage: %s [-n meters] [-d symlink directory] [-t seconds] [-l latency ms]\n"
+			"       [-b bit error rate] [-B burst probability] [-L mean burst bytes] [-j mean jitter ms]\n"
+			"       [-S stall probability] [-T stall ms] [-w wakeup failure probability] [-e]\n"
+			"       [-f mean seconds between draws] [-k leak ml/min] [-s seed]\n", argv[0]);
+		return 1;
+	}
+
+	signal(SIGINT, sim_sigterm);
+	signal(SIGTERM, sim_sigterm);
+	for (unsigned int i = 0; i < n; i++) {
+		if (sim_open(&sim_meters[i], dir, i))
+			return 1;
+		pfd[i].fd = sim_meters[i].master;
+		pfd[i].events = POLLIN;
+		printf("%s\n", sim_meters[i].path);
+	}
+	fflush(stdout);
+
+	while (!sim_stop && (!end || (sim_now() < end))) {
+		double now = sim_now(), due = now + 1;
+		for (unsigned int i = 0; i < n; i++)
+			if (sim_meters[i].txlen && (sim_meters[i].tx_due < due))
+				due = sim_meters[i].tx_due;
+
+		poll(pfd, n, (due > now) ? (int) ((due - now) * 1000) + 1 : 0);
+
+		now = sim_now();
+		for (unsigned int i = 0; i < n; i++) {
+			struct sim_meter *m = &sim_meters[i];
+			unsigned char buf[512];
+			ssize_t r;
+
+			if (m->txlen && (m->tx_due <= now))
+				sim_transmit(m, now);
+			if ((pfd[i].revents & POLLIN) && ((r = read(m->master, buf, sizeof(buf))) > 0))
+				sim_receive(m, buf, r);
+		}
+	}
+
+	for (unsigned int i = 0; i < n; i++)
+		if (dir)
+			unlink(sim_meters[i].path);
+	fprintf(stderr, "%lu frames, %lu responses, %lu checksum errors, %lu while asleep\n",
+		sim_stats.frames, sim_stats.responses, sim_stats.checksum_errors, sim_stats.asleep);
+	fprintf(stderr, "%lu bit errors, %lu bytes lost, %lu stalls, %lu wakeup failures\n",
+		sim_stats.bit_errors, sim_stats.lost, sim_stats.stalls, sim_stats.wakeup_failures);
+	if (sim_draw_interval || sim_leak)
+		fprintf(stderr, "%lu draws completed, %.0f ml drawn, %.0f ml leaked\n",
+			sim_stats.draws, sim_stats.drawn_ml, sim_stats.leaked_ml);
+	return 0;
+}
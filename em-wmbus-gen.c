@@ -0,0 +1,600 @@
+/*
+
+   em-wmbus-gen.c
+
+   Wireless M-Bus traffic generator for load-testing gateways: synthesizes
+   the telegrams of many virtual water meters, configured by the same
+   20 byte parameter blocks em-admin reads and writes (interval, month,
+   day and hour masks, OMS mode, frame type, radio and AES flags).
+
+	./em-wmbus-gen -n 1000000 -d 86400 -K keys.txt telegrams.emf
+	./em-wmbus-gen -n 5000 -x 1 unix:/run/gateway.sock
+
+   Parameter blocks are taken from a snapshot archive (-p, see em-admin
+   snapshot), round robin, or default to the EM_SET_* defines. Telegrams are
+   encrypted with a per-meter key derived from a master key, in security
+   mode 5 (AES-CBC, IV from address and access number) or 7 (AFL with
+   message counter and CMAC, keys derived per telegram) as selected by the
+   OMS mode of the parameters. Link layer CRCs are omitted, as delivered by
+   common receivers. Output is an em-frames.h stream to a file, stdout (-)
+   or a local socket, either as fast as possible or paced in (scaled) real
+   time. Duplicates (repeaters) and corrupted telegrams can be mixed in.
+
+   (C) 2025 Hajo Noerenberg
+
+   http://www.noerenberg.de/
+   https://github.com/hn/em-admin
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3.0 as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program. If not, see <http://www.gnu.org/licenses/gpl-3.0.txt>.
+
+*/
+
+#define main em_admin_main
+#include "em-admin.c"
+#undef main
+
+#include <sys/un.h>
+#include <openssl/evp.h>
+
+#include "em-frames.h"
+
+#define GEN_THREADS		64
+#define GEN_WINDOW		60		/* s of simulated time generated at once, 1 s when paced */
+#define GEN_MIN_INTERVAL	2		/* s */
+#define GEN_SECADR		0x10000000	/* addresses of meters beyond the snapshot archive */
+#define GEN_TELEGRAM_MAX	96
+#define GEN_REC_MAX		(sizeof(struct em_frame_rec) + GEN_TELEGRAM_MAX)
+
+#define WMBUS_C_SND_NR		0x44
+#define WMBUS_CI_TPL_SHORT	0x7a
+#define WMBUS_CI_AFL		0x90
+
+struct gen_meter {
+	uint32_t secadr;
+	uint8_t key[16];
+	const uint8_t *params;
+	uint8_t mode;				/* security mode 0, 5 or 7 */
+	uint8_t acc;				/* access number */
+	uint32_t mcr;				/* message counter, mode 7 */
+	uint32_t volume;			/* l */
+	uint32_t interval;			/* s */
+	uint64_t next_us;
+	uint64_t rng;
+};
+
+/* Calendar of the current window, shared by all meters */
+struct gen_window {
+	uint64_t start_us;
+	uint64_t end_us;
+	uint8_t cp32[4];			/* meter time */
+	uint16_t date;				/* packed as EM_ONDAY */
+	uint32_t month;				/* bit of the current month, day etc. */
+	uint32_t mday;
+	uint32_t wday;
+	uint32_t hour;
+};
+
+struct gen_idx {
+	uint64_t ts;
+	uint32_t off;
+};
+
+struct gen_thread {
+	pthread_t thread;
+	unsigned int first;
+	unsigned int last;
+	EVP_CIPHER_CTX *cbc;
+	EVP_CIPHER_CTX *ecb;
+	unsigned char *buf[2];
+	size_t len[2];
+	size_t cap[2];
+	struct gen_idx *idx[2];
+	size_t n[2];
+	size_t icap[2];
+	unsigned long telegrams;
+	unsigned long duplicates;
+	unsigned long corrupted;
+	unsigned long silent;			/* transmissions suppressed by the masks */
+};
+
+struct gen_meter *gen_meters;
+struct gen_thread gen_threads[GEN_THREADS];
+struct gen_window gen_window[2];
+pthread_barrier_t gen_barrier;
+unsigned int gen_nthreads = 1;
+uint64_t gen_end_us;
+double gen_duplicate = 0;			/* probability of a repeated telegram */
+double gen_corrupt = 0;				/* probability of bit errors in a telegram */
+volatile unsigned long gen_last = ULONG_MAX;	/* index of the last window, set before its barrier */
+
+uint64_t gen_random(uint64_t *s) {
+	*s ^= *s >> 12;
+	*s ^= *s << 25;
+	*s ^= *s >> 27;
+	return *s * 0x2545f4914f6cdd1dULL;
+}
+
+double gen_uniform(uint64_t *s) {
+	return (gen_random(s) >> 11) * 0x1.0p-53;
+}
+
+void gen_dbl(uint8_t *out, const uint8_t *in) {
+	uint8_t carry = in[0] >> 7;
+	for (int i = 0; i < 15; i++)
+		out[i] = in[i] << 1 | in[i + 1] >> 7;
+	out[15] = (in[15] << 1) ^ (carry ? 0x87 : 0);
+}
+
+/* AES-CMAC (RFC 4493) */
+void gen_cmac(EVP_CIPHER_CTX *ecb, const uint8_t *key, const uint8_t *msg, const size_t len, uint8_t *mac) {
+	uint8_t k[16] = { 0 }, x[16] = { 0 };
+	size_t n = len ? (len + 15) / 16 : 1;
+	int outl;
+
+	EVP_EncryptInit_ex(ecb, NULL, NULL, key, NULL);
+	EVP_EncryptUpdate(ecb, k, &outl, k, 16);
+	gen_dbl(k, k);
+	if (!len || (len % 16))
+		gen_dbl(k, k);
+	for (size_t b = 0; b < n; b++) {
+		for (size_t i = 0; i < 16; i++) {
+			size_t j = b * 16 + i;
+			x[i] ^= (j < len) ? msg[j] : (j == len) ? 0x80 : 0;
+			if (b == n - 1)
+				x[i] ^= k[i];
+		}
+		EVP_EncryptUpdate(ecb, x, &outl, x, 16);
+	}
+	memcpy(mac, x, 16);
+}
+
+/* OMS mode 7 key derivation, D = 0x00 (enc) or 0x01 (mac) | MCR | ID | 0x07 padding */
+void gen_kdf(EVP_CIPHER_CTX *ecb, const struct gen_meter *m, const uint8_t d, uint8_t *key) {
+	uint8_t in[16] = {
+		d, m->mcr, m->mcr >> 8, m->mcr >> 16, m->mcr >> 24,
+		m->secadr, m->secadr >> 8, m->secadr >> 16, m->secadr >> 24,
+		0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07
+	};
+	gen_cmac(ecb, m->key, in, sizeof(in), key);
+}
+
+int gen_allowed(const struct gen_meter *m, const struct gen_window *w) {
+	const uint8_t *p = m->params;
+	const unsigned int flags = EM_ENA_RADIO_AVAIL | EM_ENA_RADIO_ON;
+
+	if (((p[0] & flags) != flags) || !((p[6] << 8 | p[5]) & w->month) ||
+	    !(((uint32_t) p[10] << 24 | p[9] << 16 | p[8] << 8 | p[7]) & w->mday) || !(p[11] & w->wday) ||
+	    !((p[14] << 16 | p[13] << 8 | p[12]) & w->hour))
+		return 0;
+	if ((p[0] & EM_ENA_STARTDATE) && (w->date < (p[16] << 8 | p[15])))
+		return 0;
+	if ((p[0] & EM_ENA_STARTVOL) && (m->volume < (p[18] << 8 | p[17])))
+		return 0;
+	return 1;
+}
+
+/* One telegram of the meter, returns its length */
+size_t gen_telegram(struct gen_thread *t, struct gen_meter *m, const struct gen_window *w, unsigned char *f) {
+	uint8_t plain[64], kenc[16], kmac[16], iv[16], mac[16];
+	size_t p = 0, h = 0, afl = 0, tpl;
+	int outl;
+
+	/* application layer: volume, time, key date volume and date, error flags */
+	plain[p++] = 0x2f;
+	plain[p++] = 0x2f;
+	plain[p++] = 0x04;
+	plain[p++] = 0x13;
+	memcpy(plain + p, &m->volume, 4);
+	p += 4;
+	plain[p++] = 0x04;
+	plain[p++] = 0x6d;
+	memcpy(plain + p, w->cp32, 4);
+	p += 4;
+	if (m->params[2] == EM_FRAME_LONG) {
+		uint32_t keyvol = m->volume - m->volume / 16;
+		plain[p++] = 0x44;
+		plain[p++] = 0x13;
+		memcpy(plain + p, &keyvol, 4);
+		p += 4;
+		plain[p++] = 0x42;
+		plain[p++] = 0x6c;
+		plain[p++] = (EM_SET_KEYDAY_DAY | (((w->date >> 9) - 1) & 0b111) << 5);
+		plain[p++] = (EM_SET_KEYDAY_MONTH | (((w->date >> 9) - 1) & 0b1111000) << 1);
+		plain[p++] = 0x02;
+		plain[p++] = 0xfd;
+		plain[p++] = 0x17;
+		plain[p++] = 0x00;
+		plain[p++] = 0x00;
+	}
+	while (m->mode && (p % 16))
+		plain[p++] = 0x2f;
+
+	/* link layer */
+	f[h++] = 0;				/* L, set below */
+	f[h++] = WMBUS_C_SND_NR;
+	f[h++] = MBUS_MANUFACTURER('D', 'W', 'Z') & 0xff;
+	f[h++] = MBUS_MANUFACTURER('D', 'W', 'Z') >> 8;
+	f[h++] = m->secadr;
+	f[h++] = m->secadr >> 8;
+	f[h++] = m->secadr >> 16;
+	f[h++] = m->secadr >> 24;
+	f[h++] = 0x02;				/* Version */
+	f[h++] = MBUS_MEDIUM_WATER;
+
+	m->acc++;
+	if (m->mode == 7) {
+		m->mcr++;
+		afl = h;
+		f[h++] = WMBUS_CI_AFL;
+		h += 2;				/* FCL, set below */
+		f[h++] = 0x00;			/* MCL */
+		f[h++] = m->mcr;
+		f[h++] = m->mcr >> 8;
+		f[h++] = m->mcr >> 16;
+		f[h++] = m->mcr >> 24;
+		h += 8;				/* MAC, set below */
+	}
+
+	/* transport layer, short header */
+	tpl = h;
+	const unsigned int cfg = m->mode << 8 | (m->mode ? (p / 16) << 4 : 0);
+	f[h++] = WMBUS_CI_TPL_SHORT;
+	f[h++] = m->acc;
+	f[h++] = 0x00;				/* Status */
+	f[h++] = cfg;
+	f[h++] = cfg >> 8;
+	if (m->mode == 7)
+		f[h++] = 0x10;			/* CFG extension: KDF selection 1 */
+
+	if (m->mode == 5) {
+		memcpy(iv, f + 2, 8);
+		memset(iv + 8, m->acc, 8);
+		EVP_EncryptInit_ex(t->cbc, NULL, NULL, m->key, iv);
+		EVP_EncryptUpdate(t->cbc, f + h, &outl, plain, p);
+	} else if (m->mode == 7) {
+		memset(iv, 0, sizeof(iv));
+		gen_kdf(t->ecb, m, 0x00, kenc);
+		gen_kdf(t->ecb, m, 0x01, kmac);
+		EVP_EncryptInit_ex(t->cbc, NULL, NULL, kenc, iv);
+		EVP_EncryptUpdate(t->cbc, f + h, &outl, plain, p);
+	} else {
+		memcpy(f + h, plain, p);
+	}
+	h += p;
+
+	if (m->mode == 7) {
+		const unsigned int fcl = (1 << 13) | (1 << 12) | (1 << 10) | (h - afl - 3);	/* MCL, MCR, MAC present */
+		uint8_t macin[GEN_TELEGRAM_MAX];
+		f[afl + 1] = fcl;
+		f[afl + 2] = fcl >> 8;
+		memcpy(macin, f + afl + 3, 5);
+		memcpy(macin + 5, f + tpl, h - tpl);
+		gen_cmac(t->ecb, kmac, macin, 5 + h - tpl, mac);
+		memcpy(f + afl + 8, mac, 8);
+	}
+	f[0] = h - 1;
+	return h;
+}
+
+void gen_append(struct gen_thread *t, const int b, const uint64_t ts, const unsigned char *f, const size_t len, const uint8_t flags) {
+	struct em_frame_rec rec = { .ts_us = ts, .dir = EM_FRAME_RADIO, .flags = flags, .len = len };
+
+	if (t->len[b] + GEN_REC_MAX > t->cap[b]) {
+		t->cap[b] = t->cap[b] ? 2 * t->cap[b] : (1 << 20);
+		t->buf[b] = realloc(t->buf[b], t->cap[b]);
+	}
+	if (t->n[b] == t->icap[b]) {
+		t->icap[b] = t->icap[b] ? 2 * t->icap[b] : (1 << 14);
+		t->idx[b] = realloc(t->idx[b], t->icap[b] * sizeof(struct gen_idx));
+	}
+	if (!t->buf[b] || !t->idx[b]) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	t->idx[b][t->n[b]].ts = ts;
+	t->idx[b][t->n[b]++].off = t->len[b];
+	memcpy(t->buf[b] + t->len[b], &rec, sizeof(rec));
+	memcpy(t->buf[b] + t->len[b] + sizeof(rec), f, len);
+	t->len[b] += sizeof(rec) + len;
+}
+
+int gen_cmp_idx(const void *a, const void *b) {
+	const struct gen_idx *x = a, *y = b;
+	return (x->ts > y->ts) - (x->ts < y->ts);
+}
+
+/* All telegrams of the thread's meters within the window, sorted by time */
+void gen_fill(struct gen_thread *t, const int b) {
+	const struct gen_window *w = &gen_window[b];
+	unsigned char f[GEN_TELEGRAM_MAX];
+
+	t->len[b] = t->n[b] = 0;
+	for (unsigned int i = t->first; i < t->last; i++) {
+		struct gen_meter *m = &gen_meters[i];
+		while (m->next_us < w->end_us) {
+			uint64_t ts = m->next_us;
+
+			/* nominal interval with a little random deviation, as required by OMS */
+			m->next_us += m->interval * (uint64_t) (875000 + gen_random(&m->rng) % 250000);
+			m->volume += gen_random(&m->rng) % (m->interval / 60 + 2);
+			if (!gen_allowed(m, w)) {
+				t->silent++;
+				continue;
+			}
+
+			size_t len = gen_telegram(t, m, w, f);
+			uint8_t flags = 0;
+			if (gen_corrupt && (gen_uniform(&m->rng) < gen_corrupt)) {
+				unsigned int bits = 1 + gen_random(&m->rng) % 3;
+				for (unsigned int k = 0; k < bits; k++)
+					f[gen_random(&m->rng) % len] ^= 1 << (gen_random(&m->rng) % 8);
+				flags |= EM_FRAME_CORRUPT;
+				t->corrupted++;
+			}
+			gen_append(t, b, ts, f, len, flags);
+			t->telegrams++;
+
+			/* heard again through a repeater, a few ms later */
+			if (gen_duplicate && (gen_uniform(&m->rng) < gen_duplicate)) {
+				uint64_t dts = ts + 5000 + gen_random(&m->rng) % 100000;
+				gen_append(t, b, (dts < w->end_us) ? dts : w->end_us - 1, f, len, flags | EM_FRAME_DUPLICATE);
+				t->duplicates++;
+			}
+		}
+	}
+	qsort(t->idx[b], t->n[b], sizeof(struct gen_idx), gen_cmp_idx);
+}
+
+void gen_set_window(struct gen_window *w, const uint64_t start, const uint64_t len) {
+	time_t now = start / 1000000;
+	struct tm tm;
+
+	localtime_r(&now, &tm);
+	w->start_us = start;
+	w->end_us = (start + len < gen_end_us) ? start + len : gen_end_us;
+	w->cp32[0] = tm.tm_min;
+	w->cp32[1] = tm.tm_hour;
+	w->cp32[2] = ((tm.tm_year - 100) & 0b111) << 5 | tm.tm_mday;
+	w->cp32[3] = ((tm.tm_year - 100) & 0b1111000) << 1 | (tm.tm_mon + 1);
+	w->date = (tm.tm_year - 100) << 9 | (tm.tm_mon + 1) << 5 | tm.tm_mday;
+	w->month = 1 << tm.tm_mon;
+	w->mday = 1 << (tm.tm_mday - 1);
+	w->wday = 1 << ((tm.tm_wday + 6) % 7);
+	w->hour = 1 << tm.tm_hour;
+}
+
+/* Generate window n + 1 while the main thread writes window n */
+void *gen_worker(void *arg) {
+	struct gen_thread *t = arg;
+	for (unsigned long k = 0; ; k++) {
+		gen_fill(t, k & 1);
+		pthread_barrier_wait(&gen_barrier);
+		if (k >= gen_last)
+			break;
+	}
+	return NULL;
+}
+
+FILE *gen_output(const char *path) {
+	if (!strcmp(path, "-"))
+		return stdout;
+	if (!strncmp(path, "unix:", 5)) {
+		struct sockaddr_un sa = { .sun_family = AF_UNIX };
+		int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", path + 5);
+		if ((fd < 0) || connect(fd, (struct sockaddr *) &sa, sizeof(sa))) {
+			fprintf(stderr, "Failed to connect to '%s': %s\n", path + 5, strerror(errno));
+			return NULL;
+		}
+		return fdopen(fd, "w");
+	}
+	FILE *f = fopen(path, "w");
+	if (!f)
+		fprintf(stderr, "Failed to open '%s': %s\n", path, strerror(errno));
+	return f;
+}
+
+int gen_hexkey(const char *hex, uint8_t *key) {
+	for (int i = 0; i < 16; i++)
+		if (sscanf(hex + 2 * i, "%2hhx", &key[i]) != 1)
+			return -1;
+	return hex[32] ? -1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+	const char *archive = NULL, *keyfile = NULL;
+	const struct em_snapshot *sn = NULL;
+	unsigned long n = 1000;
+	double duration = 3600, speed = 0;
+	uint64_t seed = 1;
+	uint8_t master[16] = {
+		0xbc, 0x10, 0x66, 0xea, 0x5b, 0xff, 0xdc, 0xab, 0x41, 0x93, 0xd1, 0xcd, 0x34, 0x9f, 0x4f, 0x89
+	};
+	size_t size;
+	int sn_fd;
+	int opt;
+
+	gen_nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "n:d:p:k:K:D:C:x:s:j:")) != -1) {
+		switch (opt) {
+		case 'n': n = strtoul(optarg, NULL, 0); break;
+		case 'd': duration = atof(optarg); break;
+		case 'p': archive = optarg; break;
+		case 'k':
+			if (gen_hexkey(optarg, master)) n = 0;
+			break;
+		case 'K': keyfile = optarg; break;
+		case 'D': gen_duplicate = atof(optarg); break;
+		case 'C': gen_corrupt = atof(optarg); break;
+		case 'x': speed = atof(optarg); break;
+		case 's': seed = strtoull(optarg, NULL, 0); break;
+		case 'j': gen_nthreads = atoi(optarg); break;
+		default: n = 0;
+		}
+	}
+	if (!n || (optind != argc - 1) || (duration <= 0)) {
+		fprintf(stderr, "Usage: %s [-n meters] [-d seconds] [-p snapshot archive] [-k master key] [-K key file]\n"
+			"       [-D duplicate probability] [-C corruption probability] [-x speed, 1 = real time]\n"
+			"       [-s seed] [-j threads] <file|-|unix:socket>\n", argv[0]);
+		return 1;
+	}
+	if ((gen_nthreads < 1) || (gen_nthreads > GEN_THREADS))
+		gen_nthreads = 1;
+	if (gen_nthreads > n)
+		gen_nthreads = n;
+
+	/* the shared lock is held until exit */
+	if (archive && !(sn = em_snapshot_map(archive, &size, &sn_fd)))
+		return 1;
+	if (sn && !sn->count) {
+		fprintf(stderr, "Snapshot archive '%s' is empty\n", archive);
+		return 1;
+	}
+
+	FILE *out = gen_output(argv[optind]);
+	FILE *keys = keyfile ? fopen(keyfile, "w") : NULL;
+	if (!out || (keyfile && !keys)) {
+		if (keyfile && !keys) fprintf(stderr, "Failed to open '%s': %s\n", keyfile, strerror(errno));
+		return 1;
+	}
+	setvbuf(out, NULL, _IOFBF, 1 << 20);
+
+	if (!(gen_meters = calloc(n, sizeof(*gen_meters)))) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	/* per-meter keys: AES-ECB of the secondary address under the master key */
+	struct timespec ts0;
+	clock_gettime(CLOCK_REALTIME, &ts0);
+	const uint64_t start = ts0.tv_sec * 1000000ULL + ts0.tv_nsec / 1000;
+	EVP_CIPHER_CTX *ecb = EVP_CIPHER_CTX_new();
+	EVP_EncryptInit_ex(ecb, EVP_aes_128_ecb(), NULL, master, NULL);
+	EVP_CIPHER_CTX_set_padding(ecb, 0);
+	for (unsigned long i = 0; i < n; i++) {
+		struct gen_meter *m = &gen_meters[i];
+		uint8_t in[16] = { 0 };
+		int outl;
+
+		m->params = sn ? sn->rec[i % sn->count].params : em_default_params;
+		m->secadr = (sn && (i < sn->count)) ? sn->rec[i].secadr : GEN_SECADR + i;
+		m->mode = !(m->params[0] & EM_ENA_AES) ? 0 :
+			  ((m->params[1] == EM_OMSMODE_T1_OMS4_ENC7) || (m->params[1] == EM_OMSMODE_C1_OMS4_ENC7)) ? 7 : 5;
+		m->interval = m->params[4] << 8 | m->params[3];
+		if (m->interval < GEN_MIN_INTERVAL)
+			m->interval = GEN_MIN_INTERVAL;
+		m->rng = (seed + i) * 0x9e3779b97f4a7c15ULL ?: 1;
+		m->acc = gen_random(&m->rng);
+		m->volume = gen_random(&m->rng) % 500000;
+		m->next_us = start + gen_random(&m->rng) % (m->interval * 1000000ULL);	/* random phase */
+		memcpy(in, &m->secadr, 4);
+		EVP_EncryptUpdate(ecb, m->key, &outl, in, 16);
+		if (keys) {
+			fprintf(keys, "%08x ", m->secadr);
+			for (int k = 0; k < 16; k++) fprintf(keys, "%02X", m->key[k]);
+			fprintf(keys, "\n");
+		}
+	}
+	if (keys)
+		fclose(keys);
+
+	struct em_frames_hdr hdr = { .magic = EM_FRAMES_MAGIC };
+	fwrite(&hdr, sizeof(hdr), 1, out);
+
+	gen_end_us = start + duration * 1e6;
+	const uint64_t window = (speed > 0) ? 1000000 : GEN_WINDOW * 1000000ULL;
+	pthread_barrier_init(&gen_barrier, NULL, gen_nthreads + 1);
+	for (unsigned int i = 0; i < gen_nthreads; i++) {
+		struct gen_thread *t = &gen_threads[i];
+		t->first = n * i / gen_nthreads;
+		t->last = n * (i + 1) / gen_nthreads;
+		t->cbc = EVP_CIPHER_CTX_new();
+		t->ecb = EVP_CIPHER_CTX_new();
+		EVP_EncryptInit_ex(t->cbc, EVP_aes_128_cbc(), NULL, master, master);
+		EVP_EncryptInit_ex(t->ecb, EVP_aes_128_ecb(), NULL, master, NULL);
+		EVP_CIPHER_CTX_set_padding(t->cbc, 0);
+		EVP_CIPHER_CTX_set_padding(t->ecb, 0);
+	}
+	gen_set_window(&gen_window[0], start, window);
+	for (unsigned int i = 0; i < gen_nthreads; i++)
+		pthread_create(&gen_threads[i].thread, NULL, gen_worker, &gen_threads[i]);
+
+	const double t0 = em_now();
+	unsigned long written = 0;
+	int failed = 0;
+	for (unsigned long k = 0; ; k++) {
+		/* window k is complete, let the workers start on the next one */
+		const int b = k & 1;
+		const uint64_t next = gen_window[b].end_us;
+		if (next < gen_end_us)
+			gen_set_window(&gen_window[b ^ 1], next, window);
+		else
+			gen_last = k;
+		pthread_barrier_wait(&gen_barrier);
+
+		/* merge the sorted per-thread lists */
+		size_t pos[GEN_THREADS] = { 0 };
+		for (;;) {
+			struct gen_thread *best = NULL;
+			for (unsigned int i = 0; i < gen_nthreads; i++) {
+				struct gen_thread *t = &gen_threads[i];
+				if ((pos[i] < t->n[b]) && (!best || (t->idx[b][pos[i]].ts < best->idx[b][pos[best - gen_threads]].ts)))
+					best = t;
+			}
+			if (!best)
+				break;
+			const struct gen_idx *x = &best->idx[b][pos[best - gen_threads]++];
+			const struct em_frame_rec *rec = (const struct em_frame_rec *) (best->buf[b] + x->off);
+
+			if (speed > 0) {
+				double due = t0 + (x->ts - start) / 1e6 / speed, now = em_now();
+				if (due > now) {
+					struct timespec d = { (time_t) (due - now), (long) ((due - now - (time_t) (due - now)) * 1e9) };
+					fflush(out);
+					nanosleep(&d, NULL);
+				}
+			}
+			if (fwrite(rec, sizeof(*rec) + rec->len, 1, out) != 1) {
+				failed = 1;
+				break;
+			}
+			written++;
+		}
+		if (k == gen_last)
+			break;
+		if (failed) {
+			/* the workers are filling window k + 1 */
+			gen_last = k + 1;
+			pthread_barrier_wait(&gen_barrier);
+			break;
+		}
+	}
+	for (unsigned int i = 0; i < gen_nthreads; i++)
+		pthread_join(gen_threads[i].thread, NULL);
+	if (fflush(out) || failed) {
+		fprintf(stderr, "Failed to write telegrams: %s\n", strerror(errno));
+		return 1;
+	}
+
+	unsigned long dups = 0, corrupt = 0, silent = 0;
+	for (unsigned int i = 0; i < gen_nthreads; i++) {
+		dups += gen_threads[i].duplicates;
+		corrupt += gen_threads[i].corrupted;
+		silent += gen_threads[i].silent;
+	}
+	const double t = em_now() - t0;
+	fprintf(stderr, "%lu telegrams (%lu duplicates, %lu corrupted, %lu suppressed by masks) of %lu meters "
+		"over %.0f s in %.3f s, %.0f telegrams/s with %u threads\n",
+		written, dups, corrupt, silent, n, duration, t, written / t, gen_nthreads);
+	return 0;
+}